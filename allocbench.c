@@ -0,0 +1,210 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the memory backing of a large
+ bucket table allocated by hugeAlloc().
+
+ Consumes tokens from random buckets of a table
+ in normal pages and then in huge pages, and
+ reports the time and the data TLB misses per
+ access. The misses are read with perf_event_open
+ on linux, n/a is printed where the counter is not
+ available.
+
+ The table is placed on the given NUMA node while
+ the benchmark runs on the current one, so running
+ it with a local and a remote node shows the cost
+ of remote memory.
+
+ Usage: allocbench [buckets] [accesses] [node]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+
+#define DEFAULT_BUCKETS (4UL * 1024 * 1024)
+#define DEFAULT_ACCESSES 20000000UL
+
+static const struct rate_class defclass = RATE_CLASS_DEFAULT;
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Opens a data TLB read miss counter, returns -1 if unavailable */
+static int openTlbCounter(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.type = PERF_TYPE_HW_CACHE;
+   attr.size = sizeof(attr);
+   attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+
+   return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+   return -1;
+#endif
+}
+
+
+static void startCounter(int fd)
+{
+#ifdef __linux__
+   if(fd >= 0)
+   {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+   }
+#else
+   (void) fd;
+#endif
+}
+
+
+/* Returns the counted misses, -1 if there is no counter */
+static long long stopCounter(int fd)
+{
+   long long count = -1;
+
+#ifdef __linux__
+   if(fd >= 0)
+   {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if(read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+         count = -1;
+   }
+#else
+   (void) fd;
+#endif
+
+   return count;
+}
+
+
+/* Runs the accesses on a table in the current page mode */
+static void runTable(const char *label, size_t nbuckets, size_t accesses, int node, int fd)
+{
+   static const char *pages[] = { "normal", "transparent huge", "huge" };
+   struct ip4bucket *table;
+   unsigned long long start, now, allowed=0;
+   unsigned int seed = 2017;
+   size_t i, size;
+   long long misses;
+   double t;
+   int huge;
+   rate_state_t seen;
+
+   size = nbuckets * sizeof(struct ip4bucket);
+   table = hugeAlloc(size, node, &huge);
+   if(table == NULL)
+   {
+      fprintf(stderr, "Unable to allocate %zu bytes\n", size);
+      exit(EXIT_FAILURE);
+   }
+
+   now = rate_now();
+   for(i=0;i<nbuckets;i++)
+      rate_init(&table[i].state, &defclass, now);
+
+   start = monotonicNow();
+   startCounter(fd);
+   for(i=0;i<accesses;i++)
+   {
+      if(rate_consume_atomic(&table[nextRandom(&seed) % nbuckets].state, 1, &defclass, now, &seen))
+         allowed++;
+   }
+   misses = stopCounter(fd);
+   t = (double)(monotonicNow() - start);
+
+   printf("%-7s %-17s %10.2f ", label, pages[huge], t / accesses);
+   if(misses >= 0)
+      printf("%16.4f", (double)misses / accesses);
+   else
+      printf("%16s", "n/a");
+   printf("  (allowed %llu)\n", allowed);
+
+   hugeFree(table, size);
+}
+
+
+int main(int argc, char* argv[])
+{
+   size_t nbuckets = DEFAULT_BUCKETS, accesses = DEFAULT_ACCESSES;
+   int node = -1, fd;
+
+   if(argc > 1)
+      nbuckets = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      accesses = strtoul(argv[2], NULL, 10);
+   if(argc > 3)
+      node = atoi(argv[3]);
+
+   if(nbuckets == 0 || accesses == 0)
+   {
+       fprintf(stderr,"Usage: %s [buckets] [accesses] [node]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   fd = openTlbCounter();
+
+   printf("Buckets: %zu (%zu MiB) table node: %d running on node: %d\n",
+          nbuckets, nbuckets * sizeof(struct ip4bucket) >> 20,
+          node < 0 ? currentNode() : node, currentNode());
+   printf("request pages             ns/access  dTLB misses/access\n");
+
+   setHugePages(0);
+   runTable("normal", nbuckets, accesses, node, fd);
+   setHugePages(1);
+   runTable("huge", nbuckets, accesses, node, fd);
+
+   if(fd >= 0)
+      close(fd);
+
+   return 0;
+}
@@ -0,0 +1,139 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the batched lookup consumeBatch()
+
+ Fills a hash table to capacity and consumes
+ tokens from random buckets, one consumeBucket()
+ at a time and with consumeBatch() for batch
+ sizes from 1 to BATCH_MAX. The table should be
+ larger than the last level cache so that most
+ lookups miss it.
+
+ Usage: batchbench [slots] [lookups]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_SLOTS (16UL * 1024 * 1024)
+#define DEFAULT_LOOKUPS 8000000UL
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Distinct non zero keys, bijection modulo 2^32 */
+static unsigned int benchKey(size_t i)
+{
+   return (unsigned int)((i + 1) * 2654435761U);
+}
+
+
+/* Returns ns per lookup for batches of size batch, 0 for consumeBucket() */
+static double runBatch(size_t batch, size_t lookups, size_t capacity)
+{
+   unsigned int keys[BATCH_MAX];
+   int results[BATCH_MAX], costs[BATCH_MAX];
+   rate_state_t seen[BATCH_MAX];
+   unsigned int seed = 2017;
+   unsigned long long start, now;
+   size_t i, j, n;
+   volatile int allowed = 0;
+
+   n = batch == 0 ? 1 : batch;
+   for(j=0;j<n;j++)
+      costs[j] = 1;
+   now = rate_now();
+   start = monotonicNow();
+   for(i=0;i<lookups;i+=n)
+   {
+      for(j=0;j<n;j++)
+         keys[j] = benchKey(nextRandom(&seed) % capacity);
+
+      if(batch == 0)
+         results[0] = consumeBucket(keys[0], 1, now, &seen[0]);
+      else
+         consumeBatch(keys, costs, n, now, results, seen);
+
+      for(j=0;j<n;j++)
+         allowed += results[j] > 0;
+   }
+
+   return (double)(monotonicNow() - start) / (double)i;
+}
+
+
+int main(int argc, char* argv[])
+{
+   static const char *pages[] = { "normal", "transparent huge", "huge" };
+   struct ip4bucket b;
+   struct ht_stats st;
+   size_t slots = DEFAULT_SLOTS, lookups = DEFAULT_LOOKUPS, i, batch;
+
+   if(argc > 1)
+      slots = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      lookups = strtoul(argv[2], NULL, 10);
+
+   if(slots == 0 || lookups == 0)
+   {
+       fprintf(stderr,"Usage: %s [slots] [lookups]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   if(!initHashTable(slots))
+      exit(EXIT_FAILURE);
+
+   getHashStats(&st);
+   for(i=0;i<st.capacity;i++)
+   {
+      empty_ip4_bucket(&b);
+      rate_init(&b.state, &rate_classes[0], rate_now());
+      put(benchKey(i), b);
+   }
+
+   printf("Slots: %zu buckets: %zu table: %zu MiB in %s pages\n",
+          st.slots, st.capacity, st.slots * sizeof(struct ip4bucket) >> 20,
+          pages[st.huge]);
+   printf("batch  ns/lookup\n");
+   printf("%5s  %9.2f\n", "none", runBatch(0, lookups, st.capacity));
+   for(batch=1;batch<=BATCH_MAX;batch*=2)
+      printf("%5zu  %9.2f\n", batch, runBatch(batch, lookups, st.capacity));
+
+   return 0;
+}
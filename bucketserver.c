@@ -37,52 +37,156 @@ April 2017
 */
 
 #include "ratelimit.h"
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+
+#define LISTEN_PORT "3211"
+
+/* 
+ A worker processes the requests of its queue. 
+ With -w each worker also has its own ipv4 socket
+ of a reuseport group, which gets the requests 
+ for its keys. strays counts the ipv4 requests 
+ for keys of other workers, if steering fails. 
+ Worker 0 also gets the ipv6 and unix requests. 
+ topk tracks the heaviest ipv4 keys of the worker. 
+*/
+struct worker
+{
+ struct queue *queue;
+ int socket;
+ unsigned long strays;
+ struct topk *topk;
+};
+
+static struct worker workers[WORKERS_MAX];
+static int nworkers = 1;
+
+static int limitmode = LIMIT_EXACT;
+static size_t tableslots = HASHSZ;
+static const char *prefixfile;
+static const char *classfile;
+static const char *listfile;
+
+/* name of the shared memory segment of the hash table, NULL if not shared */
+static const char *shmname;
+
+/* set by SIGHUP, the update thread then reloads the ip lists */
+static volatile sig_atomic_t reloadlists;
+
+/* dump of -o, written by the update thread after a SIGUSR1, and preload of -i */
+static const char *dumpfile;
+static const char *preloadfile;
+static volatile sig_atomic_t dumprequested;
+static int ip6prefix = IP6_PREFIX;
+
+/* global budget in tokens per second, 0 if there is none */
+static unsigned long budgetrate;
+
+/* maximum delay of a shaped request in ms, 0 if requests are not shaped */
+static unsigned long maxdelay;
+
+/* monotonic time of the last refill by the update thread */
+static unsigned long long refilltime;
+
+/* trace file of the queries, NULL if they are not recorded */
+static const char *tracefile;
+
+/* path of the unix datagram socket, NULL if there is none */
+static const char *unixpath;
+
+/* listening sockets for ipv4, ipv6 and unix clients, -1 if not bound */
+#define SOCKET_IP4 0
+#define SOCKET_IP6 1
+#define SOCKET_UNIX 2
+#define SOCKETS 3
+static int serversockets[SOCKETS] = { -1, -1, -1 };
+
+/* 
+ cpus of the busy polling mode, none if the threads
+ sleep. The receiving thread of worker i is pinned to 
+ cpu 2i and its processing thread to cpu 2i + 1 of 
+ the list, which wraps around if it is shorter. 
+*/
+static int busycpus[BUSY_CPUS_MAX];
+static int nbusycpus;
+
+/* set by the processing thread once its memory is allocated */
+static int started;
+static pthread_mutex_t startlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startcond = PTHREAD_COND_INITIALIZER;
 
 
 /* 
-Setup and binds the UDP server socket to a host and port
-Takes a host, port string as well as a pointer to the
-serversocket as parameters.  
+Setup and binds a UDP server socket of the address
+family family to a host and port. 
+Takes a host, port string, the family, whether the
+port is shared by a reuseport group as well as a 
+pointer to the serversocket as parameters.  
+Returns 1 if successful, 0 otherwise
 */
-void bindSocket(const char* host, const char* port, int *serversocket)
+int bindSocket(const char* host, const char* port, int family, int reuseport,
+               int *serversocket)
 {
 
-  int status=0;
+  int status=0, on=1;
   struct addrinfo hints;
   struct addrinfo *serverip;
+  void *addr;
+  char ipstr[INET6_ADDRSTRLEN];
  
   memset(&hints,0, sizeof(struct addrinfo));
-  hints.ai_family=AF_INET;
+  hints.ai_family=family;
   hints.ai_socktype = SOCK_DGRAM;
 
   if ((status=getaddrinfo(host, port, &hints, &serverip)) != 0)
   {
      fprintf(stderr, "Unable to obtain ip information, getaddrinfo error: %s\n", 
      gai_strerror(status));
-     exit(EXIT_FAILURE);
+     return 0;
   }
 
   if(serverip->ai_family == AF_INET)
-  {
-       struct sockaddr_in *ipv4 =  (struct sockaddr_in *)serverip->ai_addr;
-       void *addr = &(ipv4->sin_addr);
-       char ipstr[INET6_ADDRSTRLEN];
-       if( inet_ntop(serverip->ai_family, addr, ipstr, INET6_ADDRSTRLEN) == NULL)
-       {
-           fprintf(stderr, "Error converting ip address to string\n");
-           exit(EXIT_FAILURE);   
-       }
-
-       printf("%s %s %s %s\n", "Using local ip:", ipstr, " UDP port:", port);
-  }
+     addr = &((struct sockaddr_in *)serverip->ai_addr)->sin_addr;
   else
+     addr = &((struct sockaddr_in6 *)serverip->ai_addr)->sin6_addr;
+
+  if( inet_ntop(serverip->ai_family, addr, ipstr, INET6_ADDRSTRLEN) == NULL)
   {
-      fprintf(stderr, "Program currently don't support Ipv6 yet !\n");
-      exit(EXIT_FAILURE);
+      fprintf(stderr, "Error converting ip address to string\n");
+      freeaddrinfo(serverip);
+      return 0;
   }
 
+  printf("%s %s %s %s\n", "Using local ip:", ipstr, " UDP port:", port);
+
   *serversocket = socket(serverip->ai_family, serverip->ai_socktype,
                 serverip->ai_protocol);
+  if(*serversocket == -1)
+  {
+      fprintf(stderr, "Unable to create socket\n");
+      freeaddrinfo(serverip);
+      return 0;
+  }
+
+  //the ipv4 socket serves the ipv4 clients
+  if(serverip->ai_family == AF_INET6)
+     setsockopt(*serversocket, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+
+  if(reuseport && 
+     setsockopt(*serversocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+  {
+      fprintf(stderr, "Unable to share the port\n");
+      close(*serversocket);
+      *serversocket = -1;
+      freeaddrinfo(serverip);
+      return 0;
+  }
 
   if (bind(*serversocket, serverip->ai_addr, serverip->ai_addrlen) == 0)
   {
@@ -91,144 +195,364 @@ void bindSocket(const char* host, const char* port, int *serversocket)
   else
   {
       fprintf(stderr, "Unable to bind to address and port\n");
-      exit(EXIT_FAILURE);
+      close(*serversocket);
+      *serversocket = -1;
+      freeaddrinfo(serverip);
+      return 0;
   }
 
   freeaddrinfo(serverip);
+  return 1;
+
+}
+
 
+
+/* Returns the nanoseconds until the next refill by the update thread */
+static unsigned long long nextRefill(void)
+{
+   unsigned long long next, clock = monotonicNow();
+
+   next = __atomic_load_n(&refilltime, __ATOMIC_RELAXED) + 
+          SLEEP_INTERVAL * NSEC_PER_SEC;
+   return next > clock ? next - clock : 0;
 }
 
 
 /* 
- Validates that a ip message string is valid
- Returns 0 for invalid ip string or
- the unsigned int representation 
- of the ip4 string message. 
-*/  
-unsigned int validateMessage(const char *msg)
+Setup and binds a unix datagram server socket
+to path, replacing a socket left there by an
+earlier server. Local clients bind their own
+socket to receive the replies. 
+Returns 1 if successful, 0 otherwise
+*/
+int bindUnixSocket(const char *path, int *serversocket)
 {
-  unsigned int ret=0;
-  if(strlen(msg) > (IP4_CHAR_LEN - 1) )
+  struct sockaddr_un addr;
+
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+      fprintf(stderr, "Unix socket path too long %s\n", path);
+      return 0;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  *serversocket = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if(*serversocket == -1)
+  {
+      fprintf(stderr, "Unable to create unix socket\n");
+      return 0;
+  }
+
+  unlink(path);
+  if(bind(*serversocket, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+     chmod(path, 0660) != 0)
   {
-     fprintf(stderr, "Invalid ip message %s %zu\n", msg, strlen(msg)); 
-     return ret;
+      fprintf(stderr, "Unable to bind to unix socket %s\n", path);
+      close(*serversocket);
+      *serversocket = -1;
+      return 0;
   }
 
-  ret=parseIP4(msg); 
-  if(ret==0)
-      fprintf(stderr, "Invalid key %s %u\n", msg, ret); 
-         
-  return ret; 
+  printf("Using unix socket: %s\n", path);
+  return 1;
+}
+
+
+/* Returns the listening socket of the clients of family */
+static int familySocket(int family)
+{
+   if(family == AF_UNIX)
+      return serversockets[SOCKET_UNIX];
+   return serversockets[family == AF_INET6 ? SOCKET_IP6 : SOCKET_IP4];
 }
 
+
 /* 
-Creates a new ip bucket and add to
-hashtable. Takes the unsigned int key k 
-and ip message string as parameters. 
-Returns 1 if successful,
-0 otherwise
+Sends the reply r to the peer of the queue 
+item from the socket of its address family. 
+The reply is OK or NOK, or WAIT for a request
+that is allowed once it has been delayed, 
+followed by the tokens left and the wait in 
+milliseconds, e.g. "OK 42 1200", "NOK 0 2400" 
+or "WAIT 0 300". 
 */
-size_t addNewBucket(unsigned int k, const char *msg)
+void sendResponse(struct queue_item *p, const struct rate_reply *r)
 {
-  struct ip4bucket ip_bucket;
-  size_t i, len;
+   char buf[48];
+   const char *verb = r->shaped ? "WAIT" : r->allowed ? "OK" : "NOK";
+   int len;
+   int serversocket = familySocket(p->peer_addr.ss_family);
 
-  len=strlen(msg);
-  
-  if(msg == NULL || len >= IP4_CHAR_LEN )
-     return 0;
+   len = rate_reply_format(buf, sizeof(buf), r);
+
+   //a unix client that does not read its replies must not stall the processing
+   if(sendto(serversocket, buf, (size_t)len, MSG_DONTWAIT,
+     (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != len)
+         fprintf(stderr, "Error sending %s response\n", verb);
+}
 
-  empty_ip4_bucket(&ip_bucket);
-  ip_bucket.ipv4=k;
-  ip_bucket.count=MAX_TOKENS - 1;
 
-  for(i=0;i<len;i++)
-    ip_bucket.addr[i] = msg[i];
-  
-  ip_bucket.addr[i] = '\0';
-            
-  return put(ip_bucket.ipv4, ip_bucket);
+/* Pins the calling thread to cpu n of the busy polling list */
+static void pinBusyThread(int n)
+{
+   if(nbusycpus > 0)
+      pinThread(busycpus[n % nbusycpus]);
+}
+
 
+/* Tells main() whether the processing thread is ready, 1 or -1 */
+static void setStarted(int status)
+{
+   pthread_mutex_lock(&startlock);
+   started = status;
+   pthread_mutex_unlock(&startlock);
+   pthread_cond_signal(&startcond);
 }
 
 
+/* Waits for the processing thread, returns 1 if it is ready */
+static int waitStarted(void)
+{
+   int status;
 
-/* 
-Processing thread, consumes items from the input queue 
-and process it. Takes the serversocket descriptor 
-as threat argument. Sends udp response Ok if rate limit 
-is not exceeded otherwise sends NOK. 
+   pthread_mutex_lock(&startlock);
+   while(started == 0)
+      pthread_cond_wait(&startcond, &startlock);
+   status = started;
+   pthread_mutex_unlock(&startlock);
+
+   return status == 1;
+}
+
+
+/*
+Reads the rate classes from the file given
+with -c and the prefix rules from the file
+given with -p, if any, and builds the prefix
+table of both. 
+Returns 1 if successful, 0 otherwise
 */
-void *processing(void *arg)
+static int initPrefixLimits(void)
 {
-   struct queue_item *p;
-   struct ip4bucket *ipb;
-   int status; 
-   int *serversocket; 
-   unsigned int k;
-   char *ok = "OK";
-   char *nok = "NOK";
-  
-   serversocket = (int *) arg; 
-    
+   FILE *fp;
+   int n;
 
-   while(1)
+   if(classfile != NULL)
    {
-      p=dequeue(&input_queue);
-      if(p!=NULL)
+      fp = fopen(classfile, "r");
+      if(fp == NULL)
       {
-         if( (k = validateMessage(p->msg)) == 0 )
-            continue;      
+         fprintf(stderr, "Unable to open rate classes %s\n", classfile);
+         return 0;
+      }
 
-         ipb = get(k);
-         if(ipb == NULL)
-         {//bucket not present in hash table
- 
-            if(addNewBucket(k,p->msg))
-            {
-               if(sendto(*serversocket, ok, 3, 0,
-                 (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != 3)
-                     fprintf(stderr, "Error sending ok response\n");
-            }
-            else
-            {
-               fprintf(stderr, "Unable to add to hash table\n");
-               if(sendto(*serversocket, nok, 4, 0,
-                 (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != 4)
-                     fprintf(stderr, "Error sending nok response\n");
-            }
+      n = loadClasses(fp);
+      fclose(fp);
+      if(n < 0)
+         return 0;
 
-         }
-         else
-         {//bucket already exists
-             status=0;
-             pthread_mutex_lock(&ht_datalock); //lock data
-             if (ipb->count > 0 )
-             {
-                 ipb->count--;
-                 status=1;
-             }
-             pthread_mutex_unlock(&ht_datalock); //unlock data
-
-            if(status)
-            {//within rate limit
-                 if(sendto(*serversocket, ok, 3, 0,
-                   (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != 3)
-                      fprintf(stderr, "Error sending ok response\n");
-               
-            }
-            else
-            {//exceeds rate limit
-
-               if(sendto(*serversocket, nok, 4, 0,
-                 (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != 4)
-                     fprintf(stderr, "Error sending nok response\n");
-            }
+      printf("Loaded %d rate classes\n", n);
+   }
+
+   if(prefixfile != NULL)
+   {
+      fp = fopen(prefixfile, "r");
+      if(fp == NULL)
+      {
+         fprintf(stderr, "Unable to open prefix rules %s\n", prefixfile);
+         return 0;
+      }
 
+      n = loadPrefixes(fp);
+      fclose(fp);
+      if(n < 0)
+         return 0;
+
+      printf("Loaded %d prefix rules\n", n);
+   }
+
+   if(maxdelay > 0)
+   {
+      for(n=0;n<classCount();n++)
+      {
+         rate_class_shape(&rate_classes[n], maxdelay * NSEC_PER_MSEC);
+         if(!rate_class_fits(&rate_classes[n]))
+         {
+            fprintf(stderr, "Delay of %lu ms out of range for class %s with %s\n", 
+                    maxdelay, className(n), RATE_ALGO_NAME);
+            return 0;
          }
+      }
+      printf("Shaping requests with delays of up to %lu ms\n", maxdelay);
+   }
+
+   n = buildPrefixes();
+   if(n < 0)
+      return 0;
+
+   if(n > 0)
+      printf("Prefix table of %d prefixes\n", n);
+   return 1;
+}
+
+
+/*
+Allocates the input queue, the hash table,
+the sketch and the prefix table. 
+Done by the processing thread so that the memory
+is placed on the NUMA node it runs on. 
+Returns 1 if successful, 0 otherwise
+*/
+static int initProcessing(void)
+{
+   static const char *pages[] = { "normal", "transparent huge", "huge" };
+   struct ht_stats st;
+   unsigned long long start;
+   long n;
+   int i, flags;
 
+   printf("Initializing queues\n");
+   for(i=0;i<nworkers;i++)
+   {
+      workers[i].queue = newQueue(nbusycpus > 0);
+      workers[i].topk = newTopK();
+      if(workers[i].queue == NULL || workers[i].topk == NULL)
+      {
+         fprintf(stderr, "Unable to allocate input queue\n");
+         return 0;
       }
-   
+   }
+
+   if(shmname != NULL && !initShm(shmname))
+      return 0;
+
+   printf("Initializing hash tables\n");
+   if(!initHashTable(tableslots))
+      return 0;
+
+   getHashStats(&st);
+   printf("Hash table %zu slots, capacity %zu, node %d, %s pages\n",
+          st.slots, st.capacity, currentNode(), pages[st.huge]);
+
+   if(!initHashTable6(tableslots))
+      return 0;
+
+   getHashStats6(&st);
+   printf("IPv6 hash table %zu slots, capacity %zu, keys /%d, %s pages\n",
+          st.slots, st.capacity, ip6prefix, pages[st.huge]);
+
+   if(!initScopes() || !initScopeTable(tableslots))
+      return 0;
+
+   getScopeStats(&st);
+   printf("Scoped hash table %zu slots, capacity %zu, %d scopes, %s pages\n",
+          st.slots, st.capacity, SCOPE_MAX, pages[st.huge]);
+
+   if(limitmode != LIMIT_EXACT)
+   {
+      printf("Initializing count-min sketch\n");
+      if(!initSketch())
+         return 0;
+   }
+
+   if(listfile != NULL)
+   {
+      n = loadLists(listfile);
+      if(n < 0)
+         return 0;
+      printf("Loaded ip lists of %ld ranges\n", n);
+   }
+
+   if(budgetrate > 0)
+   {
+      printf("Global budget of %lu tokens per second\n", budgetrate);
+      if(!initBudget(budgetrate))
+         return 0;
+   }
+
+   if(!initPrefixLimits())
+      return 0;
+
+   if(preloadfile != NULL)
+   {
+      start = monotonicNow();
+      n = loadDump(preloadfile);
+      if(n < 0)
+         return 0;
+      printf("Loaded %ld buckets from %s in %.1f ms\n", n, preloadfile, 
+             (double)(monotonicNow() - start) / NSEC_PER_MSEC);
+   }
+
+   if(shmname != NULL)
+   {//clients can only decide what the ip bucket alone decides, and a trace needs every query
+      flags = limitmode == LIMIT_EXACT && listfile == NULL && 
+              budgetrate == 0 && prefixfile == NULL && tracefile == NULL ? SHM_LOCAL : 0;
+      publishShm(flags, atoi(LISTEN_PORT));
+      printf("Hash table shared in %s, %s\n", shmname,
+             flags & SHM_LOCAL ? "clients consume tokens directly" :
+                                 "clients ask the server");
+   }
+
+   return 1;
+}
+
+
+/* 
+Processing thread of worker arg, consumes items from 
+its input queue and process it. Sends udp response Ok
+if rate limit is not exceeded otherwise sends NOK. 
+The thread of worker 0 allocates the queues and hash
+table first, the other workers start after it. 
+Items are taken from the queue in batches of up to
+BATCH_MAX and decided together by decideBatch(). 
+The ipv4 requests of a batch are counted in the
+heavy hitters of the worker after their replies. 
+*/
+void *processing(void *arg)
+{
+   struct worker *w = arg;
+   struct queue_item items[BATCH_MAX];
+   struct batch_decision d[BATCH_MAX];
+   unsigned int self = (unsigned int)(w - workers);
+   size_t i, n;
+
+   pinBusyThread(2 * (int) self + 1);
+   if(w == &workers[0])
+   {
+      if(!initProcessing())
+      {
+         setStarted(-1);
+         return NULL;
+      }
+      setStarted(1);
+   }
+    
+
+   while(1)
+   {
+      n = dequeueBatch(w->queue, items, BATCH_MAX);
+      decideBatch(items, n, limitmode, rate_now(), nextRefill(), d);
+
+      for(i=0;i<n;i++)
+      {
+         if(nworkers > 1 && d[i].key != 0 && items[i].peer_addr.ss_family == AF_INET &&
+            d[i].key % (unsigned int) nworkers != self)
+            __atomic_add_fetch(&w->strays, 1, __ATOMIC_RELAXED);
+         if(d[i].replied)
+            sendResponse(&items[i], &d[i].reply);
+      }
+
+      topk_begin(w->topk);
+      for(i=0;i<n;i++)
+      {
+         if(d[i].denied >= 0)
+            topk_add(w->topk, d[i].key, d[i].cost, d[i].denied);
+      }
+      topk_end(w->topk);
    }
 
 }
@@ -236,43 +560,99 @@ void *processing(void *arg)
 
 /*
 Token Update thread
-Loops through all the ipv4 buckets
-in the hashtable and refill their
-token according to the configured rate
+Refills the token buckets through the credit
+of their classes, then loops through all the
+ipv4 buckets in the hashtable, then the ipv6
+and the scoped buckets. 
+The sketch decays at the lowest refill of 
+the classes. 
+Buckets that are full are removed. 
+With GCRA there is nothing to refill and
+this thread only reclaims the full buckets. 
+Afterwards removed slots are reclaimed after 
+a grace period, deleted slots are purged if 
+needed and new evictions are reported. 
+The prefix buckets are refilled last and the
+shards of the global budget are reconciled. 
+The ip lists are reloaded here after a SIGHUP
+and the table is dumped after a SIGUSR1. 
+Requests that reached the wrong worker are reported.
+The heavy hitters are halved every TOPK_DECAY seconds
+and the trace is flushed. 
 */
 void *update(__attribute__((unused))void *arg)
 {
-   struct ip4bucket *ipb;
-   size_t i;
-   int remove, rate;
+   unsigned long long now;
    struct timespec ts;
+   struct ht_stats st, last;
+   unsigned long strays, laststrays=0;
+   long n;
+   int i, ticks=0;
+
+   memset(&last, 0, sizeof(last));
 
-   rate=TOKEN_REFILL;
    ts.tv_sec=SLEEP_INTERVAL;
    ts.tv_nsec=0; 
 
    while(1)
    {
-       for(i=0;i<HASHSZ;i++)
+       refillClasses();
+       __atomic_store_n(&refilltime, monotonicNow(), __ATOMIC_RELAXED);
+       shareRefill(refilltime);
+       now = rate_now();
+       refillHashTable(now);
+       refillHashTable6(now);
+       refillScopeTable(now);
+       reclaimHashItems();
+       purgeHashTable();
+
+       getHashStats(&st);
+       if(st.evicted_full != last.evicted_full || 
+          st.evicted_lru != last.evicted_lru ||
+          st.evict_failed != last.evict_failed)
+       {
+          printf("Buckets %zu evicted full %zu lru %zu failed %zu\n",
+                 st.size, st.evicted_full, st.evicted_lru, st.evict_failed);
+          last = st;
+       }
+
+       if(limitmode != LIMIT_EXACT)
+          sketch_decay(minRefill());
+
+       prefix_refill();
+       budget_reconcile();
+
+       for(strays=0,i=0;i<nworkers;i++)
+          strays += __atomic_load_n(&workers[i].strays, __ATOMIC_RELAXED);
+       if(strays != laststrays)
        {
-           ipb = getHashItem(i);
-           remove=0;
-           if(ipb != NULL)
-           {
-               pthread_mutex_lock(&ht_datalock); //lock data
-               ipb->count+=rate;
-               if(ipb->count > MAX_TOKENS )
-                  remove=1;
-               pthread_mutex_unlock(&ht_datalock); //unlock data
-       
-               if(remove)
-               {
-                 if(removeHashItem(ipb->ipv4) != 1)
-                     fprintf(stderr, "Error removing item from hashtable\n"); 
-               }
-
-           }
+          printf("Requests steered to another worker %lu\n", strays);
+          laststrays = strays;
+       }
+
+       flushTrace();
 
+       if(++ticks * SLEEP_INTERVAL >= TOPK_DECAY)
+       {
+          ticks = 0;
+          for(i=0;i<nworkers;i++)
+             topk_decay(workers[i].topk);
+       }
+
+       if(dumprequested)
+       {
+          dumprequested = 0;
+          dumpHashTable(dumpfile);
+       }
+
+       if(reloadlists)
+       {
+          reloadlists = 0;
+          n = loadLists(listfile);
+          if(n >= 0)
+             printf("Reloaded ip lists of %ld ranges\n", n);
+          else
+             fprintf(stderr, "Keeping the previous ip lists\n");
        }
 
      nanosleep(&ts, NULL);
@@ -282,31 +662,436 @@ void *update(__attribute__((unused))void *arg)
 }
 
 
-int main(__attribute__((unused))int argc, __attribute__((unused))char* argv[])
+/* Asks the update thread to reload the ip lists */
+static void onHangup(__attribute__((unused)) int sig)
 {
+   reloadlists = 1;
+}
 
-  char *LISTEN_HOST="localhost";
-  char *LISTEN_PORT="3211";
-  int serversocket; 
+
+/* Asks the update thread to dump the hash table */
+static void onDump(__attribute__((unused)) int sig)
+{
+   dumprequested = 1;
+}
+
+
+/* Prints the command line options and exits */
+void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-m exact|sketch|hybrid] [-t slots] [-c file] [-p file]\n"
+                  "          [-l file] [-d ms] [-g rate] [-s name] [-u path]\n"
+                  "          [-w workers] [-b cpus] [-r file] [-o file] [-i file]\n"
+                  "          [-6 len] [-H]\n", prog);
+  fprintf(stderr, "  -m  limiter mode, exact per ip buckets (default),\n"
+                  "      approximate count-min sketch, or sketch with\n"
+                  "      exact buckets for heavy hitters\n");
+  fprintf(stderr, "  -t  hash table slots, rounded up to a prime (default %d)\n", HASHSZ);
+  fprintf(stderr, "  -c  rate classes, lines of class name burst refill cost\n"
+                  "      and map prefix/len name\n");
+  fprintf(stderr, "  -p  per prefix limits, lines of prefix/len burst refill\n");
+  fprintf(stderr, "  -l  allow and deny lists, lines of allow|deny prefix[/len],\n"
+                  "      reloaded on SIGHUP\n");
+  fprintf(stderr, "  -d  shape requests, delay them by up to ms instead of\n"
+                  "      denying them (exact ip buckets only)\n");
+  fprintf(stderr, "  -g  global budget, tokens per second for all ips\n");
+  fprintf(stderr, "  -s  share the ipv4 hash table with local clients in the\n"
+                  "      shared memory segment name, e.g. /tbserver\n");
+  fprintf(stderr, "  -u  also serve local clients on a unix datagram socket\n");
+  fprintf(stderr, "  -w  workers, each with its own ipv4 socket and the\n"
+                  "      requests for its share of the ips (default 1)\n");
+  fprintf(stderr, "  -b  busy polling, pin the threads to cpus such as 2-5\n"
+                  "      and spin on the sockets and queues\n");
+  fprintf(stderr, "  -r  record the queries in a trace file for replaybench\n");
+  fprintf(stderr, "  -o  dump the ipv4 buckets to file on SIGUSR1, as csv\n"
+                  "      if its name ends in .csv\n");
+  fprintf(stderr, "  -i  load the ipv4 buckets of a dump file at start\n");
+  fprintf(stderr, "  -6  prefix length of the ipv6 keys (default %d)\n", IP6_PREFIX);
+  fprintf(stderr, "  -H  do not use huge pages\n");
+  exit(EXIT_FAILURE);
+}
+
+
+/* 
+Returns 1 if the peer of p is a local client, on 
+the unix socket or the loopback interface, 0 otherwise
+*/
+static int isLocalPeer(const struct queue_item *p)
+{
+  const struct sockaddr_in *in = (const struct sockaddr_in *) &p->peer_addr;
+  const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &p->peer_addr;
+
+  switch(p->peer_addr.ss_family)
+  {
+     case AF_UNIX:
+        return 1;
+     case AF_INET:
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+     case AF_INET6:
+        return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+     default:
+        return 0;
+  }
+}
+
+
+/* 
+Answers the admin query of p on serversocket with
+the TOPK_REPORT ipv4 keys that asked for the most
+tokens, a line TOP n followed by a line of ip 
+requests denies tokens error for each of them
+*/
+static void sendTopK(int serversocket, struct queue_item *p)
+{
+  struct topk_entry e[WORKERS_MAX * TOPK_SLOTS];
+  char buf[TOPK_REPORT * 100 + 16], ip[IP4_CHAR_LEN];
+  struct in_addr addr;
+  size_t n=0, i;
+  int len, w;
+
+  for(w=0;w<nworkers;w++)
+     n += topk_collect(workers[w].topk, e + n);
+  n = topk_merge(e, n);
+  if(n > TOPK_REPORT)
+     n = TOPK_REPORT;
+
+  len = snprintf(buf, sizeof(buf), "TOP %zu\n", n);
+  for(i=0;i<n && (size_t) len < sizeof(buf);i++)
+  {
+     addr.s_addr = htonl(e[i].key);
+     inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+     len += snprintf(buf + len, sizeof(buf) - (size_t) len, "%s %lu %lu %llu %llu\n",
+                     ip, e[i].requests, e[i].denies, e[i].tokens, e[i].error);
+  }
+  if((size_t) len >= sizeof(buf)) //truncated, send what fits with its NUL
+     len = (int) sizeof(buf) - 1;
+
+  if(sendto(serversocket, buf, (size_t) len + 1, MSG_DONTWAIT,
+     (struct sockaddr *) &p->peer_addr, p->peer_addr_len) != len + 1)
+        fprintf(stderr, "Error sending TOP response\n");
+}
+
+
+/* 
+Receives a request on serversocket and 
+adds it to the input queue q, and to the trace
+with -r. The admin query of a local client is 
+answered right away. flags are 
+the flags of recvfrom(). 
+Returns 1 if a request was received, 0 if
+there was none or on error
+*/
+int receiveRequest(int serversocket, struct queue *q, int flags)
+{
   ssize_t num; 
-  struct sockaddr_storage peer_addr;
-  socklen_t peer_addr_len;
   char buf[BUFSZ];
-  pthread_t tid1, tid2;
   struct queue_item qt;
+
+  qt.peer_addr_len = sizeof(qt.peer_addr);
+  num = recvfrom(serversocket, buf, BUFSZ, flags,
+              (struct sockaddr *) &qt.peer_addr, &qt.peer_addr_len);
+
+  if(num == -1)
+  {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+         return 0;
+      perror("Network error");
+      fprintf(stderr, "Network error: received %zd\n", num);
+      return 0;
+  }
   
-  peer_addr_len=sizeof(peer_addr);
+  if(num == 0)
+     return 0;   
+
+  //The expected correct message string
+  //should not be larger than BUFSZ
+  if(num < BUFSZ)
+    buf[num] = '\0';
+  else
+    buf[BUFSZ -1] = '\0';
+
+  strncpy(qt.msg, buf, strlen(buf) + 1);
+
+  if(strcmp(buf, TOPK_QUERY) == 0 && isLocalPeer(&qt))
+  {
+     sendTopK(serversocket, &qt);
+     return 1;
+  }
+
+  traceRequest(&qt);
+
+  if( enqueue(q, &qt) == -1)
+    fprintf(stderr, "Unable to queue message \n"); 
+
+  return 1;
+}
+
+
+/* 
+Receiving thread of worker arg other than worker 0, 
+which polls its socket in the busy polling mode
+*/
+void *receiving(void *arg)
+{
+  struct worker *w = arg;
+
+  if(nbusycpus > 0)
+  {
+     pinBusyThread(2 * (int)(w - workers));
+     while(1)
+     {
+        if(!receiveRequest(w->socket, w->queue, MSG_DONTWAIT))
+           cpuRelax();
+     }
+  }
+
+  while(1)
+     receiveRequest(w->socket, w->queue, 0);
+
+  return NULL;
+}
+
+
+/* 
+Polls the listening sockets of worker 0, ipv6 and
+unix clients in the busy polling mode and queues 
+the requests. Does not return. 
+*/
+static void spinRequests(void)
+{
+  int i, got;
+
+  while(1)
+  {
+    got = 0;
+    for(i=0;i<SOCKETS;i++)
+    {
+       if(serversockets[i] != -1)
+          got |= receiveRequest(serversockets[i], workers[0].queue, MSG_DONTWAIT);
+    }
+    if(!got)
+       cpuRelax();
+  }
+}
 
-  printf("Initializing queues\n");
-  initQueue(&input_queue);
 
-  printf("Initializing hash tables\n");
-  initHashTable();
+/* 
+Waits for requests on the listening sockets 
+of worker 0, ipv6 and unix clients and queues
+them, with epoll on linux and poll
+on other systems, or spins on them in the busy
+polling mode. Does not return. 
+*/
+#ifdef __linux__
+void serveRequests(void)
+{
+  struct epoll_event ev, events[SOCKETS];
+  int epfd, i, n;
+
+  if(nbusycpus > 0)
+     spinRequests();
+
+  epfd = epoll_create1(0);
+  if(epfd == -1)
+  {
+     perror("Epoll error");
+     exit(EXIT_FAILURE);
+  }
+
+  for(i=0;i<SOCKETS;i++)
+  {
+     if(serversockets[i] == -1)
+        continue;
+     memset(&ev, 0, sizeof(ev));
+     ev.events = EPOLLIN;
+     ev.data.fd = serversockets[i];
+     if(epoll_ctl(epfd, EPOLL_CTL_ADD, serversockets[i], &ev) == -1)
+     {
+        perror("Epoll error");
+        exit(EXIT_FAILURE);
+     }
+  }
+
+  while(1)
+  {
+    n = epoll_wait(epfd, events, SOCKETS, -1);
+    if(n == -1)
+    {
+        if(errno != EINTR) //SIGHUP or SIGUSR1
+           perror("Epoll error");
+        continue;
+    }
+
+    for(i=0;i<n;i++)
+    {
+       if(events[i].events & EPOLLIN)
+          receiveRequest(events[i].data.fd, workers[0].queue, 0);
+    }
+  }
+}
+#else
+void serveRequests(void)
+{
+  struct pollfd fds[SOCKETS];
+  nfds_t nfds=0, i;
+
+  if(nbusycpus > 0)
+     spinRequests();
+
+  for(i=0;i<SOCKETS;i++)
+  {
+     if(serversockets[i] == -1)
+        continue;
+     fds[nfds].fd = serversockets[i];
+     fds[nfds].events = POLLIN;
+     nfds++;
+  }
+
+  while(1)
+  {
+    if(poll(fds, nfds, -1) == -1)
+    {
+        if(errno != EINTR) //SIGHUP or SIGUSR1
+           perror("Poll error");
+        continue;
+    }
+
+    for(i=0;i<nfds;i++)
+    {
+       if(fds[i].revents & POLLIN)
+          receiveRequest(fds[i].fd, workers[0].queue, 0);
+    }
+  }
+}
+#endif
+
+
+int main(int argc, char* argv[])
+{
+
+  char *LISTEN_HOST="localhost";
+  char *LISTEN_HOST6="::1";
+  pthread_t tid1, tid2, tid;
+  struct sigaction sa;
+  int opt, i, busy;
+  char *end;
+  
+  while((opt = getopt(argc, argv, "m:t:c:p:l:d:g:s:u:w:b:r:o:i:6:H")) != -1)
+  {
+     switch(opt)
+     {
+        case 'm':
+           if(strcmp(optarg, "exact") == 0)
+              limitmode = LIMIT_EXACT;
+           else if(strcmp(optarg, "sketch") == 0)
+              limitmode = LIMIT_SKETCH;
+           else if(strcmp(optarg, "hybrid") == 0)
+              limitmode = LIMIT_HYBRID;
+           else
+              usage(argv[0]);
+           break;
+        case 't':
+           tableslots = strtoul(optarg, &end, 10);
+           if(*optarg == '\0' || *end != '\0' || tableslots == 0)
+              usage(argv[0]);
+           break;
+        case 'c':
+           classfile = optarg;
+           break;
+        case 'l':
+           listfile = optarg;
+           break;
+        case 'p':
+           prefixfile = optarg;
+           break;
+        case 'd':
+           maxdelay = strtoul(optarg, &end, 10);
+           if(*optarg == '\0' || *end != '\0' || maxdelay == 0 || maxdelay > MAX_DELAY_MS)
+              usage(argv[0]);
+           break;
+        case 's':
+           if(optarg[0] != '/' || strchr(optarg + 1, '/') != NULL)
+              usage(argv[0]);
+           shmname = optarg;
+           break;
+        case 'u':
+           unixpath = optarg;
+           break;
+        case 'r':
+           tracefile = optarg;
+           break;
+        case 'o':
+           dumpfile = optarg;
+           break;
+        case 'i':
+           preloadfile = optarg;
+           break;
+        case 'w':
+           nworkers = (int) strtol(optarg, &end, 10);
+           if(*optarg == '\0' || *end != '\0' || nworkers < 1 || nworkers > WORKERS_MAX)
+              usage(argv[0]);
+           break;
+        case 'b':
+           nbusycpus = parseCpuList(optarg, busycpus, BUSY_CPUS_MAX);
+           if(nbusycpus == 0)
+              usage(argv[0]);
+           break;
+        case 'g':
+           budgetrate = strtoul(optarg, &end, 10);
+           if(*optarg == '\0' || *end != '\0' || budgetrate == 0)
+              usage(argv[0]);
+           break;
+        case '6':
+           ip6prefix = (int) strtol(optarg, &end, 10);
+           if(*optarg == '\0' || *end != '\0' || ip6prefix < 1 || ip6prefix > 128)
+              usage(argv[0]);
+           break;
+        case 'H':
+           setHugePages(0);
+           break;
+        default:
+           usage(argv[0]);
+     }
+  }
+
+  printf("Using rate algorithm: %s\n", RATE_ALGO_NAME);
+  setIP6Prefix(ip6prefix);
+
+  if(tracefile != NULL)
+  {
+     if(!openTrace(tracefile))
+        exit(EXIT_FAILURE);
+     printf("Recording the queries in %s\n", tracefile);
+  }
+
+  if(listfile != NULL)
+  {
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = onHangup;
+     sigemptyset(&sa.sa_mask);
+     sa.sa_flags = SA_RESTART;
+     sigaction(SIGHUP, &sa, NULL);
+  }
+
+  if(dumpfile != NULL)
+  {
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = onDump;
+     sigemptyset(&sa.sa_mask);
+     sa.sa_flags = SA_RESTART;
+     sigaction(SIGUSR1, &sa, NULL);
+  }
 
   printf("Creating Token Bucket Rate Processing thread \n");
 
-  if( pthread_create(&tid1, NULL, processing, (void *)&serversocket) != 0)
+  if( pthread_create(&tid1, NULL, processing, &workers[0]) != 0)
+  {
      fprintf(stderr, "Cannot create processing thread\n");
+     exit(EXIT_FAILURE);
+  }
+
+  if(!waitStarted())
+     exit(EXIT_FAILURE);
 
  
   printf("Creating Token Bucket Rate Refilling thread \n");
@@ -314,44 +1099,60 @@ int main(__attribute__((unused))int argc, __attribute__((unused))char* argv[])
      fprintf(stderr, "Cannot create update thread\n");
 
 
-  bindSocket(LISTEN_HOST,LISTEN_PORT , &serversocket);
-  printf("Waiting for connections\n");
+  if(!bindSocket(LISTEN_HOST, LISTEN_PORT, AF_INET, nworkers > 1, &serversockets[SOCKET_IP4]))
+     exit(EXIT_FAILURE);
+  workers[0].socket = serversockets[SOCKET_IP4];
+  for(i=1;i<nworkers;i++)
+  {
+     if(!bindSocket(LISTEN_HOST, LISTEN_PORT, AF_INET, 1, &workers[i].socket))
+        exit(EXIT_FAILURE);
+  }
 
+  if(nworkers > 1)
+  {
+     if(attachSteering(workers[0].socket, nworkers))
+        printf("Steering ipv4 requests to %d workers by key\n", nworkers);
+     else
+        fprintf(stderr, "Spreading ipv4 requests to %d workers by address\n", nworkers);
+  }
 
-  while(1)
+  for(i=1;i<nworkers;i++)
   {
-    
-    num = recvfrom(serversocket, buf, BUFSZ, 0,
-                (struct sockaddr *) &peer_addr, &peer_addr_len);
+     if(pthread_create(&tid, NULL, processing, &workers[i]) != 0 ||
+        pthread_create(&tid, NULL, receiving, &workers[i]) != 0)
+     {
+        fprintf(stderr, "Cannot create worker threads\n");
+        exit(EXIT_FAILURE);
+     }
+  }
 
-    if(num == -1)
-    {
-        perror("Network error");
-        fprintf(stderr, "Network error: received %zd\n", num);
-        continue;
-    }
-    
-    if(num == 0)
-       continue;   
+  if(!bindSocket(LISTEN_HOST6, LISTEN_PORT, AF_INET6, 0, &serversockets[SOCKET_IP6]))
+     fprintf(stderr, "No ipv6 listener, serving ipv4 only\n");
 
-    //The expected correct message string
-    //should not be larger than BUFSZ
-    if(num < BUFSZ)
-      buf[num] = '\0';
-    else
-      buf[BUFSZ -1] = '\0';
+  if(unixpath != NULL && !bindUnixSocket(unixpath, &serversockets[SOCKET_UNIX]))
+     exit(EXIT_FAILURE);
 
- 
-         
-    qt.peer_addr = peer_addr;
-    qt.peer_addr_len = peer_addr_len;
-    strncpy(qt.msg, buf, strlen(buf) + 1);
+  if(nbusycpus > 0)
+  {
+     busy = 1;
+     for(i=0;i<SOCKETS;i++)
+     {
+        if(serversockets[i] != -1)
+           busy &= busyPollSocket(serversockets[i]);
+     }
+     for(i=1;i<nworkers;i++)
+        busy &= busyPollSocket(workers[i].socket);
 
-    if( enqueue(&input_queue, &qt) == -1)
-      fprintf(stderr, "Unable to queue message \n"); 
-   
+     printf("Busy polling on %d cpus%s\n", nbusycpus,
+            busy ? "" : ", without SO_BUSY_POLL");
+     if(nbusycpus < 2 * nworkers)
+        fprintf(stderr, "Spinning threads share cpus, %d are needed\n", 2 * nworkers);
+     pinBusyThread(0);
   }
 
+  printf("Waiting for connections\n");
+  serveRequests();
+
   pthread_join(tid1, NULL);
   pthread_join(tid2, NULL);
    
@@ -0,0 +1,224 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Server wide budget of admitted requests per
+ second, checked alongside the ip buckets. 
+
+ Every thread that takes tokens has a shard on 
+ its own cache line and takes from it with no 
+ other thread touching the line. When its shard
+ runs short, a thread leases a chunk of tokens 
+ from the shared pool, which is refilled at the
+ budget rate up to one second of tokens. So the
+ pool lock is taken once per chunk instead of 
+ once per request. The chunk is a hundredth of
+ the rate, at most BUDGET_CHUNK, so a thread 
+ holds back little of the budget. 
+
+ The update thread reconciles the shards every 
+ SLEEP_INTERVAL, moving their unused tokens back
+ to the pool so that an idle thread does not
+ keep them. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+struct budget_shard
+{
+ int tokens;
+} __attribute__((aligned(64)));
+
+static struct budget_shard shards[BUDGET_SHARDS];
+static unsigned int nextshard;
+static __thread struct budget_shard *myshard;
+
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static long long pool, poolmax;
+static unsigned long long pooltime, budgetrate;
+static int chunk;
+
+
+/*
+ Sets up a budget of rate tokens per second,
+ no budget if rate is 0. 
+ Returns 1 if successful, 0 otherwise
+*/
+int initBudget(unsigned long rate)
+{
+   if(rate > (unsigned long)INT_MAX)
+   {
+      fprintf(stderr, "Global budget of more than %d tokens\n", INT_MAX);
+      return 0;
+   }
+
+   pthread_mutex_lock(&poollock);
+   budgetrate = rate;
+   poolmax = pool = (long long)rate;
+   pooltime = monotonicNow();
+   chunk = rate / 100 > BUDGET_CHUNK ? BUDGET_CHUNK : (int)(rate / 100);
+   if(chunk < 1)
+      chunk = 1;
+   pthread_mutex_unlock(&poollock);
+
+   return 1;
+}
+
+
+/* Returns the shard of the calling thread */
+static struct budget_shard *threadShard(void)
+{
+   if(myshard == NULL)
+      myshard = &shards[__atomic_fetch_add(&nextshard, 1, __ATOMIC_RELAXED) % BUDGET_SHARDS];
+   return myshard;
+}
+
+
+/* Adds the tokens due since the last refill, pool lock held */
+static void refillPool(void)
+{
+   unsigned long long now = monotonicNow(), add;
+
+   add = (now - pooltime) * budgetrate / NSEC_PER_SEC;
+   if(pool + (long long)add >= poolmax)
+   {
+      pool = poolmax;
+      pooltime = now;
+   }
+   else if(add > 0)
+   {
+      pool += (long long)add;
+      pooltime += add * NSEC_PER_SEC / budgetrate;
+   }
+}
+
+
+/*
+ Moves want tokens, or as many as the pool has,
+ from the pool to shard s
+*/
+static void leaseTokens(struct budget_shard *s, int want)
+{
+   int n;
+
+   pthread_mutex_lock(&poollock);
+   refillPool();
+   n = pool < want ? (int)pool : want;
+   pool -= n;
+   pthread_mutex_unlock(&poollock);
+
+   if(n > 0)
+      __atomic_add_fetch(&s->tokens, n, __ATOMIC_RELAXED);
+}
+
+
+/* Takes n tokens from shard s, returns 1 if it had them */
+static int takeShard(struct budget_shard *s, int n)
+{
+   int old;
+
+   old = __atomic_load_n(&s->tokens, __ATOMIC_RELAXED);
+   do
+   {
+      if(old < n)
+         return 0;
+   } while(!__atomic_compare_exchange_n(&s->tokens, &old, old - n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   return 1;
+}
+
+
+/*
+ Takes cost tokens from the global budget. 
+ Returns 1 if the budget has them or there is
+ no budget, 0 otherwise
+*/
+int budget_take(int cost)
+{
+   struct budget_shard *s;
+
+   if(budgetrate == 0)
+      return 1;
+
+   s = threadShard();
+   if(takeShard(s, cost))
+      return 1;
+
+   leaseTokens(s, cost + chunk);
+   return takeShard(s, cost);
+}
+
+
+/* Gives back cost tokens of a request denied by its buckets */
+void budget_refund(int cost)
+{
+   if(budgetrate != 0)
+      __atomic_add_fetch(&threadShard()->tokens, cost, __ATOMIC_RELAXED);
+}
+
+
+/* Returns the nanoseconds until the pool can cover cost tokens */
+unsigned long long budget_wait(int cost)
+{
+   long long need;
+
+   if(budgetrate == 0)
+      return 0;
+
+   pthread_mutex_lock(&poollock);
+   refillPool();
+   need = cost - pool;
+   pthread_mutex_unlock(&poollock);
+
+   return need <= 0 ? 0 : ((unsigned long long)need * NSEC_PER_SEC + budgetrate - 1) / budgetrate;
+}
+
+
+/*
+ Moves the unused tokens of every shard back
+ to the pool, called every SLEEP_INTERVAL
+*/
+void budget_reconcile(void)
+{
+   long long n=0;
+   size_t i;
+
+   if(budgetrate == 0)
+      return;
+
+   for(i=0;i<BUDGET_SHARDS;i++)
+   {
+      if(__atomic_load_n(&shards[i].tokens, __ATOMIC_RELAXED) > 0)
+         n += __atomic_exchange_n(&shards[i].tokens, 0, __ATOMIC_RELAXED);
+   }
+
+   pthread_mutex_lock(&poollock);
+   refillPool();
+   pool = pool + n > poolmax ? poolmax : pool + n;
+   pthread_mutex_unlock(&poollock);
+}
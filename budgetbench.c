@@ -0,0 +1,154 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the global budget with several
+ threads taking tokens at the same time. 
+
+ Each thread takes single tokens with 
+ budget_take(), which uses the shard of the 
+ thread, and then from one counter shared by all
+ threads, the way a single global bucket would be
+ kept. The budget is large enough to never run 
+ out, so both runs measure the cost of the count
+ alone. 
+
+ Usage: budgetbench [max threads] [operations per thread]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 10000000
+
+struct benchparam
+{
+ size_t ops;
+ int shared;
+ unsigned long long allowed;
+};
+
+static int sharedtokens __attribute__((aligned(64)));
+
+
+/* Takes a token from the shared counter */
+static int takeShared(void)
+{
+   int old;
+
+   old = __atomic_load_n(&sharedtokens, __ATOMIC_RELAXED);
+   do
+   {
+      if(old < 1)
+         return 0;
+   } while(!__atomic_compare_exchange_n(&sharedtokens, &old, old - 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   return 1;
+}
+
+
+static void *taker(void *arg)
+{
+   struct benchparam *p = (struct benchparam *) arg;
+   size_t i;
+
+   for(i=0;i<p->ops;i++)
+      p->allowed += p->shared ? takeShared() : budget_take(1);
+
+   return NULL;
+}
+
+
+/* Returns Mops per second of nthreads taking ops tokens each */
+static double runTakers(int nthreads, size_t ops, int shared)
+{
+   pthread_t tids[DEFAULT_THREADS * 8];
+   struct benchparam params[DEFAULT_THREADS * 8];
+   unsigned long long start, allowed=0;
+   double t;
+   int i;
+
+   if(!initBudget(INT_MAX))
+      exit(EXIT_FAILURE);
+   sharedtokens = INT_MAX;
+
+   start = monotonicNow();
+   for(i=0;i<nthreads;i++)
+   {
+      params[i].ops = ops;
+      params[i].shared = shared;
+      params[i].allowed = 0;
+      if(pthread_create(&tids[i], NULL, taker, &params[i]) != 0)
+      {
+         fprintf(stderr, "Cannot create thread\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   for(i=0;i<nthreads;i++)
+   {
+      pthread_join(tids[i], NULL);
+      allowed += params[i].allowed;
+   }
+   t = (double)(monotonicNow() - start);
+
+   if(allowed != ops * (size_t)nthreads)
+   {
+      fprintf(stderr, "Denied %llu tokens\n", ops * (size_t)nthreads - allowed);
+      exit(EXIT_FAILURE);
+   }
+
+   budget_reconcile();
+   return (double)ops * nthreads / t * 1000.0;
+}
+
+
+int main(int argc, char* argv[])
+{
+   int maxthreads = DEFAULT_THREADS, n;
+   size_t ops = DEFAULT_OPS;
+
+   if(argc > 1)
+      maxthreads = atoi(argv[1]);
+   if(argc > 2)
+      ops = strtoul(argv[2], NULL, 10);
+
+   if(maxthreads <= 0 || maxthreads > DEFAULT_THREADS * 8 || ops == 0 ||
+      ops * (size_t)maxthreads > INT_MAX / 2)
+   {
+       fprintf(stderr,"Usage: %s [max threads] [operations per thread]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   printf("Online cpus: %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+   printf("threads  sharded Mops/s  shared counter Mops/s\n");
+   for(n=1;n<=maxthreads;n*=2)
+      printf("%7d  %14.2f  %21.2f\n", n, runTakers(n, ops, 0), runTakers(n, ops, 1));
+
+   return 0;
+}
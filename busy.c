@@ -0,0 +1,136 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Busy polling mode
+
+ With -b the server trades cpu for latency. The
+ receiving and processing threads are pinned to
+ the given cpus, the sockets are read without
+ blocking in a loop and the queues between the
+ threads are spin queues (queue.c), so a request
+ never waits for the scheduler to wake a thread.
+ SO_BUSY_POLL also lets the kernel poll the 
+ device queue for a short while when a socket 
+ is empty, for drivers that support it. 
+
+ The cpus are set with the sched_setaffinity
+ system call of the calling thread, as memalloc.c
+ does for its numa calls, so no gnu extension 
+ of the C library is needed. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <sys/syscall.h>
+
+
+/*
+ Parses a cpu list such as 2,3 or 4-7 into cpus,
+ at most max of them. 
+ Returns the number of cpus, 0 if the list is 
+ not valid
+*/
+int parseCpuList(const char *list, int *cpus, int max)
+{
+   const char *p = list;
+   char *end;
+   long first, last;
+   int n=0;
+
+   while(*p != '\0')
+   {
+      first = strtol(p, &end, 10);
+      if(end == p || first < 0 || first >= BUSY_CPUS_MAX)
+         return 0;
+      last = first;
+      if(*end == '-')
+      {
+         p = end + 1;
+         last = strtol(p, &end, 10);
+         if(end == p || last < first || last >= BUSY_CPUS_MAX)
+            return 0;
+      }
+
+      for(;first<=last;first++)
+      {
+         if(n == max)
+            return 0;
+         cpus[n++] = (int) first;
+      }
+
+      if(*end == ',')
+         end++;
+      else if(*end != '\0')
+         return 0;
+      p = end;
+   }
+
+   return n;
+}
+
+
+/*
+ Pins the calling thread to cpu. 
+ Returns 1 if successful, 0 otherwise
+*/
+int pinThread(int cpu)
+{
+#if defined(__linux__) && defined(SYS_sched_setaffinity)
+   unsigned long mask[BUSY_CPUS_MAX / (8 * sizeof(unsigned long))];
+
+   memset(mask, 0, sizeof(mask));
+   mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+   if(syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0)
+      return 1;
+
+   fprintf(stderr, "Unable to pin thread to cpu %d: %s\n", cpu, strerror(errno));
+#else
+   fprintf(stderr, "Unable to pin thread to cpu %d\n", cpu);
+#endif
+   return 0;
+}
+
+
+/*
+ Lets the kernel busy poll the device queue of
+ socket for BUSY_POLL_US when it is empty. Above
+ the net.core.busy_read sysctl this needs the
+ CAP_NET_ADMIN capability. 
+ Returns 1 if successful, 0 otherwise
+*/
+int busyPollSocket(int socket)
+{
+#ifdef SO_BUSY_POLL
+   int usec = BUSY_POLL_US;
+
+   if(setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0)
+      return 1;
+#else
+   (void) socket;
+#endif
+   return 0;
+}
@@ -0,0 +1,253 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Named rate classes.
+
+ Class 0 is the default class, with the limits of
+ MAX_TOKENS and TOKEN_REFILL unless the class file
+ redefines it. The class file has two kinds of
+ lines:
+
+   # name            burst  refill  cost
+   class default     50     1       1
+   class premium     500    10      1
+   class search      50     1       5
+   # prefix          class
+   map 10.0.0.0/8    premium
+
+ A map line gives the class of the buckets of the
+ addresses in a prefix. The prefixes are added to
+ the prefix table (prefix.c), so the class of an
+ address comes with the lookup of its prefix limits.
+ A class must be defined before it is mapped.
+
+ The names are indexed in a small open addressing
+ table for the class selector of a query.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+/* slots of the name index, twice RATE_CLASS_MAX */
+#define NAME_SLOTS (RATE_CLASS_MAX * 2)
+
+struct rate_class rate_classes[RATE_CLASS_MAX] = { RATE_CLASS_DEFAULT };
+int rate_class_count = 1;
+
+static char names[RATE_CLASS_MAX][RATE_CLASS_NAME_LEN] = { "default" };
+
+/* class + 1 of each name slot, 0 if empty */
+static unsigned char nameindex[NAME_SLOTS];
+
+
+/* FNV-1a hash of a class name */
+static size_t nameHash(const char *name)
+{
+   unsigned int h = 2166136261U;
+
+   while(*name != '\0')
+   {
+      h ^= (unsigned char) *name++;
+      h *= 16777619U;
+   }
+
+   return h % NAME_SLOTS;
+}
+
+
+/*
+ Returns the class named name, -1 if there
+ is no such class
+*/
+int findClass(const char *name)
+{
+   size_t i;
+   int c;
+
+   for(i=nameHash(name);nameindex[i]!=0;i=(i + 1) % NAME_SLOTS)
+   {
+      c = nameindex[i] - 1;
+      if(strcmp(names[c], name) == 0)
+         return c;
+   }
+
+   return -1;
+}
+
+
+/* Returns the name of class c */
+const char *className(int c)
+{
+   if(c < 0 || c >= rate_class_count)
+      return "unknown";
+   return names[c];
+}
+
+
+/* Returns the number of classes */
+int classCount(void)
+{
+   return rate_class_count;
+}
+
+
+/*
+ Returns the lowest refill of the classes, the
+ decay of the sketch that undercounts no class
+*/
+int minRefill(void)
+{
+   int i, r = rate_classes[0].refill;
+
+   for(i=1;i<rate_class_count;i++)
+   {
+      if(rate_classes[i].refill < r)
+         r = rate_classes[i].refill;
+   }
+
+   return r;
+}
+
+
+/*
+ Refills the token buckets of every class, done
+ by the update thread every SLEEP_INTERVAL before
+ it looks for the full buckets. GCRA needs none.
+*/
+void refillClasses(void)
+{
+   int i;
+
+   for(i=0;i<rate_class_count;i++)
+      rate_credit(&rate_classes[i]);
+}
+
+
+/* Adds a name to the index */
+static void indexName(int c)
+{
+   size_t i;
+
+   for(i=nameHash(names[c]);nameindex[i]!=0;i=(i + 1) % NAME_SLOTS)
+      ;
+   nameindex[i] = (unsigned char)(c + 1);
+}
+
+
+/*
+ Adds or redefines the class named name.
+ Returns 1 if successful, 0 otherwise
+*/
+static int defineClass(const char *name, int burst, int refill, int cost)
+{
+   struct rate_class limits;
+   int c;
+
+   if(burst < 1 || burst > RATE_BURST_MAX || refill < 1 ||
+      cost < 1 || cost > burst)
+   {
+      fprintf(stderr, "Invalid limits for class %s\n", name);
+      return 0;
+   }
+
+   rate_class_init(&limits, burst, refill, cost);
+   if(!rate_class_fits(&limits))
+   {
+      fprintf(stderr, "Limits of class %s out of range for %s\n", name, RATE_ALGO_NAME);
+      return 0;
+   }
+
+   c = findClass(name);
+   if(c < 0)
+   {
+      if(rate_class_count == RATE_CLASS_MAX)
+      {
+         fprintf(stderr, "More than %d rate classes\n", RATE_CLASS_MAX);
+         return 0;
+      }
+      c = rate_class_count++;
+      strcpy(names[c], name);
+      indexName(c);
+   }
+
+   rate_classes[c] = limits;
+   return 1;
+}
+
+
+/*
+ Reads the classes and the class of prefixes
+ from fp. The prefixes take effect once the
+ prefix table is built with buildPrefixes().
+ Returns the number of classes, -1 on failure
+*/
+int loadClasses(FILE *fp)
+{
+   char line[BUFSZ * 2], name[RATE_CLASS_NAME_LEN], ip[IP4_CHAR_LEN], extra;
+   size_t lineno=0;
+   unsigned int addr;
+   int burst, refill, cost, len, c;
+
+   if(findClass("default") < 0)
+      indexName(0);
+
+   while(fgets(line, sizeof(line), fp) != NULL)
+   {
+      lineno++;
+      line[strcspn(line, "#\r\n")] = '\0';
+
+      if(sscanf(line, " class %15s %d %d %d %c", name, &burst, &refill, &cost, &extra) == 4)
+      {
+         if(!defineClass(name, burst, refill, cost))
+            return -1;
+      }
+      else if(sscanf(line, " map %15[0-9.]/%d %15s %c", ip, &len, name, &extra) == 3)
+      {
+         c = findClass(name);
+         addr = parseIP4(ip);
+         if(c < 0)
+         {
+            fprintf(stderr, "Unknown class %s on line %zu\n", name, lineno);
+            return -1;
+         }
+         if((addr == 0 && strcmp(ip, "0.0.0.0") != 0) || len < 0 || len > 32 ||
+            !addPrefixRule(addr, len, 0, 0, c))
+         {
+            fprintf(stderr, "Invalid prefix on line %zu\n", lineno);
+            return -1;
+         }
+      }
+      else if(line[strspn(line, " \t")] != '\0')
+      {
+         fprintf(stderr, "Invalid class line %zu\n", lineno);
+         return -1;
+      }
+   }
+
+   return rate_class_count;
+}
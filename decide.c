@@ -0,0 +1,594 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Decisions on the requests of a batch, shared by
+ the processing threads of the server and by the
+ in process replay of replaybench. A request is
+ parsed, checked against the ip lists, the prefix
+ buckets and the global budget, then against the
+ ip bucket of its limiter mode. Sending the replies
+ and counting the heavy hitters are left to the
+ caller. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+/* prefix length of the ipv6 keys */
+static int ip6prefix = IP6_PREFIX;
+
+
+/* Sets the prefix length of the ipv6 keys to n */
+void setIP6Prefix(int n)
+{
+  ip6prefix = n;
+}
+
+
+/* 
+ Validates that a ip message string is valid
+ Returns 0 for invalid ip string or
+ the unsigned int representation 
+ of the ip4 string message. 
+*/  
+unsigned int validateMessage(const char *msg)
+{
+  unsigned int ret=0;
+  if(strlen(msg) > (IP4_CHAR_LEN - 1) )
+  {
+     fprintf(stderr, "Invalid ip message %s %zu\n", msg, strlen(msg)); 
+     return ret;
+  }
+
+  ret=parseIP4(msg); 
+  if(ret==HT_DELETED) //broadcast address is not a valid key
+     ret=0;
+  if(ret==0)
+      fprintf(stderr, "Invalid key %s %u\n", msg, ret); 
+         
+  return ret; 
+}
+
+
+/* Returns 1 if the message holds an ipv6 address, 0 otherwise */
+int isIP6Message(const char *msg)
+{
+  return strchr(msg, ':') != NULL;
+}
+
+
+/* 
+ Validates an ipv6 message string and sets 
+ k to the key of its prefix. 
+ Returns 1 if valid, 0 otherwise
+*/  
+int validateMessage6(const char *msg, struct ip6key *k)
+{
+  if(strlen(msg) > (IP6_CHAR_LEN - 1) || !parseIP6(msg, ip6prefix, k))
+  {
+     fprintf(stderr, "Invalid ipv6 message %s\n", msg); 
+     return 0;
+  }
+
+  return 1; 
+}
+
+/* 
+ Splits the selector off a message, the text
+ after its first space. It is either a class
+ name, e.g. "10.1.2.3 search", or a number of
+ tokens, e.g. "10.1.2.3 12". The selector only
+ sets the cost of the request, the limits of 
+ the bucket always come from the class of its
+ address.
+ Returns the cost of the selected class or the
+ number, 0 if there is no selector and -1 if 
+ the class is unknown
+*/
+int selectorCost(char *msg)
+{
+  char *sel, *end;
+  long n;
+  int c;
+
+  sel = strchr(msg, ' ');
+  if(sel == NULL)
+     return 0;
+
+  *sel++ = '\0';
+  if(*sel >= '0' && *sel <= '9')
+  {
+     n = strtol(sel, &end, 10);
+     if(*end != '\0' || n < 1)
+     {
+        fprintf(stderr, "Invalid request cost %s\n", sel);
+        return -1;
+     }
+     return n > RATE_BURST_MAX ? RATE_BURST_MAX + 1 : (int)n;
+  }
+
+  c = findClass(sel);
+  if(c < 0)
+  {
+     fprintf(stderr, "Unknown rate class %s\n", sel);
+     return -1;
+  }
+
+  return rate_classes[c].cost;
+}
+
+
+/* 
+ Splits the scope off a message, the text after
+ SCOPE_SEP, e.g. "10.1.2.3@/v1/search", and sets
+ scope to its number, 0 if there is none. The 
+ selector must have been split off first. 
+ Returns 1 if successful, 0 if the scope is invalid
+*/
+int messageScope(char *msg, unsigned int *scope)
+{
+  char *sep;
+
+  *scope = 0;
+  sep = strchr(msg, SCOPE_SEP);
+  if(sep == NULL)
+     return 1;
+
+  *sep++ = '\0';
+  *scope = internScope(sep);
+  if(*scope == 0)
+  {
+     fprintf(stderr, "Invalid scope %s\n", sep);
+     return 0;
+  }
+
+  return 1;
+}
+
+
+/* 
+ Returns the cost of a request to a bucket of
+ class cls, the cost of the selector if it has
+ one, or -1 if the request can never be allowed
+*/
+int requestCost(int selcost, int cls)
+{
+  int cost = selcost > 0 ? selcost : rate_classes[cls].cost;
+
+  if(selcost < 0 || cost > rate_classes[cls].burst)
+     return -1;
+  return cost;
+}
+
+
+/* 
+Creates a new ip bucket of rate class cls
+and add to hashtable. Takes the unsigned 
+int key k, ip message string, the cost of 
+the request and the current time of the 
+rate algorithm as parameters. 
+The request that creates the bucket consumes
+its first cost tokens. 
+Returns 1 if successful,
+0 if k is present or on failure
+*/
+size_t addNewBucket(unsigned int k, int cls, const char *msg, int cost, 
+                    unsigned long long now)
+{
+  struct ip4bucket ip_bucket;
+  size_t i, len;
+
+  len=strlen(msg);
+  
+  if(msg == NULL || len >= IP4_CHAR_LEN )
+     return 0;
+
+  empty_ip4_bucket(&ip_bucket);
+  ip_bucket.ipv4=k;
+  ip_bucket.cls=(unsigned char)cls;
+  rate_init_used(&ip_bucket.state, cost, &rate_classes[cls], now);
+
+  for(i=0;i<len;i++)
+    ip_bucket.addr[i] = msg[i];
+  
+  ip_bucket.addr[i] = '\0';
+            
+  return putNew(ip_bucket.ipv4, ip_bucket);
+
+}
+
+
+/* 
+Fills the reply r to a request of cost tokens
+from a count of left tokens out of burst that
+gains refill tokens every SLEEP_INTERVAL, as 
+kept by the sketch and the prefix buckets. 
+*/
+void countReply(struct rate_reply *r, int status, int left, int burst, int cost, 
+                int refill, unsigned long long next)
+{
+   r->allowed = status;
+   r->shaped = 0;
+   r->left = left;
+   if(!status)
+      r->wait = refill_wait(cost - left, refill, next);
+   else
+      r->wait = left < burst ? next : 0;
+}
+
+
+/* 
+Checks the rate limit of key k of rate class
+cls against the exact hash table, adding a 
+new bucket if k is not present. status and 
+seen are the results of consumeBatch() for k. 
+Fills the reply r. 
+Returns 1 if within rate limit, 0 otherwise
+*/
+int checkExact(unsigned int k, int cls, const char *msg, int cost, 
+               unsigned long long now, unsigned long long next, 
+               int status, rate_state_t *seen, struct rate_reply *r)
+{
+   if(status < 0) //may have been added for an earlier request of the batch
+      status = consumeBucket(k, cost, now, seen);
+   if(status < 0) //bucket not present in hash table
+   {
+      rate_init_used(seen, cost, &rate_classes[cls], now);
+      status = addNewBucket(k,cls,msg,cost,now) != 0 ? 1 :
+               consumeBucket(k, cost, now, seen); //added by another worker meanwhile
+      if(status < 0)
+      {
+         fprintf(stderr, "Unable to add to hash table\n");
+         status = 0;
+      }
+   }
+
+   rate_reply_bucket(r, status, seen, cost, &rate_classes[cls], now, next);
+   return status;
+}
+
+
+/* 
+Checks the rate limit of the ipv6 key k 
+against the ipv6 hash table, adding a new 
+bucket if k is not present. ipv6 keys are
+always counted exactly, in the default class. 
+Fills the reply r. 
+Returns 1 if within rate limit, 0 otherwise
+*/
+int checkExact6(const struct ip6key *k, int cost, unsigned long long now, 
+                unsigned long long next, struct rate_reply *r)
+{
+   rate_state_t seen;
+   int status;
+
+   status = consumeBucket6(k, cost, now, &seen);
+   if(status < 0)
+   {
+      rate_init_used(&seen, cost, &rate_classes[0], now);
+      status = put6(k, seen, 0) != 0 ? 1 : consumeBucket6(k, cost, now, &seen);
+      if(status < 0)
+      {
+         fprintf(stderr, "Unable to add to ipv6 hash table\n");
+         status = 0;
+      }
+   }
+
+   rate_reply_bucket(r, status, &seen, cost, &rate_classes[0], now, next);
+   return status;
+}
+
+
+/* 
+Checks the rate limit of the scoped key k of
+rate class cls against the table of the scoped
+keys, adding a new bucket if k is not present. 
+Scoped keys are always counted exactly. 
+Fills the reply r. 
+Returns 1 if within rate limit, 0 otherwise
+*/
+int checkScoped(const struct ip6key *k, int cls, int cost, unsigned long long now, 
+                unsigned long long next, struct rate_reply *r)
+{
+   rate_state_t seen;
+   int status;
+
+   status = consumeScoped(k, cost, now, &seen);
+   if(status < 0)
+   {
+      rate_init_used(&seen, cost, &rate_classes[cls], now);
+      status = putScoped(k, seen, cls) != 0 ? 1 : consumeScoped(k, cost, now, &seen);
+      if(status < 0)
+      {
+         fprintf(stderr, "Unable to add to scoped hash table\n");
+         status = 0;
+      }
+   }
+
+   rate_reply_bucket(r, status, &seen, cost, &rate_classes[cls], now, next);
+   return status;
+}
+
+
+/* 
+Checks the rate limit of key k of rate class 
+cls against the sketch and fills the reply r. 
+The sketch decays at the lowest refill of the
+classes, which is used for the wait. 
+Returns the tokens used by k if within rate 
+limit, 0 otherwise
+*/
+int checkSketch(unsigned int k, int cls, int cost, unsigned long long next, 
+                struct rate_reply *r)
+{
+   int burst = rate_classes[cls].burst, used;
+
+   if(burst > SKETCH_MAX)
+      burst = SKETCH_MAX;
+
+   used = sketch_consume(k, cost, burst);
+   countReply(r, used > 0, burst - (used > 0 ? used : sketch_estimate(k)), 
+              burst, cost, minRefill(), next);
+   return used;
+}
+
+
+/* 
+Checks the rate limit of key k in hybrid mode. 
+Heavy hitters are kept in the exact hash table,
+every other ip is only counted by the sketch 
+and moved to the hash table once it has used 
+SKETCH_PROMOTE tokens. status and seen are 
+the results of consumeBatch() for k. 
+Fills the reply r. 
+Returns 1 if within rate limit, 0 otherwise
+*/
+int checkHybrid(unsigned int k, int cls, const char *msg, int cost, 
+                unsigned long long now, unsigned long long next, 
+                int status, rate_state_t *seen, struct rate_reply *r)
+{
+   struct ip4bucket ip_bucket;
+   int used;
+   size_t len;
+
+   if(status < 0) //may have been promoted for an earlier request of the batch
+      status = consumeBucket(k, cost, now, seen);
+   if(status >= 0) //heavy hitter in hash table
+   {
+      rate_reply_bucket(r, status, seen, cost, &rate_classes[cls], now, next);
+      return status;
+   }
+
+   used = checkSketch(k, cls, cost, next, r);
+   if(used < SKETCH_PROMOTE)
+      return used > 0;
+
+   len = strlen(msg);
+   empty_ip4_bucket(&ip_bucket);
+   ip_bucket.cls = (unsigned char)cls;
+   rate_init_used(&ip_bucket.state, used, &rate_classes[cls], now);
+   if(len < IP4_CHAR_LEN)
+      memcpy(ip_bucket.addr, msg, len + 1);
+
+   if(putNew(k, ip_bucket) != 1)
+   {//promoted by another worker meanwhile
+      status = consumeBucket(k, cost, now, seen);
+      if(status >= 0)
+      {
+         rate_reply_bucket(r, status, seen, cost, &rate_classes[cls], now, next);
+         return status;
+      }
+      fprintf(stderr, "Unable to promote to hash table\n");
+   }
+
+   return 1;
+}
+
+
+/* 
+Decides the n requests of items in limiter mode
+mode, at time now of the rate algorithm with next
+ns until the next refill, and fills d with their
+decisions. 
+ipv4 addresses on the allow or deny lists are 
+answered first, without taking any token. 
+The rate class of an ipv4 request is the class of
+its longest matching prefix, a class selector in
+the message only changes its cost. 
+A request is only allowed if the buckets of its 
+prefixes and its ip bucket all have its cost, it
+is never charged in part. The reply gives the
+fewest tokens left in any of these buckets, the 
+most the client can still use, and when the next
+token comes or, if denied, when the request can
+be allowed. Every request also takes its cost 
+from the global budget first, which is given 
+back if a bucket denies it. 
+With -d a request that is over the 
+limit of its ip bucket is charged anyway and 
+answered with the delay the client must keep. The
+prefixes are checked first so that a denied 
+request does not use a token of its ip bucket,
+their tokens are given back if the ip bucket 
+denies it. ipv6 requests are checked against
+the ipv6 hash table only. 
+A request with a scope is checked against the 
+bucket of its address in that scope, in place
+of the bucket of its address and in every mode,
+after the same lists, prefixes and budget. 
+The ipv4 buckets of the batch are looked up 
+together by consumeBatch(). 
+*/
+void decideBatch(struct queue_item *items, size_t n, int mode, unsigned long long now,
+                 unsigned long long next, struct batch_decision *d)
+{
+   unsigned int keys[BATCH_MAX], lookups[BATCH_MAX];
+   struct ip6key keys6[BATCH_MAX];
+   unsigned int scopes[BATCH_MAX];
+   int results[BATCH_MAX], allowed[BATCH_MAX];
+   int costs[BATCH_MAX], prefixes[BATCH_MAX], classes[BATCH_MAX];
+   int prefixleft[BATCH_MAX], budgeted[BATCH_MAX], verdicts[BATCH_MAX];
+   rate_state_t seen[BATCH_MAX];
+   struct rate_reply *reply;
+   int status, selcost; 
+   size_t i;
+
+   ebr_enter(); //for the ip lists
+   for(i=0;i<n;i++)
+   {
+      verdicts[i] = LIST_NONE;
+      keys[i] = 0;
+      prefixes[i] = -1;
+      classes[i] = 0;
+      prefixleft[i] = INT_MAX;
+      budgeted[i] = 0;
+      costs[i] = 0;
+      selcost = selectorCost(items[i].msg);
+      if(!messageScope(items[i].msg, &scopes[i]))
+      {
+         allowed[i] = 0;
+         lookups[i] = 0;
+         continue;
+      }
+      if(isIP6Message(items[i].msg))
+      {
+         costs[i] = requestCost(selcost, 0);
+         allowed[i] = validateMessage6(items[i].msg, &keys6[i]);
+         if(allowed[i] && scopes[i] != 0)
+            scopeKey(keys6[i].hi, AF_INET6, scopes[i], &keys6[i]);
+      }
+      else
+      {
+         keys[i] = validateMessage(items[i].msg);
+         if(keys[i] != 0)
+            verdicts[i] = list_lookup(keys[i]);
+         if(verdicts[i] != LIST_NONE)
+         {//listed ips take no tokens, also in the heavy hitters
+            allowed[i] = 0;
+            lookups[i] = 0;
+            continue;
+         }
+         prefixes[i] = prefix_lookup(keys[i]);
+         classes[i] = prefix_class(prefixes[i]);
+         costs[i] = requestCost(selcost, classes[i]);
+         budgeted[i] = keys[i] != 0 && costs[i] > 0 && budget_take(costs[i]);
+         allowed[i] = budgeted[i] && 
+                      prefix_consume(prefixes[i], costs[i], &prefixleft[i]);
+         if(budgeted[i] && !allowed[i])
+            budget_refund(costs[i]);
+         if(scopes[i] != 0)
+            scopeKey(keys[i], AF_INET, scopes[i], &keys6[i]);
+      }
+      lookups[i] = allowed[i] && scopes[i] == 0 ? keys[i] : 0;
+   }
+   ebr_exit();
+
+   if(mode != LIMIT_SKETCH)
+      consumeBatch(lookups, costs, n, now, results, seen);
+
+   for(i=0;i<n;i++)
+   {
+      reply = &d[i].reply;
+      memset(reply, 0, sizeof(*reply));
+      d[i].key = keys[i];
+      d[i].cost = costs[i];
+      d[i].replied = 1;
+      d[i].denied = -1;
+      if(verdicts[i] != LIST_NONE)
+      {//allowed ips are reported with a full default bucket
+         reply->allowed = verdicts[i] == LIST_ALLOW;
+         reply->left = reply->allowed ? rate_classes[0].burst : 0;
+         d[i].denied = !reply->allowed;
+         continue;
+      }
+
+      if(keys[i] == 0)
+      {
+         if(!allowed[i]) //invalid ipv6 address or scope
+            d[i].replied = 0;
+         else if(costs[i] > 0 && !budget_take(costs[i]))
+            reply->wait = budget_wait(costs[i]);
+         else if(costs[i] > 0 && scopes[i] != 0)
+         {
+            if(!checkScoped(&keys6[i], 0, costs[i], now, next, reply))
+               budget_refund(costs[i]);
+         }
+         else if(costs[i] > 0 && !checkExact6(&keys6[i], costs[i], now, next, reply))
+            budget_refund(costs[i]);
+         continue;
+      }
+
+      if(!allowed[i])
+      {
+         if(costs[i] > 0 && !budgeted[i]) //the global budget is short
+            reply->wait = budget_wait(costs[i]);
+         else if(costs[i] > 0) //a prefix bucket is short
+         {
+            reply->wait = prefix_wait(prefixes[i], costs[i], next);
+            reply->left = prefixleft[i];
+         }
+         d[i].denied = 1;
+         continue;
+      }
+
+      switch(scopes[i] != 0 ? LIMIT_EXACT : mode)
+      {
+         case LIMIT_SKETCH:
+            status = checkSketch(keys[i], classes[i], costs[i], next, reply) > 0;
+            break;
+         case LIMIT_HYBRID:
+            status = checkHybrid(keys[i], classes[i], items[i].msg, costs[i], 
+                                 now, next, results[i], &seen[i], reply);
+            break;
+         default:
+            if(scopes[i] != 0)
+               status = checkScoped(&keys6[i], classes[i], costs[i], now, next, reply);
+            else
+               status = checkExact(keys[i], classes[i], items[i].msg, costs[i], 
+                                   now, next, results[i], &seen[i], reply);
+            break;
+      }
+
+      if(!status)
+      {
+         budget_refund(costs[i]);
+         prefix_refund(prefixes[i], costs[i]);
+         if(prefixleft[i] != INT_MAX)
+            prefixleft[i] += costs[i];
+      }
+
+      if(prefixleft[i] < reply->left)
+      {
+         reply->left = prefixleft[i];
+         if(reply->allowed && !reply->shaped)
+            reply->wait = next;
+      }
+
+      d[i].denied = !reply->allowed;
+   }
+}
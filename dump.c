@@ -0,0 +1,361 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Dumps and preloads of the ipv4 hash table
+
+ On SIGUSR1 the update thread copies the live 
+ buckets with snapshotHashTable(), between two
+ refills and without taking a lock, so the 
+ processing threads go on consuming tokens. The
+ copy is written out by a thread of its own, 
+ which does not hold back the next refill, to
+ a temporary file that is then renamed over the
+ dump, so a reader never sees a partial dump. 
+ Only one dump is written at a time. 
+
+ At start the buckets of a dump are loaded in 
+ one pass, DUMP_CHUNK records at a time, and 
+ the hash table lock is taken once per chunk.
+ The records of either format are checked 
+ before they are loaded. A csv file can also be
+ written by hand to preload the tokens of 
+ chosen ips, e.g. 
+
+   ip,class,tokens,burst
+   10.1.2.3,default,5,50
+   10.1.2.4,premium,0,500
+
+ The burst column is informative and ignored. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+struct dump_job
+{
+ const char *path;
+ struct dump_record *records;
+ size_t size;
+ size_t n;
+ unsigned long long start;
+};
+
+static int dumping;
+
+
+/* Returns 1 if path names a csv file, 0 otherwise */
+static int isCsv(const char *path)
+{
+   size_t len = strlen(path), n = strlen(DUMP_CSV);
+
+   return len > n && strcmp(path + len - n, DUMP_CSV) == 0;
+}
+
+
+/* 
+ Writes the records of job to fp as csv lines.
+ Returns 1 if successful, 0 otherwise
+*/
+static int writeCsv(FILE *fp, const struct dump_job *job)
+{
+   char ip[IP4_CHAR_LEN];
+   const struct dump_record *r;
+   size_t i;
+
+   fprintf(fp, "ip,class,tokens,burst\n");
+   for(i=0;i<job->n;i++)
+   {
+      r = &job->records[i];
+      formatIP4(r->key, ip);
+      fprintf(fp, "%s,%s,%d,%d\n", ip, className(r->cls), r->tokens, 
+              rate_classes[r->cls].burst);
+   }
+
+   return !ferror(fp);
+}
+
+
+/* 
+ Writes the header and the records of job to
+ fp as a binary dump.
+ Returns 1 if successful, 0 otherwise
+*/
+static int writeBinary(FILE *fp, const struct dump_job *job)
+{
+   struct dump_header h;
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   memset(&h, 0, sizeof(h));
+   h.magic = DUMP_MAGIC;
+   h.version = DUMP_VERSION;
+   h.count = job->n;
+   h.time = (unsigned long long) ts.tv_sec;
+
+   return fwrite(&h, sizeof(h), 1, fp) == 1 &&
+          fwrite(job->records, sizeof(struct dump_record), job->n, fp) == job->n;
+}
+
+
+/* Thread that writes the dump of arg and frees it */
+static void *writing(void *arg)
+{
+   struct dump_job *job = arg;
+   char tmp[PATH_MAX];
+   FILE *fp;
+   int ok=0;
+
+   if(snprintf(tmp, sizeof(tmp), "%s.tmp", job->path) < (int) sizeof(tmp))
+   {
+      fp = fopen(tmp, "wb");
+      if(fp != NULL)
+      {
+         ok = isCsv(job->path) ? writeCsv(fp, job) : writeBinary(fp, job);
+         ok = fclose(fp) == 0 && ok && rename(tmp, job->path) == 0;
+         if(!ok)
+            unlink(tmp);
+      }
+   }
+
+   if(ok)
+      printf("Dumped %zu buckets to %s in %.1f ms\n", job->n, job->path,
+             (double)(monotonicNow() - job->start) / NSEC_PER_MSEC);
+   else
+      fprintf(stderr, "Unable to write the dump %s\n", job->path);
+
+   hugeFree(job->records, job->size);
+   free(job);
+   __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+
+/*
+ Copies the ipv4 hash table and starts a thread
+ that writes it to path. Must be called by the 
+ update thread, see snapshotHashTable(). 
+ Returns 1 if the dump is started, 0 otherwise
+*/
+int dumpHashTable(const char *path)
+{
+   struct dump_job *job;
+   struct ht_stats st;
+   pthread_attr_t attr;
+   pthread_t tid;
+   int huge, ret;
+
+   if(__atomic_exchange_n(&dumping, 1, __ATOMIC_ACQ_REL))
+   {
+      fprintf(stderr, "The previous dump is still being written\n");
+      return 0;
+   }
+
+   getHashStats(&st);
+   job = malloc(sizeof(*job));
+   if(job != NULL)
+   {
+      job->path = path;
+      job->start = monotonicNow();
+      job->size = (st.capacity + 1) * sizeof(struct dump_record);
+      job->records = hugeAlloc(job->size, -1, &huge);
+      if(job->records == NULL)
+      {
+         free(job);
+         job = NULL;
+      }
+   }
+   if(job == NULL)
+   {
+      fprintf(stderr, "Unable to allocate the dump\n");
+      __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+      return 0;
+   }
+
+   job->n = snapshotHashTable(job->records, st.capacity + 1, rate_now());
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   ret = pthread_create(&tid, &attr, writing, job);
+   pthread_attr_destroy(&attr);
+   if(ret != 0)
+   {
+      fprintf(stderr, "Cannot create dump thread\n");
+      hugeFree(job->records, job->size);
+      free(job);
+      __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* 
+ Loads the records of a binary dump from fp
+ into the hash table, the header is read. 
+ Returns the number of buckets loaded, -1 
+ on failure
+*/
+static long loadBinary(FILE *fp, struct dump_record *r)
+{
+   struct dump_header h;
+   unsigned long long left;
+   size_t n, i;
+   long loaded=0;
+
+   if(fread(&h, sizeof(h), 1, fp) != 1 || h.magic != DUMP_MAGIC || 
+      h.version != DUMP_VERSION)
+   {
+      fprintf(stderr, "Not a dump of this version\n");
+      return -1;
+   }
+
+   for(left=h.count;left>0;left-=n)
+   {
+      n = left < DUMP_CHUNK ? (size_t) left : DUMP_CHUNK;
+      if(fread(r, sizeof(*r), n, fp) != n)
+      {
+         fprintf(stderr, "Dump is truncated\n");
+         return -1;
+      }
+
+      for(i=0;i<n;i++)
+      {
+         if(r[i].cls >= classCount())
+         {
+            fprintf(stderr, "Unknown rate class %d in dump\n", r[i].cls);
+            return -1;
+         }
+         if(r[i].tokens < -RATE_BURST_MAX || r[i].tokens > RATE_BURST_MAX)
+         {
+            fprintf(stderr, "Invalid tokens %d in dump\n", r[i].tokens);
+            return -1;
+         }
+      }
+
+      loaded += (long) preloadHashTable(r, n, rate_now());
+   }
+
+   return loaded;
+}
+
+
+/* 
+ Splits the first field off the csv line at p
+ and moves p to the next field. 
+ Returns the field, NULL if it is the last one
+*/
+static char *csvField(char **p)
+{
+   char *f = *p, *end = strchr(f, ',');
+
+   if(end == NULL)
+      return NULL;
+   *end = '\0';
+   *p = end + 1;
+   return f;
+}
+
+
+/* 
+ Loads the csv lines of fp into the hash table.
+ Returns the number of buckets loaded, -1 on 
+ failure
+*/
+static long loadCsv(FILE *fp, struct dump_record *r)
+{
+   char line[BUFSZ * 2], *p, *ip, *name, *end;
+   size_t lineno=0, n=0;
+   long loaded=0, tokens;
+   int c;
+
+   while(fgets(line, sizeof(line), fp) != NULL)
+   {
+      lineno++;
+      line[strcspn(line, "#\r\n")] = '\0';
+      if(line[strspn(line, " \t")] == '\0' || strncmp(line, "ip,", 3) == 0)
+         continue;
+
+      p = line;
+      ip = csvField(&p);
+      name = ip == NULL ? NULL : csvField(&p);
+      tokens = name == NULL ? LONG_MAX : strtol(p, &end, 10);
+      if(tokens < -RATE_BURST_MAX || tokens > RATE_BURST_MAX || end == p || 
+         (*end != '\0' && *end != ','))
+      {
+         fprintf(stderr, "Invalid dump line %zu\n", lineno);
+         return -1;
+      }
+
+      //the default class is only indexed once a class file is loaded
+      c = strcmp(name, className(0)) == 0 ? 0 : findClass(name);
+      r[n].key = strlen(ip) < IP4_CHAR_LEN ? parseIP4(ip) : 0;
+      if(c < 0 || r[n].key == 0)
+      {
+         fprintf(stderr, "Invalid ip or class on dump line %zu\n", lineno);
+         return -1;
+      }
+      r[n].tokens = (int) tokens;
+      r[n].cls = (unsigned char) c;
+
+      if(++n == DUMP_CHUNK)
+      {
+         loaded += (long) preloadHashTable(r, n, rate_now());
+         n = 0;
+      }
+   }
+
+   return loaded + (long) preloadHashTable(r, n, rate_now());
+}
+
+
+/*
+ Loads the buckets of the dump file path, 
+ binary or csv, into the hash table. Must be
+ called after the classes are loaded. 
+ Returns the number of buckets loaded, -1 
+ on failure
+*/
+long loadDump(const char *path)
+{
+   static struct dump_record records[DUMP_CHUNK];
+   FILE *fp;
+   long n;
+
+   fp = fopen(path, "rb");
+   if(fp == NULL)
+   {
+      fprintf(stderr, "Unable to open dump %s\n", path);
+      return -1;
+   }
+
+   n = isCsv(path) ? loadCsv(fp, records) : loadBinary(fp, records);
+   fclose(fp);
+
+   return n;
+}
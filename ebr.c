@@ -0,0 +1,237 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Epoch based reclamation for the lock free
+ hash table lookups.
+
+ A reader announces the global epoch in its own
+ cache line when it enters a read section and
+ clears it when it leaves. ebr_synchronize()
+ advances the global epoch and waits until every
+ reader is either outside a read section or has
+ announced the new epoch. Anything unlinked before
+ the call can then no longer be in use by a reader.
+
+ Readers never wait. Read sections must not nest
+ and must not call ebr_synchronize(). A thread gets
+ its slot on its first read section and gives it
+ back when it exits.
+
+ With ebr_share() the global epoch moves into the
+ shared memory segment, and the client processes
+ that read the shared hash table announce it in
+ their own slots there. ebr_synchronize() waits 
+ for them as well, unless their process is gone.
+ A client can stop inside a read section, so the
+ threads that serve requests never wait: they 
+ advance the epoch with ebr_advance() and check
+ later with ebr_passed() whether it is over. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+struct ebr_thread
+{
+ unsigned long epoch;
+ int inuse;
+ char pad[CACHELINE - sizeof(unsigned long) - sizeof(int)];
+};
+
+static struct ebr_thread ebr_threads[EBR_MAX_THREADS] __attribute__((aligned(CACHELINE)));
+static unsigned long ebr_localepoch = 1;
+static unsigned long *ebr_epoch = &ebr_localepoch;
+static struct shm_client *ebr_clients;
+static int ebr_nclients;
+static int ebr_nthreads;
+static __thread int ebr_id = -1;
+
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+
+/* Frees the announcement slot when a thread exits */
+static void ebrRelease(void *arg)
+{
+   struct ebr_thread *t = (struct ebr_thread *) arg;
+
+   __atomic_store_n(&t->epoch, 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&t->inuse, 0, __ATOMIC_RELEASE);
+}
+
+
+static void ebrKeyInit(void)
+{
+   if(pthread_key_create(&ebr_key, ebrRelease) != 0)
+   {
+      fprintf(stderr, "Cannot create epoch reclamation key\n");
+      exit(EXIT_FAILURE);
+   }
+}
+
+
+/* Gives the calling thread a free announcement slot */
+static void ebrRegister(void)
+{
+   int i, n, expected;
+
+   pthread_once(&ebr_once, ebrKeyInit);
+
+   for(i=0;i<EBR_MAX_THREADS;i++)
+   {
+      expected = 0;
+      if(__atomic_compare_exchange_n(&ebr_threads[i].inuse, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+   }
+
+   if(i == EBR_MAX_THREADS)
+   {
+      fprintf(stderr, "Too many threads for epoch reclamation\n");
+      exit(EXIT_FAILURE);
+   }
+
+   //highest slot ever used, bounds the scan of ebr_synchronize()
+   n = __atomic_load_n(&ebr_nthreads, __ATOMIC_RELAXED);
+   while(n < i + 1 &&
+         !__atomic_compare_exchange_n(&ebr_nthreads, &n, i + 1, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      ;
+
+   ebr_id = i;
+   pthread_setspecific(ebr_key, &ebr_threads[i]);
+}
+
+
+/* Enters a read section */
+void ebr_enter(void)
+{
+   unsigned long e;
+
+   if(ebr_id < 0)
+      ebrRegister();
+
+   e = __atomic_load_n(ebr_epoch, __ATOMIC_ACQUIRE);
+   __atomic_store_n(&ebr_threads[ebr_id].epoch, e, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/* Leaves a read section */
+void ebr_exit(void)
+{
+   __atomic_store_n(&ebr_threads[ebr_id].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ Moves the global epoch to epoch and adds the n
+ read section slots of client processes in clients.
+ Must be called before any read section. 
+*/
+void ebr_share(unsigned long *epoch, struct shm_client *clients, int n)
+{
+   __atomic_store_n(epoch, ebr_localepoch, __ATOMIC_RELAXED);
+   ebr_epoch = epoch;
+   ebr_clients = clients;
+   ebr_nclients = n;
+}
+
+
+/* 
+ Returns 1 if the process of client slot c 
+ may still be reading, 0 otherwise. The slot
+ of a process that is gone is freed. 
+*/
+static int clientAlive(struct shm_client *c)
+{
+   int pid = __atomic_load_n(&c->pid, __ATOMIC_ACQUIRE);
+
+   if(pid == 0)
+      return 0;
+   if(kill(pid, 0) == 0 || errno != ESRCH)
+      return 1;
+
+   __atomic_store_n(&c->epoch, 0, __ATOMIC_RELAXED);
+   __atomic_compare_exchange_n(&c->pid, &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+   return 0;
+}
+
+
+/*
+ Advances the global epoch and returns it. A
+ grace period for anything unlinked before the
+ call is over once ebr_passed() of it returns 1. 
+*/
+unsigned long ebr_advance(void)
+{
+   return __atomic_add_fetch(ebr_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ Checks once, without waiting, whether every 
+ reader has left the read sections it was in
+ when the epoch was advanced to e. 
+ Returns 1 if so, 0 otherwise
+*/
+int ebr_passed(unsigned long e)
+{
+   unsigned long t;
+   int i, n;
+
+   n = __atomic_load_n(&ebr_nthreads, __ATOMIC_SEQ_CST);
+   for(i=0;i<n;i++)
+   {
+      t = __atomic_load_n(&ebr_threads[i].epoch, __ATOMIC_SEQ_CST);
+      if(t != 0 && t < e)
+         return 0;
+   }
+
+   for(i=0;i<ebr_nclients;i++)
+   {
+      t = __atomic_load_n(&ebr_clients[i].epoch, __ATOMIC_SEQ_CST);
+      if(t != 0 && t < e && clientAlive(&ebr_clients[i]))
+         return 0;
+   }
+
+   return 1;
+}
+
+
+/*
+ Waits for a grace period, after which no reader
+ holds a reference obtained before the call
+*/
+void ebr_synchronize(void)
+{
+   unsigned long e = ebr_advance();
+
+   while(!ebr_passed(e))
+      sched_yield();
+}
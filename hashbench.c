@@ -0,0 +1,206 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the hash table probe lengths with
+ ip sets chosen against the previous unkeyed hash
+ functions, ip % HASHSZ and ip % (HASHSZ-1) + 1.
+
+ - same sequence, ips equal modulo HASHSZ*(HASHSZ-1)
+   share their whole probe sequence
+ - same slot, ips equal modulo HASHSZ start at the
+   same slot
+ - random ips for comparison
+
+ Each set is inserted into a table of HASHSZ slots
+ using the previous functions, and into the hash
+ table of hashtable.c with its keyed SipHash. The
+ longest probe sequence of an insert is reported
+ for both, and the time of a lookup get() for the
+ keyed table.
+
+ Usage: hashbench [lookup rounds]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_ROUNDS 200
+#define SET_SEQUENCE 0
+#define SET_SLOT 1
+#define SET_RANDOM 2
+
+static unsigned int oldtable[HASHSZ];
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Previous probe sequence of the hash table */
+static size_t oldHash(unsigned int ip, size_t i)
+{
+   size_t h1 = ip % HASHSZ;
+   size_t h2 = (ip % (HASHSZ - 1)) + 1;
+   return (h1 + i * h2) % HASHSZ;
+}
+
+
+/* Fills keys with an ip set, returns the number of keys */
+static size_t makeKeys(int set, unsigned int *keys, size_t max)
+{
+   unsigned long long k;
+   unsigned int seed = 2017;
+   size_t n = 0;
+
+   switch(set)
+   {
+      case SET_SEQUENCE:
+         for(k=12345;k<HT_DELETED && n<max;k+=(unsigned long long)HASHSZ*(HASHSZ-1))
+            keys[n++] = (unsigned int) k;
+         break;
+      case SET_SLOT:
+         for(k=12345;k<HT_DELETED && n<max;k+=HASHSZ)
+            keys[n++] = (unsigned int) k;
+         break;
+      default:
+         while(n < max)
+         {
+            k = nextRandom(&seed);
+            if(k != HT_EMPTY && k != HT_DELETED)
+               keys[n++] = (unsigned int) k;
+         }
+         break;
+   }
+
+   return n;
+}
+
+
+/* 
+ Inserts keys with the previous functions
+ Returns the longest probe sequence
+*/
+static size_t runOld(unsigned int *keys, size_t n)
+{
+   size_t i, j, index, maxprobe = 0;
+
+   memset(oldtable, 0, sizeof(oldtable));
+   for(j=0;j<n;j++)
+   {
+      for(i=0;i<HASHSZ;i++)
+      {
+         index = oldHash(keys[j], i);
+         if(oldtable[index] == HT_EMPTY)
+         {
+            oldtable[index] = keys[j];
+            break;
+         }
+      }
+      if(i + 1 > maxprobe)
+         maxprobe = i + 1;
+   }
+
+   return maxprobe;
+}
+
+
+/* Inserts and looks up keys in the keyed hash table */
+static void runKeyed(unsigned int *keys, size_t n, size_t rounds,
+                     size_t *maxprobe, double *ns)
+{
+   struct ip4bucket b;
+   struct ht_stats st;
+   unsigned long long start;
+   size_t j, r;
+   volatile size_t found = 0;
+
+   if(!initHashTable(HASHSZ))
+      exit(EXIT_FAILURE);
+
+   for(j=0;j<n;j++)
+   {
+      empty_ip4_bucket(&b);
+      rate_init(&b.state, &rate_classes[0], rate_now());
+      put(keys[j], b);
+   }
+   getHashStats(&st);
+   *maxprobe = st.max_probe;
+
+   start = monotonicNow();
+   for(r=0;r<rounds;r++)
+   {
+      ebr_enter();
+      for(j=0;j<n;j++)
+      {
+         if(get(keys[j]) != NULL)
+            found++;
+      }
+      ebr_exit();
+   }
+   *ns = (double)(monotonicNow() - start) / ((double)rounds * n);
+}
+
+
+int main(int argc, char* argv[])
+{
+   static const char *names[] = { "same sequence", "same slot", "random" };
+   unsigned int keys[HT_CAPACITY(HASHSZ)];
+   size_t rounds = DEFAULT_ROUNDS, n, oldmax, newmax;
+   double ns;
+   int set;
+
+   if(argc > 1)
+      rounds = strtoul(argv[1], NULL, 10);
+
+   if(rounds == 0)
+   {
+       fprintf(stderr,"Usage: %s [lookup rounds]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   printf("Table slots: %d\n", HASHSZ);
+   printf("ip set          ips  previous max probes  keyed max probes  keyed ns/lookup\n");
+   for(set=SET_SEQUENCE;set<=SET_RANDOM;set++)
+   {
+      n = makeKeys(set, keys, HT_CAPACITY(HASHSZ));
+      oldmax = runOld(keys, n);
+      runKeyed(keys, n, rounds, &newmax, &ns);
+      printf("%-13s %5zu  %19zu  %16zu  %15.2f\n",
+             names[set], n, oldmax, newmax, ns);
+   }
+
+   return 0;
+}
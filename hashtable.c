@@ -24,12 +24,60 @@
 
 /*
  A hash table implementation to store ip4 buckets
- It uses double hashing with the hash defines by the
- combination of the two auxiliary hash functions. 
- The hash table uses mutex to allow thread safe
- operation on the hash structure. 
- To read/change/modify hash data safely a data mutex 
- needs to be used by the modifier/readers.  
+ It uses double hashing, the first slot and the 
+ probe step of an ip are taken from a SipHash-1-3
+ of the ip with a random key picked by 
+ initHashTable(). The probe sequence of an ip 
+ cannot be predicted, so chosen ranges of ips do
+ not collide any more often than random ones. 
+ Changes to the hash structure (put, remove, evict)
+ are serialized by a mutex. Lookups take no lock. 
+
+ A key is published with a release store after its
+ bucket data is written, so a lookup that finds the
+ key sees the data. The bucket state is changed with
+ atomic compare and swap by the consumers and the
+ update thread. 
+
+ Removed items leave a deleted marker so that the
+ probe sequences of other keys stay intact, and a
+ lookup stops at the first empty slot. A removed 
+ slot is retired and only reused by put() after
+ a grace period of the epoch based reclamation, so
+ a lookup can never act on a slot that has been 
+ given to another ip. Lookups must be done inside
+ ebr_enter() and ebr_exit(). put() reclaims slots
+ whose grace period is over but never waits for
+ one, a reader stopped in a read section cannot 
+ stall the requests. Only the update thread waits.
+
+ When deleted slots build up, the update thread
+ copies the live buckets into the spare table and
+ swaps it in. The old table becomes the spare after
+ a grace period. 
+
+ When the table is at capacity, put() evicts a
+ bucket chosen by a CLOCK hand that looks at a
+ bounded number of slots. 
+
+ Each bucket has a rate class, whose limits
+ are used to consume, refill and evict it. 
+
+ With LAYOUT=SOA the bucket states and classes
+ are kept in dense arrays per table instead of 
+ the buckets, and the refill is a vector sweep 
+ over them that marks the full buckets in a 
+ bitmask. 
+
+ The slot count is set by initHashTable() and
+ rounded up to a prime. The tables are allocated
+ with hugeAlloc() by the thread that initializes
+ them, which should be the processing thread, so
+ that they sit on its NUMA node and in huge pages
+ when the size warrants it. With a shared memory
+ segment (shm.c) they are allocated from it and
+ shared with the clients of the tbshm library,
+ which look up and consume buckets the same way.
  
  Ng Chiang Lin
  April 2017
@@ -39,47 +87,563 @@
 #include "ratelimit.h"
 
 
-static struct ip4bucket ht[HASHSZ];
+static struct ip4bucket *tables[2];
+static size_t htsize;
+static size_t htcapacity;
+static size_t htreclaim;
+static size_t htpurge;
+static int hthuge;
+
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+/* dense bucket states and classes of tables[0] and tables[1] */
+static rate_state_t *states[2];
+static unsigned char *classes[2];
+
+/* full buckets found by the refill sweep */
+static unsigned long long *fullmask;
+#endif
+
+/* current table, swapped by purgeHashTable() */
+static struct ip4bucket *ht;
+static struct ip4bucket *spare;
+
 static size_t hashsize;
+static size_t hashused;
+static size_t clockhand;
+static struct ht_stats htstats;
+
+/* states of the buckets of the old table as purgeHashTable() copied them */
+static rate_state_t *purgeseen;
+
+/* removed slots waiting for a grace period */
+static size_t *retired;
+static size_t nretired;
+
+/* 
+ retired slots whose grace period started at
+ reclaimepoch, in the table reclaimtable
+*/
+static size_t *reclaiming;
+static size_t nreclaiming;
+static unsigned long reclaimepoch;
+static struct ip4bucket *reclaimtable;
+
+/* SipHash key */
+static unsigned long long seeds[2];
 
 /* hash lock for hash structure */
 static pthread_mutex_t htlock = PTHREAD_MUTEX_INITIALIZER;
 
-/* hash data lock for the data itself */
-pthread_mutex_t ht_datalock = PTHREAD_MUTEX_INITIALIZER;
+/* serializes the reclamation of retired slots */
+static pthread_mutex_t reclaimlock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Auxiliary hash function 1 */
-static size_t hash1(unsigned int ip)
+/* 
+ Returns the first slot of the probe sequence
+ of ip and sets step to its probe step
+*/
+static size_t probeStart(unsigned int ip, size_t *step)
 {
-   size_t ret = (size_t) (ip % HASHSZ);
-   return  ret;
+  return ip4ProbeStart(ip4Hash(seeds, ip), htsize, step);
 }
 
-/* Auxiliary hash function 2 */
-static size_t hash2(unsigned int ip)
+/* Returns the next slot of a probe sequence */
+static size_t probeNext(size_t index, size_t step)
 {
-   size_t ret = (size_t)  ( (ip % (HASHSZ -1)) + 1) ;
-   return ret;
+  index += step;
+  if(index >= htsize)
+    index -= htsize;
+  return index;
+}
+
+
+/* Loads the key of a slot for a lock free reader */
+static unsigned int slotKey(struct ip4bucket *b)
+{
+  return __atomic_load_n(&b->ipv4, __ATOMIC_ACQUIRE);
+}
+
+
+/* Returns the rate state of a bucket in one of the tables */
+static rate_state_t *bucketState(struct ip4bucket *b)
+{
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  if(b >= tables[1] && b < tables[1] + htsize)
+    return &states[1][b - tables[1]];
+  return &states[0][b - tables[0]];
+#else
+  return &b->state;
+#endif
+}
+
+
+/* Returns the rate class of a bucket in one of the tables */
+static unsigned char *bucketClass(struct ip4bucket *b)
+{
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  if(b >= tables[1] && b < tables[1] + htsize)
+    return &classes[1][b - tables[1]];
+  return &classes[0][b - tables[0]];
+#else
+  return &b->cls;
+#endif
+}
+
+
+/* Returns the limits of a bucket */
+static const struct rate_class *bucketLimits(struct ip4bucket *b)
+{
+  return &rate_classes[classIndex(*bucketClass(b))];
 }
 
+
+/* Returns 1 if the slot holds a bucket, 0 otherwise */
+static int isLive(struct ip4bucket *b)
+{
+  unsigned int k = slotKey(b);
+  return k != HT_EMPTY && k != HT_DELETED;
+}
+
+
 /* 
- Hash function for the key makes 
- use of hash function 1 and 2. 
- */
-static size_t hash(unsigned int ip, size_t i)
+ Returns 1 if put() can use the slot for 
+ a new key, 0 otherwise. htlock must be held. 
+*/
+static int isFree(struct ip4bucket *b)
 {
-  size_t ret = (size_t)(( hash1(ip) + i * hash2(ip) ) % HASHSZ );
-  return ret;
+  return b->ipv4 == HT_EMPTY || (b->ipv4 == HT_DELETED && !b->retired);
+}
+
+
+/* Returns 1 if n is a prime number, 0 otherwise */
+static int isPrime(size_t n)
+{
+  size_t d;
+
+  if(n < 2)
+    return 0;
+
+  for(d=2;d<=n/d;d++)
+  {
+    if(n % d == 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/* 
+ Allocates size bytes for a table array, from
+ the shared memory segment if there is one
+*/
+static void *tableAlloc(size_t size, int *huge)
+{
+  void *p = shmAlloc(size);
+
+  if(p == NULL)
+     return hugeAlloc(size, -1, huge);
+  if(huge != NULL)
+     *huge = HUGE_NONE;
+  return p;
+}
+
+
+/* Frees a table array from tableAlloc() */
+static void tableFree(void *p, size_t size)
+{
+  if(!shmFree(p, size))
+     hugeFree(p, size);
 }
 
 
-/* Initializes the hash table */
-void initHashTable(void)
+/* Frees the tables, htlock must be held */
+static void freeTables(void)
+{
+  tableFree(tables[0], htsize * sizeof(struct ip4bucket));
+  tableFree(tables[1], htsize * sizeof(struct ip4bucket));
+  hugeFree(retired, htsize * sizeof(size_t));
+  hugeFree(reclaiming, htsize * sizeof(size_t));
+  hugeFree(purgeseen, htsize * sizeof(rate_state_t));
+  tables[0] = tables[1] = NULL;
+  retired = reclaiming = NULL;
+  purgeseen = NULL;
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  tableFree(states[0], htsize * sizeof(rate_state_t));
+  tableFree(states[1], htsize * sizeof(rate_state_t));
+  tableFree(classes[0], htsize);
+  tableFree(classes[1], htsize);
+  hugeFree(fullmask, (htsize + 63) / 64 * sizeof(unsigned long long));
+  states[0] = states[1] = NULL;
+  classes[0] = classes[1] = NULL;
+  fullmask = NULL;
+#endif
+  htsize = 0;
+}
+
+
+/* 
+ Initializes the hash table with at least
+ slots slots, HASHSZ if slots is 0. 
+ Memory is allocated on the NUMA node of the
+ calling thread, a table of the same size is
+ reused. Must not be called while the table 
+ is in use. 
+ Returns 1 if successful, 0 otherwise.
+*/
+int initHashTable(size_t slots)
 {
-  size_t i;
+  size_t i, n;
+  int huge0, huge1, ok;
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  rate_state_t idle;
+#endif
+
+  if(slots == 0)
+    slots = HASHSZ;
+  if(slots < CLOCK_MAX_SCAN)
+    slots = CLOCK_MAX_SCAN;
+  for(n=slots;!isPrime(n);n++)
+    ;
+
+  pthread_mutex_lock(&htlock);
+  if(n != htsize)
+  {
+    freeTables();
+    tables[0] = tableAlloc(n * sizeof(struct ip4bucket), &huge0);
+    tables[1] = tableAlloc(n * sizeof(struct ip4bucket), &huge1);
+    retired = hugeAlloc(n * sizeof(size_t), -1, NULL);
+    reclaiming = hugeAlloc(n * sizeof(size_t), -1, NULL);
+    purgeseen = hugeAlloc(n * sizeof(rate_state_t), -1, NULL);
+    htsize = n;
+    ok = tables[0] != NULL && tables[1] != NULL && 
+         retired != NULL && reclaiming != NULL && purgeseen != NULL;
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+    states[0] = tableAlloc(n * sizeof(rate_state_t), NULL);
+    states[1] = tableAlloc(n * sizeof(rate_state_t), NULL);
+    classes[0] = tableAlloc(n, NULL);
+    classes[1] = tableAlloc(n, NULL);
+    fullmask = hugeAlloc((n + 63) / 64 * sizeof(unsigned long long), -1, NULL);
+    ok = ok && states[0] != NULL && states[1] != NULL && fullmask != NULL &&
+         classes[0] != NULL && classes[1] != NULL;
+#endif
+    if(!ok)
+    {
+      freeTables();
+      __atomic_store_n(&ht, NULL, __ATOMIC_RELEASE);
+      spare = NULL;
+      pthread_mutex_unlock(&htlock);
+      fprintf(stderr, "Unable to allocate hash table of %zu slots\n", n);
+      return 0;
+    }
+    hthuge = huge0 < huge1 ? huge0 : huge1;
+  }
+  else
+  {
+    for(i=0;i<htsize;i++)
+    {
+      empty_ip4_bucket(&tables[0][i]);
+      empty_ip4_bucket(&tables[1][i]);
+    }
+  }
+
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  idle = rate_idle(rate_now());
+  for(i=0;i<htsize;i++)
+  {
+    states[0][i] = states[1][i] = idle;
+    classes[0][i] = classes[1][i] = 0;
+  }
+#endif
+
+  randomSeeds(seeds, 2);
+  htcapacity = HT_CAPACITY(htsize);
+  htreclaim = HT_RECLAIM(htsize);
+  htpurge = HT_PURGE(htsize);
+
   hashsize=0;
-  for(i=0;i<HASHSZ;i++)
-    empty_ip4_bucket(&ht[i]);
+  hashused=0;
+  clockhand=0;
+  nretired=0;
+  nreclaiming=0;
+  memset(&htstats, 0, sizeof(htstats));
+  spare = tables[1];
+  __atomic_store_n(&ht, tables[0], __ATOMIC_RELEASE);
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  shareHashTable(tables, states, classes, htsize, seeds);
+#else
+  shareHashTable(tables, NULL, NULL, htsize, seeds);
+#endif
+  pthread_mutex_unlock(&htlock);
+
+  return 1;
+}
+
+
+/*
+ Removes the bucket in slot i, leaving a
+ deleted marker. The slot is retired until
+ reclaimHashItems() has seen a grace period. 
+ Readers may still be using the bucket data
+ so it is left alone. htlock must be held.
+*/
+static void deleteSlot(size_t i)
+{
+  hashsize--;
+  ht[i].retired = 1;
+  __atomic_store_n(&ht[i].ref, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&ht[i].ipv4, HT_DELETED, __ATOMIC_RELEASE);
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+  __atomic_store_n(bucketState(&ht[i]), rate_idle(rate_now()), __ATOMIC_RELAXED);
+#endif
+  retired[nretired] = i;
+  __atomic_store_n(&nretired, nretired + 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Evicts a bucket using a CLOCK hand. 
+ A bucket that is full is taken right away, 
+ otherwise the first bucket that has not been
+ used since the hand last passed it. Buckets
+ passed over lose their reference bit. 
+ At most CLOCK_MAX_SCAN slots are looked at, 
+ if all of them were used the first one passed
+ is evicted rather than going round the table. 
+ htlock must be held. 
+ Returns 1 if a bucket is evicted, 0 otherwise.
+*/
+static size_t evictHashItem(void)
+{
+  size_t n, i, victim=htsize, first=htsize;
+  unsigned long long now;
+  rate_state_t state;
+
+  now = rate_now();
+  for(n=0;n<CLOCK_MAX_SCAN;n++)
+  {
+     if(n >= CLOCK_SCAN && victim != htsize)
+        break;
+
+     i = clockhand;
+     clockhand++;
+     if(clockhand == htsize)
+        clockhand = 0;
+
+     if(!isLive(&ht[i]))
+        continue;
+
+     if(first == htsize)
+        first = i;
+
+     state = __atomic_load_n(bucketState(&ht[i]), __ATOMIC_RELAXED);
+     if(rate_full(&state, bucketLimits(&ht[i]), now))
+     {
+        deleteSlot(i);
+        htstats.evicted_full++;
+        return 1;
+     }
+
+     if(__atomic_load_n(&ht[i].ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&ht[i].ref, 0, __ATOMIC_RELAXED); //second chance
+     else if(victim == htsize)
+        victim = i;
+  }
+
+  if(victim == htsize)
+     victim = first;
+
+  if(victim == htsize)
+  {
+     htstats.evict_failed++;
+     return 0;
+  }
+
+  deleteSlot(victim);
+  htstats.evicted_lru++;
+  return 1;
+}
+
+
+/*
+ Starts the grace period of the slots retired
+ so far, unless those of an earlier batch are 
+ still waiting for theirs. reclaimlock must be
+ held. 
+*/
+static void startReclaim(void)
+{
+   pthread_mutex_lock(&htlock);
+   if(nreclaiming == 0 && nretired > 0)
+   {
+      nreclaiming = nretired;
+      memcpy(reclaiming, retired, nreclaiming * sizeof(size_t));
+      __atomic_store_n(&nretired, 0, __ATOMIC_RELAXED);
+      reclaimtable = ht;
+      reclaimepoch = ebr_advance();
+   }
+   pthread_mutex_unlock(&htlock);
+}
+
+
+/*
+ Makes the slots of the batch whose grace period
+ is over available to put() again. They are 
+ dropped if the table has been purged meanwhile.
+ reclaimlock must be held. 
+ Returns the number of slots reclaimed
+*/
+static size_t finishReclaim(void)
+{
+   size_t i, n = nreclaiming;
+
+   pthread_mutex_lock(&htlock);
+   if(reclaimtable == ht)
+   {
+      for(i=0;i<n;i++)
+         ht[reclaiming[i]].retired = 0;
+      htstats.reclaimed += n;
+   }
+   pthread_mutex_unlock(&htlock);
+   nreclaiming = 0;
+
+   return n;
+}
+
+
+/*
+ Reclaims for put() without waiting. The batch
+ whose grace period is over is reclaimed and 
+ the slots retired since start their own. A
+ batch still in use by a reader, such as a shm
+ client stopped in a read section, is left to
+ a later call or to the update thread. 
+*/
+static void tryReclaim(void)
+{
+   if(pthread_mutex_trylock(&reclaimlock) != 0)
+      return;
+
+   startReclaim();
+   if(nreclaiming > 0 && ebr_passed(reclaimepoch))
+   {
+      finishReclaim();
+      startReclaim();
+   }
+   pthread_mutex_unlock(&reclaimlock);
+}
+
+
+/*
+ Returns the slot for key k, the slot of its
+ bucket or the first free slot of its probe
+ sequence, htsize if there is none. Sets 
+ probes to the length of the probe sequence. 
+ htlock must be held. 
+*/
+static size_t putSlot(unsigned int k, size_t *probes)
+{
+    size_t i=0, index, slot=htsize, step;
+
+    index = probeStart(k, &step);
+    while(i < htsize)
+    {
+        if (ht[index].ipv4 == k)
+        {//duplicate, old value is overwritten
+          slot = index;
+          break;
+        }
+
+        if (ht[index].ipv4 == HT_DELETED)
+        {//reuse the first deleted slot past its grace period
+          if(slot == htsize && isFree(&ht[index]))
+             slot = index;
+        }
+        else if (ht[index].ipv4 == HT_EMPTY)
+        {//key not present
+          if(slot == htsize)
+             slot = index;
+          break;
+        }
+
+        i++; 
+        index = probeNext(index, step);
+    }
+
+    *probes = i;
+    return slot;
+}
+
+
+/*
+ Stores bucket v for key k in the free slot 
+ found by putSlot(), after a probe sequence
+ of probes slots. The data is written before
+ the key. htlock must be held. 
+*/
+static void storeSlot(size_t slot, unsigned int k, struct ip4bucket *v, size_t probes)
+{
+    if(ht[slot].ipv4 == HT_EMPTY)
+       hashused++;
+    hashsize++;
+    if(probes >= htstats.max_probe)
+       htstats.max_probe = probes + 1;
+
+    copy_ip4_bucket_data(v ,&ht[slot]); //data before key
+    *bucketClass(&ht[slot]) = v->cls;
+    __atomic_store_n(bucketState(&ht[slot]), v->state, __ATOMIC_RELAXED);
+    ht[slot].ref = 1;
+    __atomic_store_n(&ht[slot].ipv4, k, __ATOMIC_RELEASE);
+}
+
+
+/*
+ Adds bucket v for key k, replacing the bucket
+ of k if it is present and replace is set. 
+ See put(). 
+ Returns 1 if successful, 0 otherwise.
+*/
+static size_t putBucket(unsigned int k, struct ip4bucket *v, int replace)
+{
+    size_t slot, probes; 
+   
+    if(k==HT_EMPTY || k==HT_DELETED)
+      return 0;
+
+    if(__atomic_load_n(&nretired, __ATOMIC_RELAXED) >= htreclaim)
+      tryReclaim();
+
+    pthread_mutex_lock(&htlock);
+    slot = putSlot(k, &probes);
+    
+    if(slot == htsize)
+    {
+       pthread_mutex_unlock(&htlock); //unlock hash
+       return 0;     
+    }
+
+    if(ht[slot].ipv4 == k)
+    {//existing bucket, readers may be using it
+       if(replace)
+       {
+          *bucketClass(&ht[slot]) = v->cls;
+          __atomic_store_n(bucketState(&ht[slot]), v->state, __ATOMIC_RELAXED);
+          __atomic_store_n(&ht[slot].ref, 1, __ATOMIC_RELAXED);
+       }
+       pthread_mutex_unlock(&htlock); //unlock hash
+       return (size_t) replace;
+    }
+
+    //new hash entry
+    if(hashsize >= htcapacity && !evictHashItem())
+    {
+       pthread_mutex_unlock(&htlock); //unlock hash
+       return 0;
+    }
+
+    storeSlot(slot, k, v, probes);
+
+    pthread_mutex_unlock(&htlock); //unlock hash
+    return 1; 
 }
 
 
@@ -87,51 +651,148 @@ void initHashTable(void)
  Adds a ip4bucket item into the hash table 
  Takes an integer value as the hash key 
  and the ip4bucket struct to be added.
+ The bucket of a key already present is 
+ replaced. If the table is at capacity a 
+ bucket is evicted to make room. Once 
+ HT_RECLAIM() slots are retired put() also 
+ reclaims them, so evictions do not run out
+ of free slots between two runs of the update
+ thread. It never waits for a grace period for
+ that, see tryReclaim(). 
+ Must not be called inside a read section. 
  Returns 1 if successful, 0 otherwise.
 */
 size_t put(unsigned int k, struct ip4bucket v)
 {
-    size_t i, ret, index; 
-   
-    i=0; ret =0;
-   
-    if(k==0)
-      return ret;
+    return putBucket(k, &v, 1);
+}
+
+
+/*
+ Adds bucket v for key k as put() does, unless
+ k is already present. A thread that did not 
+ find k may race another one adding it, the 
+ bucket of the winner is then kept and the 
+ loser consumes from it. 
+ Must not be called inside a read section. 
+ Returns 1 if added, 0 if k is present or on
+ failure.
+*/
+size_t putNew(unsigned int k, struct ip4bucket v)
+{
+    return putBucket(k, &v, 0);
+}
+
+
+/* Records ahead of the one loaded whose first slot is prefetched */
+#define PRELOAD_AHEAD 16
 
+/*
+ Adds the buckets of the n dump records r in 
+ one pass under a single hold of htlock, with
+ the tokens of each record left at time now. 
+ A record replaces the bucket of its key. Full
+ buckets are skipped, they would be removed by
+ the next refill, and nothing is evicted: the 
+ load stops once the table is at capacity. 
+ Returns the number of records loaded
+*/
+size_t preloadHashTable(const struct dump_record *r, size_t n, unsigned long long now)
+{
+    struct ip4bucket v;
+    const struct rate_class *c;
+    size_t i, slot, probes, step, loaded=0;
 
     pthread_mutex_lock(&htlock);
-    while(i < HASHSZ)
+    for(i=0;i<n;i++)
     {
-        index = hash(k, i);
-        if (ht[index].ipv4 == 0 || ht[index].ipv4 == k )
-        {//empty slot or duplicate
-         //for duplicate old value is overwritten
-         
-          if(ht[index].ipv4 == 0 ) //new hash entry
-          {      
-               hashsize++;
-               ht[index].ipv4 = k;
-          }
-          ret=1;
+       if(i + PRELOAD_AHEAD < n) //the keys are random, their slots are not cached
+          __builtin_prefetch(&ht[probeStart(r[i + PRELOAD_AHEAD].key, &step)], 1, 1);
 
-          pthread_mutex_lock(&ht_datalock); //lock data
-          pthread_mutex_unlock(&htlock); //unlock hash
+       if(r[i].key == HT_EMPTY || r[i].key == HT_DELETED)
+          continue;
 
-          copy_ip4_bucket_data(&v ,&ht[index]); //update data
-          pthread_mutex_unlock(&ht_datalock); //unlock data
-           
-          return ret; 
-        }
-        else 
-        {
-           i++; 
-        }
+       c = &rate_classes[r[i].cls];
+       if(r[i].tokens >= c->burst)
+          continue;
+
+       empty_ip4_bucket(&v);
+       v.cls = r[i].cls;
+       rate_init_used(&v.state, c->burst - (r[i].tokens < 0 ? 0 : r[i].tokens), c, now);
+
+       slot = putSlot(r[i].key, &probes);
+       if(slot == htsize)
+          continue;
+       if(ht[slot].ipv4 == r[i].key)
+       {
+          *bucketClass(&ht[slot]) = v.cls;
+          __atomic_store_n(bucketState(&ht[slot]), v.state, __ATOMIC_RELAXED);
+          loaded++;
+          continue;
+       }
+       if(hashsize >= htcapacity)
+          break;
+
+       formatIP4(r[i].key, v.addr);
+       storeSlot(slot, r[i].key, &v, probes);
+       loaded++;
     }
-    
-   pthread_mutex_unlock(&htlock); //unlock hash
-   return ret;     
+    pthread_mutex_unlock(&htlock);
+
+    return loaded;
 }
 
+
+/*
+ Copies up to max live buckets into out as 
+ dump records, with the tokens they have at 
+ time now. No lock is taken, the buckets are
+ read as the consumers read them and consumers
+ go on meanwhile. The read section is left 
+ every DUMP_CHUNK slots, so a large table does
+ not hold back the reclamation of put(). 
+ Must be called by the thread that refills 
+ and purges the table, outside of a read 
+ section: no bucket is then refilled and the
+ table is not swapped during the copy. 
+ Returns the number of buckets copied
+*/
+size_t snapshotHashTable(struct dump_record *out, size_t max, unsigned long long now)
+{
+    struct ip4bucket *t;
+    rate_state_t state;
+    unsigned int k;
+    unsigned char cls;
+    size_t i, n=0;
+
+    ebr_enter();
+    t = __atomic_load_n(&ht, __ATOMIC_ACQUIRE);
+    for(i=0;t!=NULL && i<htsize && n<max;i++)
+    {
+       if(i > 0 && i % DUMP_CHUNK == 0)
+       {
+          ebr_exit();
+          ebr_enter();
+       }
+
+       k = slotKey(&t[i]);
+       if(k == HT_EMPTY || k == HT_DELETED)
+          continue;
+
+       state = __atomic_load_n(bucketState(&t[i]), __ATOMIC_RELAXED);
+       cls = classIndex(*bucketClass(&t[i]));
+       out[n].key = k;
+       out[n].tokens = rate_tokens(&state, &rate_classes[cls], now);
+       out[n].cls = cls;
+       memset(out[n].pad, 0, sizeof(out[n].pad));
+       n++;
+    }
+    ebr_exit();
+
+    return n;
+}
+
+
 /*
  Retrieves a ip4 bucket item
  from hash table at the specified
@@ -142,20 +803,60 @@ size_t put(unsigned int k, struct ip4bucket v)
  or hash item is empty. 
  Returns a pointer to the ip4bucket item
  in the hash table if not empty. 
+ Must be called inside ebr_enter() and
+ ebr_exit(), the pointer is only valid 
+ until ebr_exit(). 
 */
 struct ip4bucket *getHashItem(size_t i)
 {
-   struct ip4bucket * ret= NULL; 
-   pthread_mutex_lock(&htlock);
-   if (i < HASHSZ  && ht[i].ipv4 != 0)
+   struct ip4bucket *t;
+
+   t = __atomic_load_n(&ht, __ATOMIC_ACQUIRE);
+   if (t == NULL || i >= htsize)
+      return NULL;
+
+   if (isLive(&t[i]))
+      return &t[i];
+
+   return NULL; 
+}
+
+/*
+ Looks up key k in table t, starting at slot
+ index of its probe sequence with step step. 
+ Sets the reference bit of the bucket found. 
+ Must be called inside a read section. 
+*/
+static struct ip4bucket *lookup(struct ip4bucket *t, unsigned int k,
+                                size_t index, size_t step)
+{
+   size_t i=0;
+   unsigned int key;
+
+   if(k==HT_EMPTY || k==HT_DELETED)
+      return NULL;
+
+   while(i < htsize)
    {
-      ret = &ht[i];
-      pthread_mutex_unlock(&htlock);
-      return ret;
+      key = slotKey(&t[index]);
+      if(key == k)
+      {
+        if(!__atomic_load_n(&t[index].ref, __ATOMIC_RELAXED))
+           __atomic_store_n(&t[index].ref, 1, __ATOMIC_RELAXED);
+        return &t[index];
+      } 
+      else if(key == HT_EMPTY)
+      {
+        break;
+      }
+      else
+      {
+        i++;
+        index = probeNext(index, step);
+      }
    }
 
-   pthread_mutex_unlock(&htlock);
-   return ret; 
+   return NULL; 
 }
 
 /*
@@ -164,46 +865,117 @@ struct ip4bucket *getHashItem(size_t i)
  Takes unsigned int key as parameter.
  Returns the a pointer to ip4bucket
  item if found, NULL otherwise.   
+ The reference bit of the bucket is set
+ for the CLOCK eviction. 
 
- Note there can be a potential race
- condition where a caller of this function
- obtains a reference to a hash item, but before
- it can use the item, another thread removes
- the item from the hash table. 
- In this case, this is not a critical issue. 
- We allow this since the hash item is only 
- meant for rate limiting. If the caller 
- continue to use the removed hash item to 
- decide whether access to a resource is within 
- limit, it is alright to be slightly wrong 
- and allow one more access.  
+ No lock is taken. Must be called inside 
+ ebr_enter() and ebr_exit(), the slot is 
+ not given to another ip until ebr_exit().
+ The bucket may still be removed meanwhile,
+ its key then changes to HT_DELETED. 
 */
 struct ip4bucket* get(unsigned int k)
 {
+   struct ip4bucket *t;
+   size_t index, step;
 
-   size_t i, index;
-   i=0;
-
-   if(k==0)
+   t = __atomic_load_n(&ht, __ATOMIC_ACQUIRE);
+   if(t == NULL)
       return NULL;
 
-   pthread_mutex_lock(&htlock);
-   while(i < HASHSZ)
+   index = probeStart(k, &step);
+   return lookup(t, k, index, step);
+}
+
+/*
+ Consumes cost tokens from bucket b found for
+ key k, looking k up again if b is removed 
+ meanwhile, and sets seen to the state of the
+ bucket. Must be called inside a read section. 
+ Returns 1 if within rate limit, 0 if the 
+ rate limit is exceeded and -1 if there 
+ is no bucket for k. 
+*/
+static int consumeFound(unsigned int k, struct ip4bucket *b, int cost, 
+                        unsigned long long now, rate_state_t *seen)
+{
+   int ret;
+
+   while(b != NULL)
+   {
+      ret = rate_consume_atomic(bucketState(b), cost, bucketLimits(b), now, seen);
+      if(slotKey(b) == k)
+         return ret;
+      b = get(k);
+   }
+
+   return -1;
+}
+
+/*
+ Consumes cost tokens from the bucket of key k
+ at time now without taking a lock, and sets
+ seen to the state of the bucket. 
+ If the bucket is removed while the token is
+ taken the lookup is done again. 
+ Returns 1 if within rate limit, 0 if the 
+ rate limit is exceeded and -1 if there 
+ is no bucket for k. 
+*/
+int consumeBucket(unsigned int k, int cost, unsigned long long now, rate_state_t *seen)
+{
+   int ret;
+
+   ebr_enter();
+   ret = consumeFound(k, get(k), cost, now, seen);
+   ebr_exit();
+
+   return ret;
+}
+
+
+/*
+ Consumes costs[i] tokens for each of the n 
+ keys at time now, in the same way as 
+ consumeBucket(). 
+ The slots of BATCH_MAX keys at a time are 
+ hashed and prefetched before any is looked
+ at, so that their cache misses overlap. 
+ Sets results[i] to 1 if keys[i] is within
+ rate limit, 0 if the rate limit is exceeded 
+ and -1 if there is no bucket for keys[i], 
+ and seen[i] to the state of its bucket. 
+*/
+void consumeBatch(const unsigned int *keys, const int *costs, size_t n, 
+                  unsigned long long now, int *results, rate_state_t *seen)
+{
+   struct ip4bucket *t;
+   size_t i, j, m, index[BATCH_MAX], step[BATCH_MAX];
+
+   ebr_enter();
+   t = __atomic_load_n(&ht, __ATOMIC_ACQUIRE);
+   for(j=0;j<n;j+=BATCH_MAX)
    {
-      index = hash(k,i);
-      if(ht[index].ipv4  != 0 && ht[index].ipv4 == k)
+      m = n - j < BATCH_MAX ? n - j : BATCH_MAX;
+      if(t == NULL)
       {
-        pthread_mutex_unlock(&htlock);
-        return &ht[index];
-      } 
-      else
+         for(i=0;i<m;i++)
+            results[j + i] = -1;
+         continue;
+      }
+
+      for(i=0;i<m;i++)
       {
-        i++;
+         index[i] = probeStart(keys[j + i], &step[i]);
+         __builtin_prefetch(&t[index[i]], 1, 1);
       }
-   }
 
-   pthread_mutex_unlock(&htlock);
-   return NULL; 
+      for(i=0;i<m;i++)
+         results[j + i] = consumeFound(keys[j + i], 
+                                       lookup(t, keys[j + i], index[i], step[i]),
+                                       costs[j + i], now, &seen[j + i]);
+   }
+   ebr_exit();
 }
 
 /*
@@ -216,33 +988,30 @@ struct ip4bucket* get(unsigned int k)
 
 size_t removeHashItem(unsigned int k)
 {
-   size_t i, index, ret;
+   size_t i, index, ret, step;
    i=0; ret=0;
 
-    if(k==0)
+    if(k==HT_EMPTY || k==HT_DELETED)
       return ret;
 
    pthread_mutex_lock(&htlock);
-   while(i < HASHSZ)
+   index = probeStart(k, &step);
+   while(i < htsize)
    {
-      index=hash(k, i);
-      if(ht[index].ipv4  != 0 && ht[index].ipv4 == k)
+      if(ht[index].ipv4 == k)
       {
           ret=1;
-          hashsize--; 
-          ht[index].ipv4 = 0;
-          
-          pthread_mutex_lock(&ht_datalock); //lock data
-          pthread_mutex_unlock(&htlock); // unlock hash
-
-          empty_ip4_bucket(&ht[index]); //empty data
-          pthread_mutex_unlock(&ht_datalock); //unlock data
-          
-          return ret;
+          deleteSlot(index);
+          break;
       }       
+      else if(ht[index].ipv4 == HT_EMPTY)
+      {
+         break;
+      }
       else
       {
          i++;
+         index = probeNext(index, step);
       }
 
    }
@@ -252,3 +1021,231 @@ size_t removeHashItem(unsigned int k)
 }
 
 
+/*
+ Checks every bucket in the table at time now,
+ once refillClasses() has refilled them, and
+ removes the buckets that are full. 
+ Called by the update thread, outside of a 
+ read section. 
+ Returns the number of buckets removed. 
+*/
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+size_t refillHashTable(unsigned long long now)
+{
+   struct ip4bucket *t;
+   rate_state_t state;
+   unsigned long long bits;
+   size_t i, w, removed=0;
+   unsigned int k;
+
+   //only the update thread swaps the table
+   t = __atomic_load_n(&ht, __ATOMIC_ACQUIRE);
+   if(t == NULL || rate_sweep(bucketState(t), bucketClass(t), htsize, now, fullmask) == 0)
+      return 0;
+
+   for(w=0;w<(htsize + 63) / 64;w++)
+   {
+      bits = fullmask[w];
+      while(bits != 0)
+      {
+         i = w * 64 + (size_t) __builtin_ctzll(bits);
+         bits &= bits - 1;
+
+         k = slotKey(&t[i]);
+         if(k == HT_EMPTY || k == HT_DELETED)
+            continue;
+
+         state = __atomic_load_n(bucketState(&t[i]), __ATOMIC_RELAXED);
+         if(rate_full(&state, bucketLimits(&t[i]), now))
+            removed += removeHashItem(k);
+      }
+   }
+
+   return removed;
+}
+#else
+size_t refillHashTable(unsigned long long now)
+{
+   struct ip4bucket *ipb;
+   size_t i, removed=0;
+   unsigned int k;
+   int full;
+
+   for(i=0;i<htsize;i++)
+   {
+      full = 0;
+      k = HT_EMPTY;
+      ebr_enter();
+      ipb = getHashItem(i);
+      if(ipb != NULL)
+      {
+         k = slotKey(ipb);
+         full = rate_refill_atomic(bucketState(ipb), bucketLimits(ipb), now);
+      }
+      ebr_exit();
+
+      if(full && k != HT_DELETED)
+         removed += removeHashItem(k);
+   }
+
+   return removed;
+}
+#endif
+
+
+/*
+ Makes the slots retired so far available to
+ put() again once every reader that could 
+ still see them has left its read section, 
+ first those of a batch started by put(). 
+ Waits for the readers, so it is only called
+ by the update thread, outside of a read 
+ section. 
+ Returns the number of slots reclaimed. 
+*/
+size_t reclaimHashItems(void)
+{
+   size_t n=0;
+   int round;
+
+   pthread_mutex_lock(&reclaimlock);
+   for(round=0;round<2;round++)
+   {
+      startReclaim();
+      if(nreclaiming == 0)
+         break;
+      while(!ebr_passed(reclaimepoch))
+         sched_yield();
+      n += finishReclaim();
+   }
+   pthread_mutex_unlock(&reclaimlock);
+
+   return n;
+}
+
+
+/*
+ Charges the buckets of the current table with
+ the requests taken from the old table while 
+ purgeHashTable() copied it from time then. 
+ The old table must be out of use. 
+*/
+static void replayPurge(struct ip4bucket *old, unsigned long long then)
+{
+   struct ip4bucket *b;
+   rate_state_t state;
+   size_t j;
+
+   ebr_enter();
+   for(j=0;j<htsize;j++)
+   {
+      if(!isLive(&old[j]))
+         continue;
+
+      state = __atomic_load_n(bucketState(&old[j]), __ATOMIC_RELAXED);
+      if(state == purgeseen[j])
+         continue;
+
+      b = get(old[j].ipv4);
+      if(b != NULL)
+         rate_replay_atomic(bucketState(b), purgeseen[j], state, bucketLimits(b),
+                            then, rate_now());
+   }
+   ebr_exit();
+}
+
+
+/*
+ Purges the deleted markers once used and
+ deleted slots exceed HT_PURGE(), by copying
+ every bucket into the emptied spare table 
+ and swapping it in. The old table becomes
+ the spare after a grace period. 
+ The requests that take tokens from the old
+ table while the copy is made are charged to
+ the new table once the grace period is over,
+ from the states the copy started with. 
+ Called by the update thread, outside of a 
+ read section. 
+ Returns the number of deleted slots purged. 
+*/
+size_t purgeHashTable(void)
+{
+   struct ip4bucket *old;
+   size_t i, j, index, step, purged;
+   unsigned long long then;
+
+   pthread_mutex_lock(&htlock);
+   if(hashused <= htpurge)
+   {
+      pthread_mutex_unlock(&htlock);
+      return 0;
+   }
+
+   then = rate_now();
+   for(i=0;i<htsize;i++)
+   {
+      empty_ip4_bucket(&spare[i]);
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+      *bucketState(&spare[i]) = rate_idle(then);
+      *bucketClass(&spare[i]) = 0;
+#endif
+   }
+
+   for(j=0;j<htsize;j++)
+   {
+      if(!isLive(&ht[j]))
+         continue;
+
+      index = probeStart(ht[j].ipv4, &step);
+      for(i=0;i<htsize;i++)
+      {
+         if(spare[index].ipv4 == HT_EMPTY)
+         {
+            spare[index] = ht[j];
+            *bucketClass(&spare[index]) = *bucketClass(&ht[j]);
+            purgeseen[j] = __atomic_load_n(bucketState(&ht[j]), __ATOMIC_RELAXED);
+            __atomic_store_n(bucketState(&spare[index]), purgeseen[j], __ATOMIC_RELAXED);
+            spare[index].retired = 0;
+            break;
+         }
+         index = probeNext(index, step);
+      }
+   }
+
+   old = ht;
+   __atomic_store_n(&ht, spare, __ATOMIC_RELEASE);
+   shareCurrentTable(spare == tables[1]);
+   spare = NULL;
+
+   purged = hashused - hashsize;
+   hashused = hashsize;
+   __atomic_store_n(&nretired, 0, __ATOMIC_RELAXED);
+   htstats.purges++;
+   pthread_mutex_unlock(&htlock);
+
+   ebr_synchronize();
+   replayPurge(old, then);
+
+   pthread_mutex_lock(&htlock);
+   spare = old;
+   pthread_mutex_unlock(&htlock);
+
+   return purged;
+}
+
+
+/* Copies the hash table statistics into s */
+void getHashStats(struct ht_stats *s)
+{
+   if(s == NULL)
+      return;
+
+   pthread_mutex_lock(&htlock);
+   *s = htstats;
+   s->size = hashsize;
+   s->slots = htsize;
+   s->capacity = htcapacity;
+   s->huge = hthuge;
+   pthread_mutex_unlock(&htlock);
+}
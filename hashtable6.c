@@ -0,0 +1,545 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ A hash table to store ip6 buckets keyed on
+ 128 bit IPv6 prefixes.
+
+ A key is twice the size of an ipv4 key, so the
+ table keeps a one byte tag of each slot in a
+ separate array. A slot is only compared when its
+ tag matches, 7 bits of the hash of its key, and
+ 64 tags share a cache line. A lookup reads the
+ tag line and, except for about 1 in 128 probes,
+ only the bucket it is looking for. Buckets are
+ 32 bytes so that none crosses a cache line.
+
+ The slots are probed linearly from the slot
+ picked by a SipHash-1-3 of the key with a random
+ key. Removals shift the following buckets of the
+ run back instead of leaving deleted markers, so
+ the table never needs to be purged.
+
+ The table is smaller and less used than the ipv4
+ table and is changed and read under a single
+ mutex. When it is at capacity a bucket is evicted
+ by a CLOCK hand in the same way as the ipv4 table.
+
+ The composite keys of scoped requests (scope.c)
+ are also 128 bits and are kept in a second table
+ of the same kind, with its own lock and seeds. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+/* tag of an empty slot, used slots have the top bit set */
+#define TAG_EMPTY 0
+
+struct table6
+{
+ struct ip6bucket *slots;
+ unsigned char *tags;
+ size_t size;
+ size_t mask;
+ size_t capacity;
+ size_t used;
+ size_t clockhand;
+ int huge;
+ struct ht_stats stats;
+ unsigned long long seeds[2]; /* SipHash key */
+ pthread_mutex_t lock;
+};
+
+/* the ipv6 table and the table of the scoped keys */
+static struct table6 ip6table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct table6 scopetable = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ SipHash-1-3 of the 16 byte key, two blocks
+ and the length block
+*/
+static unsigned long long sipHash6(const struct table6 *t, const struct ip6key *k)
+{
+   unsigned long long v0 = t->seeds[0] ^ 0x736f6d6570736575ULL;
+   unsigned long long v1 = t->seeds[1] ^ 0x646f72616e646f6dULL;
+   unsigned long long v2 = t->seeds[0] ^ 0x6c7967656e657261ULL;
+   unsigned long long v3 = t->seeds[1] ^ 0x7465646279746573ULL;
+   unsigned long long m[3];
+   size_t i;
+
+   m[0] = k->hi;
+   m[1] = k->lo;
+   m[2] = 16ULL << 56;
+
+   for(i=0;i<3;i++)
+   {
+      v3 ^= m[i];
+      SIPROUND(v0, v1, v2, v3);
+      v0 ^= m[i];
+   }
+
+   v2 ^= 0xff;
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+
+   return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/* Returns the tag of a hash, never TAG_EMPTY */
+static unsigned char hashTag(unsigned long long h)
+{
+   return (unsigned char)(0x80 | (h >> 57));
+}
+
+
+/* Returns the distance of slot i from the home slot of its bucket */
+static size_t probeDistance(const struct table6 *t, size_t i)
+{
+   return (i - (t->slots[i].hash & t->mask)) & t->mask;
+}
+
+
+/*
+ Returns the slot of key k with hash h,
+ the size of the table if it is not 
+ present. The lock must be held.
+*/
+static size_t findSlot(const struct table6 *t, const struct ip6key *k, unsigned long long h)
+{
+   size_t i = h & t->mask;
+   unsigned char tag = hashTag(h);
+
+   while(t->tags[i] != TAG_EMPTY)
+   {
+      if(t->tags[i] == tag && t->slots[i].key.hi == k->hi && t->slots[i].key.lo == k->lo)
+         return i;
+      i = (i + 1) & t->mask;
+   }
+
+   return t->size;
+}
+
+
+/*
+ Removes the bucket in slot i and moves the
+ following buckets of the run back to fill
+ the gap. The lock must be held.
+*/
+static void deleteSlot6(struct table6 *t, size_t i)
+{
+   size_t j = i;
+
+   while(1)
+   {
+      j = (j + 1) & t->mask;
+      if(t->tags[j] == TAG_EMPTY)
+         break;
+
+      /* j can move to i if i is not before its home slot */
+      if(probeDistance(t, j) >= ((j - i) & t->mask))
+      {
+         t->tags[i] = t->tags[j];
+         t->slots[i] = t->slots[j];
+         i = j;
+      }
+   }
+
+   t->tags[i] = TAG_EMPTY;
+   memset(&t->slots[i], 0, sizeof(t->slots[i]));
+   t->used--;
+}
+
+
+/* Frees the table, the lock must be held */
+static void freeTable6(struct table6 *t)
+{
+   hugeFree(t->slots, t->size * sizeof(struct ip6bucket));
+   hugeFree(t->tags, t->size);
+   t->slots = NULL;
+   t->tags = NULL;
+   t->size = 0;
+   t->mask = 0;
+}
+
+
+/*
+ Initializes table t with at least slots 
+ slots, rounded up to a power of two. 
+ Memory is allocated on the NUMA node of 
+ the calling thread. Must not be called
+ while the table is in use.
+ Returns 1 if successful, 0 otherwise.
+*/
+static int initTable6(struct table6 *t, size_t slots)
+{
+   size_t n;
+   int huge0, huge1;
+
+   if(slots < CLOCK_MAX_SCAN)
+      slots = CLOCK_MAX_SCAN;
+   if(slots > 0xFFFFFFFFUL)
+      slots = 0xFFFFFFFFUL;
+   for(n=1;n<slots;n<<=1)
+      ;
+
+   pthread_mutex_lock(&t->lock);
+   freeTable6(t);
+   t->slots = hugeAlloc(n * sizeof(struct ip6bucket), -1, &huge0);
+   t->tags = hugeAlloc(n, -1, &huge1);
+   if(t->slots == NULL || t->tags == NULL)
+   {
+      t->size = n;
+      freeTable6(t);
+      pthread_mutex_unlock(&t->lock);
+      fprintf(stderr, "Unable to allocate hash table of %zu 128 bit keys\n", n);
+      return 0;
+   }
+
+   randomSeeds(t->seeds, 2);
+   t->size = n;
+   t->mask = n - 1;
+   t->capacity = HT_CAPACITY(n);
+   t->used = 0;
+   t->clockhand = 0;
+   t->huge = huge0 < huge1 ? huge0 : huge1;
+   memset(&t->stats, 0, sizeof(t->stats));
+   pthread_mutex_unlock(&t->lock);
+
+   return 1;
+}
+
+
+/*
+ Inserts bucket b with tag tag. A bucket
+ further from its home slot than the one
+ being placed takes its slot, robin hood 
+ style, which keeps the longest probe 
+ sequences short at a high load. 
+ The lock must be held. 
+ Returns the probe length of the new bucket.
+*/
+static size_t insertSlot(struct table6 *t, unsigned char tag, struct ip6bucket *b)
+{
+   struct ip6bucket tmpb;
+   unsigned char tmpt;
+   size_t i, d=0, probes=0;
+
+   i = b->hash & t->mask;
+   while(t->tags[i] != TAG_EMPTY)
+   {
+      if(probeDistance(t, i) < d)
+      {
+         if(probes == 0)
+            probes = d + 1;
+         tmpb = t->slots[i];
+         tmpt = t->tags[i];
+         t->slots[i] = *b;
+         t->tags[i] = tag;
+         *b = tmpb;
+         tag = tmpt;
+         d = (i - (b->hash & t->mask)) & t->mask;
+      }
+      i = (i + 1) & t->mask;
+      d++;
+   }
+
+   t->slots[i] = *b;
+   t->tags[i] = tag;
+   t->used++;
+
+   return probes == 0 ? d + 1 : probes;
+}
+
+
+/*
+ Evicts a bucket with a CLOCK hand, like
+ evictHashItem() of the ipv4 table.
+ The lock must be held.
+ Returns 1 if a bucket is evicted, 0 otherwise.
+*/
+static size_t evictHashItem6(struct table6 *t)
+{
+   size_t n, i, victim=t->size, first=t->size;
+   unsigned long long now;
+
+   now = rate_now();
+   for(n=0;n<CLOCK_MAX_SCAN;n++)
+   {
+      if(n >= CLOCK_SCAN && victim != t->size)
+         break;
+
+      i = t->clockhand;
+      t->clockhand = (t->clockhand + 1) & t->mask;
+
+      if(t->tags[i] == TAG_EMPTY)
+         continue;
+
+      if(first == t->size)
+         first = i;
+
+      if(rate_full(&t->slots[i].state, &rate_classes[t->slots[i].cls], now))
+      {
+         deleteSlot6(t, i);
+         t->stats.evicted_full++;
+         return 1;
+      }
+
+      if(t->slots[i].ref)
+         t->slots[i].ref = 0; //second chance
+      else if(victim == t->size)
+         victim = i;
+   }
+
+   if(victim == t->size)
+      victim = first;
+
+   if(victim == t->size)
+   {
+      t->stats.evict_failed++;
+      return 0;
+   }
+
+   deleteSlot6(t, victim);
+   t->stats.evicted_lru++;
+   return 1;
+}
+
+
+/*
+ Adds a bucket for key k to table t with the 
+ rate state state and rate class cls, evicting
+ a bucket if the table is at capacity. An 
+ existing bucket for k is kept, it was added 
+ by a thread that raced the caller and the 
+ caller consumes from it instead. 
+ Returns 1 if added, 0 if k is present or on
+ failure.
+*/
+static size_t putTable6(struct table6 *t, const struct ip6key *k, rate_state_t state, int cls)
+{
+   struct ip6bucket b;
+   unsigned long long h;
+   size_t i, probes;
+
+   pthread_mutex_lock(&t->lock);
+   if(t->slots == NULL)
+   {
+      pthread_mutex_unlock(&t->lock);
+      return 0;
+   }
+
+   h = sipHash6(t, k);
+   i = findSlot(t, k, h);
+   if(i == t->size)
+   {
+      if(t->used >= t->capacity && !evictHashItem6(t))
+      {
+         pthread_mutex_unlock(&t->lock);
+         return 0;
+      }
+
+      memset(&b, 0, sizeof(b));
+      b.key = *k;
+      b.state = state;
+      b.hash = (unsigned int) h;
+      b.cls = (unsigned char) cls;
+      b.ref = 1;
+      probes = insertSlot(t, hashTag(h), &b);
+      if(probes > t->stats.max_probe)
+         t->stats.max_probe = probes;
+      pthread_mutex_unlock(&t->lock);
+      return 1;
+   }
+
+   t->slots[i].ref = 1;
+   pthread_mutex_unlock(&t->lock);
+
+   return 0;
+}
+
+
+/*
+ Consumes cost tokens from the bucket of key k
+ in table t at time now and sets seen to the 
+ state of the bucket.
+ Returns 1 if within rate limit, 0 if the
+ rate limit is exceeded and -1 if there
+ is no bucket for k.
+*/
+static int consumeTable6(struct table6 *t, const struct ip6key *k, int cost, 
+                         unsigned long long now, rate_state_t *seen)
+{
+   size_t i;
+   int ret=-1;
+
+   pthread_mutex_lock(&t->lock);
+   if(t->slots != NULL)
+   {
+      i = findSlot(t, k, sipHash6(t, k));
+      if(i != t->size)
+      {
+         t->slots[i].ref = 1;
+         ret = rate_consume(&t->slots[i].state, cost, &rate_classes[t->slots[i].cls], now);
+         *seen = t->slots[i].state;
+      }
+   }
+   pthread_mutex_unlock(&t->lock);
+
+   return ret;
+}
+
+
+/*
+ Refills every bucket of table t at time now
+ and removes the full ones. The slots are 
+ visited from an empty one so that the buckets
+ moved back by a removal have not been visited
+ yet.
+ Returns the number of buckets removed.
+*/
+static size_t refillTable6(struct table6 *t, unsigned long long now)
+{
+   size_t i, n, start, removed=0;
+
+   pthread_mutex_lock(&t->lock);
+   if(t->slots == NULL || t->used == 0)
+   {
+      pthread_mutex_unlock(&t->lock);
+      return 0;
+   }
+
+   for(start=0;t->tags[start]!=TAG_EMPTY;start++)
+      ;
+
+   i = start;
+   for(n=0;n<t->size;)
+   {
+      if(t->tags[i] != TAG_EMPTY && 
+         rate_refill(&t->slots[i].state, &rate_classes[t->slots[i].cls], now))
+      {
+         deleteSlot6(t, i); //slot i now holds the next bucket of the run
+         removed++;
+         continue;
+      }
+      i = (i + 1) & t->mask;
+      n++;
+   }
+   pthread_mutex_unlock(&t->lock);
+
+   return removed;
+}
+
+
+/* Copies the statistics of table t into s */
+static void getTableStats6(struct table6 *t, struct ht_stats *s)
+{
+   if(s == NULL)
+      return;
+
+   pthread_mutex_lock(&t->lock);
+   *s = t->stats;
+   s->size = t->used;
+   s->slots = t->size;
+   s->capacity = t->capacity;
+   s->huge = t->huge;
+   pthread_mutex_unlock(&t->lock);
+}
+
+
+/* Initializes the IPv6 hash table, see initTable6() */
+int initHashTable6(size_t slots)
+{
+   return initTable6(&ip6table, slots);
+}
+
+
+/* Adds the bucket of ipv6 key k unless it is present, see putTable6() */
+size_t put6(const struct ip6key *k, rate_state_t state, int cls)
+{
+   return putTable6(&ip6table, k, state, cls);
+}
+
+
+/* Consumes from the bucket of ipv6 key k, see consumeTable6() */
+int consumeBucket6(const struct ip6key *k, int cost, unsigned long long now, 
+                   rate_state_t *seen)
+{
+   return consumeTable6(&ip6table, k, cost, now, seen);
+}
+
+
+/* Refills the IPv6 hash table, see refillTable6() */
+size_t refillHashTable6(unsigned long long now)
+{
+   return refillTable6(&ip6table, now);
+}
+
+
+/* Copies the IPv6 hash table statistics into s */
+void getHashStats6(struct ht_stats *s)
+{
+   getTableStats6(&ip6table, s);
+}
+
+
+/* Initializes the hash table of the scoped keys */
+int initScopeTable(size_t slots)
+{
+   return initTable6(&scopetable, slots);
+}
+
+
+/* Adds the bucket of scoped key k unless it is present */
+size_t putScoped(const struct ip6key *k, rate_state_t state, int cls)
+{
+   return putTable6(&scopetable, k, state, cls);
+}
+
+
+/* Consumes from the bucket of scoped key k */
+int consumeScoped(const struct ip6key *k, int cost, unsigned long long now, 
+                  rate_state_t *seen)
+{
+   return consumeTable6(&scopetable, k, cost, now, seen);
+}
+
+
+/* Refills the hash table of the scoped keys */
+size_t refillScopeTable(unsigned long long now)
+{
+   return refillTable6(&scopetable, now);
+}
+
+
+/* Copies the statistics of the table of the scoped keys into s */
+void getScopeStats(struct ht_stats *s)
+{
+   getTableStats6(&scopetable, s);
+}
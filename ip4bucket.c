@@ -41,8 +41,9 @@
  parameter and another ip4bucket pointer 
  as destination.
  Copies the source data to destination data
- Note that that hash key ipv4 of the
- ip4bucket struct is not copied. This key is
+ Note that that hash key ipv4, the
+ reference bit and the retired flag of the 
+ ip4bucket struct are not copied. These are 
  set by the hash table function.  
 */
 
@@ -53,7 +54,8 @@ void copy_ip4_bucket_data(struct ip4bucket *s, struct ip4bucket *d)
    if(s== NULL || d == NULL)
      return;
 
-   d->count = s->count;
+   d->state = s->state;
+   d->cls = s->cls;
    for(i=0;i<IP4_CHAR_LEN;i++)
      d->addr[i] = s->addr[i];
 }
@@ -69,7 +71,10 @@ void empty_ip4_bucket(struct ip4bucket *s)
       return;
  
    s->ipv4=0;
-   s->count=0;
+   s->state=0;
+   s->cls=0;
+   s->ref=0;
+   s->retired=0;
    for(i=0;i<IP4_CHAR_LEN;i++)
      s->addr[i] = '\0';
 
@@ -171,3 +176,27 @@ unsigned int parseIP4(const char * p)
 
 }
 
+
+
+/*
+ Writes the dotted string of ip into buf, 
+ which has room for IP4_CHAR_LEN chars. 
+ A faster inet_ntop() for the bulk load 
+ and dump of the hash table. 
+*/
+void formatIP4(unsigned int ip, char *buf)
+{
+   unsigned int o;
+   int i;
+
+   for(i=3;i>=0;i--)
+   {
+      o = (ip >> (8 * i)) & 0xFF;
+      if(o >= 100)
+         *buf++ = (char)('0' + o / 100);
+      if(o >= 10)
+         *buf++ = (char)('0' + o / 10 % 10);
+      *buf++ = (char)('0' + o % 10);
+      *buf++ = i > 0 ? '.' : '\0';
+   }
+}
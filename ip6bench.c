@@ -0,0 +1,154 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the ipv6 hash table
+
+ Fills the table to capacity with random /64
+ keys, then measures lookups of keys that are
+ present and of keys that are not. Every key is
+ checked and the benchmark exits with failure
+ if one is lost. A refill of the whole table
+ removes every bucket, which checks the removal
+ of the buckets in each run.
+
+ Usage: ip6bench [slots] [lookups]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_SLOTS (4UL * 1024 * 1024)
+#define DEFAULT_LOOKUPS 10000000UL
+
+
+/* splitmix64 pseudo random generator */
+static unsigned long long nextRandom(unsigned long long *s)
+{
+   unsigned long long z = (*s += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+
+/* Key i of the present (set 0) or absent (set 1) keys */
+static void benchKey(size_t i, int set, struct ip6key *k)
+{
+   unsigned long long s = i * 2 + (unsigned long long)set;
+   k->hi = nextRandom(&s);
+   k->lo = 0;
+}
+
+
+/* Returns ns per lookup of random keys of set */
+static double runLookups(size_t n, size_t lookups, int set, size_t *found)
+{
+   struct ip6key k;
+   unsigned long long seed = 2017, start, now;
+   size_t i;
+   rate_state_t seen;
+
+   *found = 0;
+   now = rate_now();
+   start = monotonicNow();
+   for(i=0;i<lookups;i++)
+   {
+      benchKey(nextRandom(&seed) % n, set, &k);
+      *found += consumeBucket6(&k, 1, now, &seen) >= 0;
+   }
+
+   return (double)(monotonicNow() - start) / lookups;
+}
+
+
+int main(int argc, char* argv[])
+{
+   static const char *pages[] = { "normal", "transparent huge", "huge" };
+   size_t slots = DEFAULT_SLOTS, lookups = DEFAULT_LOOKUPS, i, found;
+   struct ht_stats st;
+   struct ip6key k;
+   rate_state_t state;
+   double t;
+
+   if(argc > 1)
+      slots = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      lookups = strtoul(argv[2], NULL, 10);
+
+   if(slots == 0 || lookups == 0)
+   {
+       fprintf(stderr,"Usage: %s [slots] [lookups]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   if(!initHashTable6(slots))
+      exit(EXIT_FAILURE);
+
+   getHashStats6(&st);
+   rate_init_used(&state, 0, &rate_classes[0], rate_now());
+   for(i=0;i<st.capacity;i++)
+   {
+      benchKey(i, 0, &k);
+      put6(&k, state, 0);
+   }
+   getHashStats6(&st);
+
+   printf("Slots: %zu buckets: %zu table: %zu MiB in %s pages, max probe %zu\n",
+          st.slots, st.size, st.slots * sizeof(struct ip6bucket) >> 20,
+          pages[st.huge], st.max_probe);
+
+   t = runLookups(st.capacity, lookups, 0, &found);
+   printf("present keys: %8.2f ns/lookup\n", t);
+   if(found != lookups)
+   {
+      fprintf(stderr, "Lost %zu lookups of present keys\n", lookups - found);
+      exit(EXIT_FAILURE);
+   }
+
+   t = runLookups(st.capacity, lookups, 1, &found);
+   printf("absent keys:  %8.2f ns/lookup\n", t);
+   if(found != 0)
+   {
+      fprintf(stderr, "Found %zu absent keys\n", found);
+      exit(EXIT_FAILURE);
+   }
+
+   /* the lookups above used at most lookups tokens per key */
+   for(i=0;i<MAX_TOKENS + 1;i++)
+   {
+      refillClasses();
+      refillHashTable6(rate_now() + GCRA_LIMIT);
+   }
+
+   getHashStats6(&st);
+   printf("buckets left after refill: %zu\n", st.size);
+   if(st.size != 0)
+      exit(EXIT_FAILURE);
+
+   return 0;
+}
@@ -0,0 +1,77 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Parses an ipv6 string into the key of its
+ ip6 bucket
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+/*
+ Parses the ipv6 string p and sets k to its
+ first prefix bits, the other bits are zero.
+ So every address of a /64 has the same key
+ with a prefix of 64.
+ Returns 1 if successful, 0 if the string is
+ not a valid ipv6 address.
+*/
+int parseIP6(const char *p, int prefix, struct ip6key *k)
+{
+   struct in6_addr addr;
+   unsigned long long hi=0, lo=0;
+   size_t i;
+
+   if(inet_pton(AF_INET6, p, &addr) != 1)
+   {
+      fprintf(stderr, "Invalid ipv6 address\n");
+      return 0;
+   }
+
+   for(i=0;i<8;i++)
+   {
+      hi = (hi << 8) | addr.s6_addr[i];
+      lo = (lo << 8) | addr.s6_addr[i + 8];
+   }
+
+   if(prefix <= 0)
+      hi = lo = 0;
+   else if(prefix < 64)
+   {
+      hi &= ~(0xFFFFFFFFFFFFFFFFULL >> prefix);
+      lo = 0;
+   }
+   else if(prefix == 64)
+      lo = 0;
+   else if(prefix < 128)
+      lo &= ~(0xFFFFFFFFFFFFFFFFULL >> (prefix - 64));
+
+   k->hi = hi;
+   k->lo = lo;
+   return 1;
+}
@@ -0,0 +1,179 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Latency histogram of the server
+
+ Sends requests one at a time to the udp port 
+ on the loopback interface and prints the 
+ histogram of their round trips in power of two 
+ microseconds, with the percentiles up to the 
+ 99.9th. Run it against a server in the default 
+ mode and one started with -b to compare the 
+ tails, e.g. 
+
+   tbserver -b 2,3
+   latbench 200000
+
+ Usage: latbench [requests] [ip]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_REQUESTS 100000UL
+#define WARMUP 1000
+#define HIST_BINS 24
+#define BAR_WIDTH 50
+
+
+/* Orders round trip times */
+static int compareTimes(const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a;
+   unsigned long long y = *(const unsigned long long *) b;
+
+   return (x > y) - (x < y);
+}
+
+
+/* 
+ Sends a request for ip on the connected socket
+ sock and waits for its answer. 
+ Returns the round trip in ns, 0 on failure
+*/
+static unsigned long long roundTrip(int sock, const char *ip)
+{
+   char buf[BUFSZ];
+   unsigned long long start;
+
+   start = monotonicNow();
+   if(send(sock, ip, strlen(ip) + 1, 0) == -1 ||
+      recv(sock, buf, sizeof(buf), 0) <= 0)
+      return 0;
+
+   return monotonicNow() - start + 1;
+}
+
+
+/* Prints the histogram of the n sorted times */
+static void printHistogram(const unsigned long long *times, size_t n)
+{
+   size_t bins[HIST_BINS], max=0, i;
+   unsigned long long us;
+   int b, first=HIST_BINS, last=0;
+
+   memset(bins, 0, sizeof(bins));
+   for(i=0;i<n;i++)
+   {
+      us = times[i] / 1000;
+      for(b=0;us>0 && b<HIST_BINS - 1;b++)
+         us >>= 1;
+      bins[b]++;
+      if(bins[b] > max)
+         max = bins[b];
+      if(b < first)
+         first = b;
+      if(b > last)
+         last = b;
+   }
+
+   for(b=first;b<=last;b++)
+   {
+      printf("%8llu us %9zu %6.2f%% ", b == 0 ? 0ULL : 1ULL << (b - 1), 
+             bins[b], 100.0 * bins[b] / n);
+      for(i=0;i<(bins[b] * BAR_WIDTH + max - 1) / max;i++)
+         putchar('#');
+      putchar('\n');
+   }
+}
+
+
+int main(int argc, char* argv[])
+{
+   static const double percentiles[] = { 50, 90, 99, 99.9 };
+   const char *ip = "198.18.0.1";
+   size_t requests = DEFAULT_REQUESTS, i;
+   unsigned long long *times;
+   struct sockaddr_in in;
+   struct timeval tv = { 1, 0 };
+   int sock;
+
+   if(argc > 1)
+      requests = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      ip = argv[2];
+
+   if(requests == 0 || strlen(ip) >= IP4_CHAR_LEN)
+   {
+       fprintf(stderr,"Usage: %s [requests] [ip]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   times = calloc(requests, sizeof(*times));
+   sock = socket(AF_INET, SOCK_DGRAM, 0);
+   if(times == NULL || sock == -1)
+   {
+       fprintf(stderr,"Unable to create socket\n");
+       exit(EXIT_FAILURE);
+   }
+
+   memset(&in, 0, sizeof(in));
+   in.sin_family = AF_INET;
+   in.sin_port = htons(3211);
+   in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if(connect(sock, (struct sockaddr *) &in, sizeof(in)) == -1 ||
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+   {
+       perror("Socket error");
+       exit(EXIT_FAILURE);
+   }
+
+   //the first requests warm up the caches and the bucket
+   for(i=0;i<WARMUP + requests;i++)
+   {
+      times[i < WARMUP ? 0 : i - WARMUP] = roundTrip(sock, ip);
+      if(times[i < WARMUP ? 0 : i - WARMUP] == 0)
+      {
+         fprintf(stderr, "No answer from the server\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   qsort(times, requests, sizeof(*times), compareTimes);
+   printHistogram(times, requests);
+
+   for(i=0;i<sizeof(percentiles) / sizeof(percentiles[0]);i++)
+      printf("p%-5g %8.2f us\n", percentiles[i],
+             (double) times[(size_t)(percentiles[i] / 100 * (requests - 1))] / 1000);
+   printf("max    %8.2f us\n", (double) times[requests - 1] / 1000);
+
+   close(sock);
+   free(times);
+   return 0;
+}
@@ -0,0 +1,225 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the allow and deny lists
+
+ Writes nested allow and deny prefixes to a list
+ file, loads it and looks up random addresses
+ with list_lookup() and with a linear scan of
+ the prefixes. Every lookup is checked against
+ the scan and the benchmark exits with failure
+ on a mismatch. Lookups are measured for random
+ addresses, most of them in a /16 without a 
+ listed range, and for addresses inside listed
+ prefixes. The time of a reload is reported 
+ as well.
+
+ Usage: listbench [lookups]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_LOOKUPS 10000000UL
+#define RULES8 4
+#define RULES16 1024
+#define RULES24 8192
+#define RULES32 4096
+#define NRULES (RULES8 + RULES16 + RULES24 + RULES32)
+
+struct bench_rule
+{
+ unsigned int addr;
+ int len;
+ int verdict;
+};
+
+static struct bench_rule brules[NRULES];
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Adds a rule of len inside base, the verdict alternating with the length */
+static void addRule(size_t *n, unsigned int base, unsigned int bits, int len)
+{
+   unsigned int mask = 0xFFFFFFFFU << (32 - len);
+
+   brules[*n].addr = (base | bits) & mask;
+   brules[*n].len = len;
+   brules[*n].verdict = (len / 8) & 1 ? LIST_DENY : LIST_ALLOW;
+   (*n)++;
+}
+
+
+/* Writes the nested rules to fp */
+static void writeRules(FILE *fp)
+{
+   size_t i, n=0;
+   unsigned int a, seed=7;
+
+   for(i=0;i<RULES8;i++)
+      addRule(&n, (unsigned int)(i * 37 + 10) << 24, 0, 8);
+   for(i=0;i<RULES16;i++) //the first quarter inside the /8s
+      addRule(&n, i < RULES16 / 4 ? brules[i % RULES8].addr : 0,
+              nextRandom(&seed) & 0xFFFF0000U, 16);
+   for(i=0;i<RULES24;i++)
+      addRule(&n, brules[RULES8 + i % RULES16].addr, nextRandom(&seed) & 0xFF00, 24);
+   for(i=0;i<RULES32;i++)
+      addRule(&n, brules[RULES8 + RULES16 + i % RULES24].addr, nextRandom(&seed) & 0xFF, 32);
+
+   for(i=0;i<n;i++)
+   {
+      a = brules[i].addr;
+      fprintf(fp, "%s %u.%u.%u.%u/%d\n", brules[i].verdict == LIST_DENY ? "deny" : "allow",
+              a >> 24, (a >> 16) & 0xFF, (a >> 8) & 0xFF, a & 0xFF, brules[i].len);
+   }
+}
+
+
+/* Returns the verdict of k by a linear scan of the rules */
+static int scanRules(unsigned int k)
+{
+   size_t i;
+   int verdict=LIST_NONE, bestlen=-1;
+   unsigned int mask;
+
+   for(i=0;i<NRULES;i++)
+   {
+      mask = 0xFFFFFFFFU << (32 - brules[i].len);
+      if((k & mask) != brules[i].addr)
+         continue;
+      if(brules[i].len > bestlen ||
+         (brules[i].len == bestlen && brules[i].verdict == LIST_DENY))
+      {
+         verdict = brules[i].verdict;
+         bestlen = brules[i].len;
+      }
+   }
+
+   return verdict;
+}
+
+
+int main(int argc, char* argv[])
+{
+   char path[] = "/tmp/listbenchXXXXXX";
+   size_t lookups = DEFAULT_LOOKUPS, i, listed=0;
+   unsigned int seed = 2017, k;
+   unsigned long long start;
+   volatile int sink = 0;
+   long n;
+   double t;
+   FILE *fp;
+   int fd, v;
+
+   if(argc > 1)
+      lookups = strtoul(argv[1], NULL, 10);
+
+   if(lookups == 0)
+   {
+       fprintf(stderr,"Usage: %s [lookups]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   fd = mkstemp(path);
+   if(fd == -1 || (fp = fdopen(fd, "w")) == NULL)
+   {
+       fprintf(stderr,"Unable to create list file\n");
+       exit(EXIT_FAILURE);
+   }
+   writeRules(fp);
+   fclose(fp);
+
+   start = monotonicNow();
+   n = loadLists(path);
+   t = (double)(monotonicNow() - start) / 1000000;
+   if(n < 0 || (n = loadLists(path)) < 0) //the second load swaps out the first
+   {
+      unlink(path);
+      exit(EXIT_FAILURE);
+   }
+   unlink(path);
+
+   printf("Rules: %d /8, %d /16, %d /24, %d /32 in %ld ranges, loaded in %.2f ms\n",
+          RULES8, RULES16, RULES24, RULES32, n, t);
+
+   /* check against the scan, half the addresses inside a rule */
+   ebr_enter();
+   for(i=0;i<100000;i++)
+   {
+      k = nextRandom(&seed);
+      if(i & 1)
+         k = brules[k % NRULES].addr | (k >> 24);
+      v = list_lookup(k);
+      if(v != scanRules(k))
+      {
+         fprintf(stderr, "Lookup mismatch for %08x\n", k);
+         exit(EXIT_FAILURE);
+      }
+      listed += v != LIST_NONE;
+   }
+   ebr_exit();
+   printf("checked 100000 lookups against a linear scan, %zu listed\n", listed);
+
+   start = monotonicNow();
+   ebr_enter();
+   for(i=0;i<lookups;i++)
+      sink += list_lookup(nextRandom(&seed));
+   ebr_exit();
+   t = (double)(monotonicNow() - start) / lookups;
+   printf("lookup random:           %8.2f ns\n", t);
+
+   start = monotonicNow();
+   ebr_enter();
+   for(i=0;i<lookups;i++)
+   {
+      k = nextRandom(&seed);
+      sink += list_lookup(brules[RULES8 + RULES16 + k % (RULES24 + RULES32)].addr | (k >> 24));
+   }
+   ebr_exit();
+   t = (double)(monotonicNow() - start) / lookups;
+   printf("lookup listed:           %8.2f ns\n", t);
+
+   start = monotonicNow();
+   for(i=0;i<lookups / 1000;i++)
+      sink += scanRules(nextRandom(&seed));
+   t = (double)(monotonicNow() - start) / (lookups / 1000);
+   printf("linear scan:             %8.2f ns\n", t);
+
+   return 0;
+}
@@ -0,0 +1,341 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Allow and deny lists, checked before the 
+ buckets. An address on the allow list always
+ gets OK and one on the deny list always gets
+ NOK, neither takes a token or a bucket. 
+
+ The list file has one prefix per line:
+
+   allow 192.0.2.10         # monitoring probe
+   allow 198.51.100.0/24    # partner
+   deny  203.0.113.0/24
+   deny  10.0.0.0/8
+   allow 10.1.0.0/16
+
+ The longest matching prefix decides, so a 
+ range can be cut out of a larger one. If the
+ same prefix is on both lists deny wins. 
+
+ The prefixes are compiled into a sorted array
+ of disjoint address ranges, each with its 
+ verdict, and an index by the first 16 bits of
+ an address of the first range that starts in 
+ each /16. A lookup reads the index entries of
+ its /16 and searches the few ranges between 
+ them. An address in a /16 without a listed 
+ range is decided by the index alone. 
+
+ The lists can be reloaded while lookups run. 
+ The new lists are built on the side and 
+ swapped in, the old ones are freed after an
+ epoch based grace period, so lookups must be
+ done inside ebr_enter() and ebr_exit(). 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define LIST_INDEX_SIZE 65536
+
+struct list_range
+{
+ unsigned int start;
+ unsigned int end;
+ int verdict;
+};
+
+struct ip_lists
+{
+ struct list_range *ranges;
+ size_t nranges;
+ unsigned int index[LIST_INDEX_SIZE + 1];
+};
+
+struct list_rule
+{
+ unsigned int start;
+ unsigned int end;
+ int len;
+ int verdict;
+};
+
+static struct ip_lists *lists;
+
+/* serializes loadLists() */
+static pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ Returns the verdict of the lists for key k,
+ LIST_NONE if k is on neither list. 
+ Must be called inside a read section. 
+*/
+int list_lookup(unsigned int k)
+{
+   struct ip_lists *l = __atomic_load_n(&lists, __ATOMIC_ACQUIRE);
+   size_t lo, hi, mid;
+
+   if(l == NULL)
+      return LIST_NONE;
+
+   //the range before the first one of this /16 may reach into it
+   hi = l->index[(k >> 16) + 1];
+   lo = l->index[k >> 16];
+   if(lo > 0)
+      lo--;
+
+   while(lo < hi)
+   {//last range that starts at or before k
+      mid = lo + (hi - lo) / 2;
+      if(l->ranges[mid].start <= k)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if(lo == 0 || l->ranges[lo - 1].end < k)
+      return LIST_NONE;
+   return l->ranges[lo - 1].verdict;
+}
+
+
+/* Orders rules by start, the longer prefix of the same start last */
+static int compareRules(const void *a, const void *b)
+{
+   const struct list_rule *x = a, *y = b;
+
+   if(x->start != y->start)
+      return (x->start > y->start) - (x->start < y->start);
+   if(x->len != y->len)
+      return x->len - y->len;
+   return y->verdict - x->verdict;
+}
+
+
+/* Appends range start..end, merging it with the last range of the same verdict */
+static void addRange(struct ip_lists *l, unsigned long long start, 
+                     unsigned long long end, int verdict)
+{
+   struct list_range *r;
+
+   if(start > end)
+      return;
+
+   if(l->nranges > 0)
+   {
+      r = &l->ranges[l->nranges - 1];
+      if(r->verdict == verdict && (unsigned long long)r->end + 1 == start)
+      {
+         r->end = (unsigned int) end;
+         return;
+      }
+   }
+
+   r = &l->ranges[l->nranges++];
+   r->start = (unsigned int) start;
+   r->end = (unsigned int) end;
+   r->verdict = verdict;
+}
+
+
+/*
+ Flattens the nested rules sorted by 
+ compareRules() into disjoint ranges, each 
+ address taking the verdict of its longest 
+ prefix, and builds the /16 index. 
+ Returns 1 if successful, 0 otherwise
+*/
+static int buildRanges(struct ip_lists *l, struct list_rule *rules, size_t n)
+{
+   struct list_rule *stack[33];
+   unsigned long long cursor=0;
+   size_t i, depth=0, r;
+
+   //a prefix adds at most two ranges, one before and one after a nested prefix
+   l->ranges = malloc((2 * n + 1) * sizeof(struct list_range));
+   if(l->ranges == NULL)
+   {
+      fprintf(stderr, "Unable to allocate list ranges\n");
+      return 0;
+   }
+
+   for(i=0;i<=n;i++)
+   {
+      //close the prefixes that end before rule i
+      while(depth > 0 && (i == n || stack[depth - 1]->end < rules[i].start))
+      {
+         addRange(l, cursor, stack[depth - 1]->end, stack[depth - 1]->verdict);
+         cursor = (unsigned long long) stack[depth - 1]->end + 1;
+         depth--;
+      }
+      if(i == n)
+         break;
+
+      if(depth > 0 && stack[depth - 1]->start == rules[i].start && 
+         stack[depth - 1]->len == rules[i].len)
+         continue; //same prefix on both lists, deny sorts first
+
+      if(depth > 0)
+         addRange(l, cursor, (unsigned long long) rules[i].start - 1, 
+                  stack[depth - 1]->verdict);
+      cursor = rules[i].start;
+      stack[depth++] = &rules[i];
+   }
+
+   for(i=0,r=0;i<=LIST_INDEX_SIZE;i++)
+   {
+      while(r < l->nranges && l->ranges[r].start < ((unsigned long long) i << 16))
+         r++;
+      l->index[i] = (unsigned int) r;
+   }
+
+   return 1;
+}
+
+
+/* Frees lists built by loadLists() */
+static void freeLists(struct ip_lists *l)
+{
+   if(l == NULL)
+      return;
+   free(l->ranges);
+   free(l);
+}
+
+
+/*
+ Reads the allow and deny lists from fp into
+ rules. 
+ Returns the number of rules, -1 on failure
+*/
+static long readRules(FILE *fp, struct list_rule **rules)
+{
+   char line[BUFSZ * 2], ip[IP4_CHAR_LEN], word[8], extra;
+   struct list_rule *p;
+   size_t lineno=0, n=0, max=0;
+   unsigned int addr, mask;
+   int len, k;
+
+   while(fgets(line, sizeof(line), fp) != NULL)
+   {
+      lineno++;
+      line[strcspn(line, "#\r\n")] = '\0';
+      len = 32;
+      k = sscanf(line, " %7s %15[0-9.]/%d %c", word, ip, &len, &extra);
+      if(k <= 0)
+         continue;
+
+      addr = parseIP4(ip);
+      if(k < 2 || k > 3 || (addr == 0 && strcmp(ip, "0.0.0.0") != 0) || 
+         len < 0 || len > 32 || (strcmp(word, "allow") != 0 && strcmp(word, "deny") != 0))
+      {
+         fprintf(stderr, "Invalid list entry on line %zu\n", lineno);
+         return -1;
+      }
+
+      if(n == max)
+      {
+         max = max == 0 ? 1024 : max * 2;
+         p = realloc(*rules, max * sizeof(**rules));
+         if(p == NULL)
+         {
+            fprintf(stderr, "Unable to allocate list rules\n");
+            return -1;
+         }
+         *rules = p;
+      }
+
+      mask = len == 0 ? 0 : 0xFFFFFFFFU << (32 - len);
+      p = &(*rules)[n++];
+      p->start = addr & mask;
+      p->end = p->start | ~mask;
+      p->len = len;
+      p->verdict = word[0] == 'a' ? LIST_ALLOW : LIST_DENY;
+   }
+
+   return (long) n;
+}
+
+
+/*
+ Loads the allow and deny lists from the file
+ path and swaps them in for the current lists,
+ which are freed once no lookup can use them.
+ Must not be called inside a read section. 
+ Returns the number of ranges, -1 on failure, 
+ in which case the current lists are kept
+*/
+long loadLists(const char *path)
+{
+   struct list_rule *rules=NULL;
+   struct ip_lists *l, *old;
+   FILE *fp;
+   long n;
+
+   fp = fopen(path, "r");
+   if(fp == NULL)
+   {
+      fprintf(stderr, "Unable to open ip lists %s\n", path);
+      return -1;
+   }
+
+   n = readRules(fp, &rules);
+   fclose(fp);
+   if(n < 0)
+   {
+      free(rules);
+      return -1;
+   }
+
+   l = calloc(1, sizeof(*l));
+   if(l == NULL)
+   {
+      fprintf(stderr, "Unable to allocate ip lists\n");
+      free(rules);
+      return -1;
+   }
+
+   qsort(rules, (size_t) n, sizeof(*rules), compareRules);
+   if(!buildRanges(l, rules, (size_t) n))
+   {
+      freeLists(l);
+      free(rules);
+      return -1;
+   }
+   free(rules);
+
+   pthread_mutex_lock(&listlock);
+   old = __atomic_exchange_n(&lists, l, __ATOMIC_ACQ_REL);
+   ebr_synchronize();
+   freeLists(old);
+   pthread_mutex_unlock(&listlock);
+
+   return (long) l->nranges;
+}
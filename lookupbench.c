@@ -0,0 +1,219 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the hash table lookup path with
+ several reader threads.
+
+ Each reader consumes tokens from random buckets
+ of a table filled to capacity, using the lock
+ free consumeBucket(). The same run is repeated
+ with every lookup serialized by one mutex, the
+ way the hash lock used to be taken. A writer
+ thread keeps removing and adding buckets during
+ both runs.
+
+ Usage: lookupbench [max threads] [operations per thread]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_OPS 2000000
+
+struct benchparam
+{
+ size_t ops;
+ int locked;
+ unsigned int seed;
+ unsigned long long allowed;
+};
+
+static pthread_mutex_t biglock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int stopwriter;
+static size_t capacity;
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Distinct non zero keys, bijection modulo 2^32 */
+static unsigned int benchKey(size_t i)
+{
+   return (unsigned int)((i + 1) * 2654435761U);
+}
+
+
+static void *reader(void *arg)
+{
+   struct benchparam *p = (struct benchparam *) arg;
+   size_t i;
+   unsigned int k;
+   int r;
+   rate_state_t seen;
+
+   for(i=0;i<p->ops;i++)
+   {
+      k = benchKey(nextRandom(&p->seed) % capacity);
+      if(p->locked)
+      {
+         pthread_mutex_lock(&biglock);
+         r = consumeBucket(k, 1, rate_now(), &seen);
+         pthread_mutex_unlock(&biglock);
+      }
+      else
+         r = consumeBucket(k, 1, rate_now(), &seen);
+
+      if(r > 0)
+         p->allowed++;
+   }
+
+   return NULL;
+}
+
+
+/* Keeps changing the table while the readers run */
+static void *writer(void *arg)
+{
+   struct ip4bucket b;
+   unsigned int seed = 7;
+   size_t i;
+   int locked = *(int *) arg;
+
+   while(!stopwriter)
+   {
+      i = nextRandom(&seed) % capacity;
+      empty_ip4_bucket(&b);
+      rate_init(&b.state, &rate_classes[0], rate_now());
+
+      if(locked)
+         pthread_mutex_lock(&biglock);
+      removeHashItem(benchKey(i));
+      put(benchKey(i), b);
+      if(locked)
+         pthread_mutex_unlock(&biglock);
+   }
+
+   return NULL;
+}
+
+
+static void fillTable(void)
+{
+   struct ip4bucket b;
+   struct ht_stats st;
+   size_t i;
+
+   if(!initHashTable(HASHSZ))
+      exit(EXIT_FAILURE);
+   getHashStats(&st);
+   capacity = st.capacity;
+
+   for(i=0;i<capacity;i++)
+   {
+      empty_ip4_bucket(&b);
+      rate_init(&b.state, &rate_classes[0], rate_now());
+      put(benchKey(i), b);
+   }
+}
+
+
+static double runReaders(int nthreads, size_t ops, int locked)
+{
+   pthread_t tids[DEFAULT_THREADS * 8], wtid;
+   struct benchparam params[DEFAULT_THREADS * 8];
+   unsigned long long start;
+   double t;
+   int i;
+
+   fillTable();
+   stopwriter = 0;
+   if(pthread_create(&wtid, NULL, writer, &locked) != 0)
+   {
+      fprintf(stderr, "Cannot create writer thread\n");
+      exit(EXIT_FAILURE);
+   }
+
+   start = monotonicNow();
+   for(i=0;i<nthreads;i++)
+   {
+      params[i].ops = ops;
+      params[i].locked = locked;
+      params[i].seed = 2017 + i;
+      params[i].allowed = 0;
+      if(pthread_create(&tids[i], NULL, reader, &params[i]) != 0)
+      {
+         fprintf(stderr, "Cannot create reader thread\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   for(i=0;i<nthreads;i++)
+      pthread_join(tids[i], NULL);
+   t = (double)(monotonicNow() - start);
+
+   stopwriter = 1;
+   pthread_join(wtid, NULL);
+   reclaimHashItems();
+
+   return (double)ops * nthreads / t * 1000.0; //Mops per second
+}
+
+
+int main(int argc, char* argv[])
+{
+   int maxthreads = DEFAULT_THREADS, n;
+   size_t ops = DEFAULT_OPS;
+
+   if(argc > 1)
+      maxthreads = atoi(argv[1]);
+   if(argc > 2)
+      ops = strtoul(argv[2], NULL, 10);
+
+   if(maxthreads <= 0 || maxthreads > DEFAULT_THREADS * 8 || ops == 0)
+   {
+       fprintf(stderr,"Usage: %s [max threads] [operations per thread]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   printf("Online cpus: %ld Buckets: %d\n", sysconf(_SC_NPROCESSORS_ONLN), HT_CAPACITY(HASHSZ));
+   printf("threads  lock free Mops/s  single lock Mops/s\n");
+   for(n=1;n<=maxthreads;n*=2)
+      printf("%7d  %16.2f  %18.2f\n", n, runReaders(n, ops, 0), runReaders(n, ops, 1));
+
+   return 0;
+}
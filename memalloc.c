@@ -0,0 +1,216 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Memory allocation for the hash tables, queues
+ and other large structures.
+
+ Allocations of at least HUGE_MIN bytes are backed
+ by 2 MiB huge pages when possible:
+ 1. explicit huge pages (MAP_HUGETLB), if the
+    administrator has reserved them
+ 2. transparent huge pages, asked for with madvise
+ 3. normal pages otherwise
+ Smaller allocations use normal pages, a huge page
+ would mostly be wasted on them.
+
+ On linux the memory is bound to a preferred NUMA
+ node and zeroed by the calling thread, so that the
+ pages are placed on that node even without the
+ binding. Other systems only get the zeroing.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_2MB)
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+
+static int hugepages_enabled = 1;
+
+
+/* Enables or disables huge pages for later allocations */
+void setHugePages(int enable)
+{
+   hugepages_enabled = enable;
+}
+
+
+/*
+ Returns the NUMA node of the cpu the calling
+ thread runs on, 0 if it cannot be found
+*/
+int currentNode(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+   unsigned int cpu, node;
+   if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+      return (int) node;
+#endif
+   return 0;
+}
+
+
+/* Rounds size up to a multiple of align, a power of 2 */
+static size_t roundUp(size_t size, size_t align)
+{
+   return (size + align - 1) & ~(align - 1);
+}
+
+
+/* Prefers node for the pages in [p, p + size) */
+static void bindNode(void *p, size_t size, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+   unsigned long mask;
+
+   if(node < 0 || node >= (int)(sizeof(mask) * 8))
+      return;
+
+   mask = 1UL << node;
+   syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+#else
+   (void) p;
+   (void) size;
+   (void) node;
+#endif
+}
+
+
+/*
+ Maps size bytes aligned to HUGEPAGE_SIZE and asks
+ for transparent huge pages. Returns NULL on failure.
+*/
+static void *mapAligned(size_t size)
+{
+   char *p, *a;
+   size_t head, tail;
+
+   p = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(p == MAP_FAILED)
+      return NULL;
+
+   a = (char *) roundUp((size_t) p, HUGEPAGE_SIZE);
+   head = (size_t)(a - p);
+   tail = HUGEPAGE_SIZE - head;
+   if(head > 0)
+      munmap(p, head);
+   if(tail > 0)
+      munmap(a + size, tail);
+
+#ifdef MADV_HUGEPAGE
+   madvise(a, size, MADV_HUGEPAGE);
+#endif
+
+   return a;
+}
+
+
+/*
+ Allocates size bytes of zeroed memory placed on
+ the NUMA node node, or the node of the calling
+ thread if node is negative.
+ If huge is not NULL it is set to HUGE_NONE,
+ HUGE_THP or HUGE_TLB for the pages obtained.
+ Returns a pointer to the memory, NULL on failure.
+ The memory must be freed with hugeFree().
+*/
+void *hugeAlloc(size_t size, int node, int *huge)
+{
+   void *p = NULL;
+   int kind = HUGE_NONE;
+
+   if(size == 0)
+      return NULL;
+
+   if(node < 0)
+      node = currentNode();
+
+   if(size >= HUGE_MIN)
+      size = roundUp(size, HUGEPAGE_SIZE);
+   else
+      size = roundUp(size, (size_t) sysconf(_SC_PAGESIZE));
+
+   if(hugepages_enabled && size >= HUGE_MIN)
+   {
+#ifdef MAP_HUGETLB
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+      if(p == MAP_FAILED)
+         p = NULL;
+      else
+         kind = HUGE_TLB;
+#endif
+
+      if(p == NULL && (p = mapAligned(size)) != NULL)
+         kind = HUGE_THP;
+   }
+
+   if(p == NULL)
+   {
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(p == MAP_FAILED)
+         return NULL;
+      kind = HUGE_NONE;
+   }
+
+   bindNode(p, size, node);
+   memset(p, 0, size); //first touch by the owner
+
+   if(huge != NULL)
+      *huge = kind;
+
+   return p;
+}
+
+
+/* Frees memory of size bytes obtained from hugeAlloc() */
+void hugeFree(void *p, size_t size)
+{
+   if(p == NULL || size == 0)
+      return;
+
+   if(size >= HUGE_MIN)
+      size = roundUp(size, HUGEPAGE_SIZE);
+   else
+      size = roundUp(size, (size_t) sysconf(_SC_PAGESIZE));
+
+   munmap(p, size);
+}
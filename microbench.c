@@ -0,0 +1,724 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Microbenchmarks of the hash table, the queue
+ and the ipv4 parser
+
+ table  get() of present keys with uniform and
+        zipf accesses, get() of absent keys, 
+        removeHashItem() and put(), at 25, 50 and 
+        75% of the capacity of the table, for 
+        random and for sequential keys. Then 
+        get() and remove and put pairs on threads
+        of their own, up to the given threads. 
+ queue  enqueue() and dequeueBatch() of single
+        items and of batches on one thread, and 
+        from a producer to a consumer thread, for
+        the locked and the spin queues. 
+ parse  parseIP4() of short, long and random 
+        addresses, with inet_pton() to compare. 
+
+ Every measure is run once to warm up the caches
+ and then REPEATS times. The median, lowest and 
+ highest time per operation are printed, with the
+ median in cycles of the time stamp counter on 
+ x86, which runs at the nominal frequency of the
+ cpu. For several threads, each doing the same 
+ operations, the time is the wall time of a run 
+ over the operations of one thread. 
+
+ Usage: microbench [table|queue|parse|all] [slots] [threads]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <math.h>
+
+
+#define DEFAULT_SLOTS (1024UL * 1024)
+#define DEFAULT_THREADS 4
+#define REPEATS 5
+#define TABLE_OPS (1024UL * 1024)
+#define QUEUE_OPS (1024UL * 1024)
+#define PARSE_OPS (4UL * 1024 * 1024)
+#define PARSE_STRINGS 4096
+#define ZIPF_S 0.99
+
+typedef void (*bench_fn)(void *arg, size_t ops);
+
+/* 
+ A measure runs run(arg, ops) on threads threads,
+ args points to the argument of each, argsize apart. 
+ undo, if set, is run after each run, untimed. 
+*/
+struct measure
+{
+ const char *name;
+ bench_fn run;
+ bench_fn undo;
+ void *args;
+ size_t argsize;
+ size_t ops;
+ int threads;
+};
+
+struct thread_run
+{
+ bench_fn run;
+ void *arg;
+ size_t ops;
+};
+
+/* 
+ Keys and access streams of the table benchmarks. 
+ keys holds the n present keys, extra the keys
+ that are absent. stream gives the index of the
+ key of each access. 
+*/
+struct table_run
+{
+ unsigned int *keys;
+ unsigned int *extra;
+ size_t n;
+ size_t *stream;
+ size_t first;
+};
+
+struct queue_run
+{
+ struct queue *queue;
+ size_t batch;
+};
+
+static volatile size_t sink;
+
+
+/* splitmix64 pseudo random generator */
+static unsigned long long nextRandom(unsigned long long *s)
+{
+   unsigned long long z = (*s += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+
+/* Returns the time stamp counter, 0 if there is none */
+static unsigned long long readCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return __builtin_ia32_rdtsc();
+#else
+   return 0;
+#endif
+}
+
+
+/* Orders doubles */
+static int compareDoubles(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+
+   return (x > y) - (x < y);
+}
+
+
+static void *runThread(void *arg)
+{
+   struct thread_run *t = arg;
+
+   t->run(t->arg, t->ops);
+   return NULL;
+}
+
+
+/* 
+ Runs m on its threads and adds the cycles of the
+ run to cycles. Returns the wall time in ns
+*/
+static unsigned long long runOnce(const struct measure *m, unsigned long long *cycles)
+{
+   pthread_t tids[WORKERS_MAX];
+   struct thread_run t[WORKERS_MAX];
+   unsigned long long start, c;
+   int i;
+
+   start = monotonicNow();
+   c = readCycles();
+   if(m->threads == 1)
+      m->run(m->args, m->ops);
+   else
+   {
+      for(i=0;i<m->threads;i++)
+      {
+         t[i].run = m->run;
+         t[i].arg = (char *) m->args + (size_t) i * m->argsize;
+         t[i].ops = m->ops;
+         if(pthread_create(&tids[i], NULL, runThread, &t[i]) != 0)
+         {
+            fprintf(stderr, "Cannot create benchmark thread\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      for(i=0;i<m->threads;i++)
+         pthread_join(tids[i], NULL);
+   }
+   *cycles += readCycles() - c;
+   start = monotonicNow() - start;
+
+   for(i=0;m->undo!=NULL && i<m->threads;i++)
+      m->undo((char *) m->args + (size_t) i * m->argsize, m->ops);
+
+   return start;
+}
+
+
+/* Warms up, repeats and prints the measure m */
+static void measure(const struct measure *m)
+{
+   double ns[REPEATS], cycles[REPEATS];
+   unsigned long long c;
+   int r;
+
+   c = 0;
+   runOnce(m, &c);
+   for(r=0;r<REPEATS;r++)
+   {
+      c = 0;
+      ns[r] = (double) runOnce(m, &c) / m->ops;
+      cycles[r] = (double) c / m->ops;
+   }
+
+   qsort(ns, REPEATS, sizeof(double), compareDoubles);
+   qsort(cycles, REPEATS, sizeof(double), compareDoubles);
+   printf("  %-28s %9.2f ns/op %9.1f cycles/op  (%.2f - %.2f)\n", m->name,
+          ns[REPEATS / 2], cycles[REPEATS / 2], ns[0], ns[REPEATS - 1]);
+}
+
+
+/* Runs a measure of run on one thread */
+static void measureOne(const char *name, bench_fn run, bench_fn undo, void *arg, size_t ops)
+{
+   struct measure m = { name, run, undo, arg, 0, ops, 1 };
+
+   measure(&m);
+}
+
+
+/* 
+ Fills stream with n indexes below range, drawn 
+ uniformly or from a zipf distribution of ZIPF_S
+ over a random order of the indexes
+*/
+static void fillStream(size_t *stream, size_t n, size_t range, int zipf, 
+                       unsigned long long seed)
+{
+   double *cdf, sum=0;
+   size_t *order, i, j, lo, hi;
+   double u;
+
+   if(!zipf)
+   {
+      for(i=0;i<n;i++)
+         stream[i] = nextRandom(&seed) % range;
+      return;
+   }
+
+   cdf = malloc(range * sizeof(double));
+   order = malloc(range * sizeof(size_t));
+   if(cdf == NULL || order == NULL)
+      exit(EXIT_FAILURE);
+
+   for(i=0;i<range;i++)
+   {
+      sum += 1.0 / pow((double)(i + 1), ZIPF_S);
+      cdf[i] = sum;
+      order[i] = i;
+   }
+   for(i=range - 1;i>0;i--)
+   {//the hot keys are spread over the table
+      j = nextRandom(&seed) % (i + 1);
+      lo = order[i];
+      order[i] = order[j];
+      order[j] = lo;
+   }
+
+   for(i=0;i<n;i++)
+   {
+      u = (double)(nextRandom(&seed) >> 11) / 9007199254740992.0 * sum;
+      for(lo=0,hi=range - 1;lo<hi;)
+      {
+         j = (lo + hi) / 2;
+         if(cdf[j] < u)
+            lo = j + 1;
+         else
+            hi = j;
+      }
+      stream[i] = order[lo];
+   }
+
+   free(cdf);
+   free(order);
+}
+
+
+static void runGet(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+   size_t i, found=0;
+
+   for(i=0;i<ops;i++)
+   {
+      if((i & (BATCH_MAX - 1)) == 0)
+      {//one read section per batch, as processing() does
+         if(i > 0)
+            ebr_exit();
+         ebr_enter();
+      }
+      found += get(t->keys[t->stream[i]]) != NULL;
+   }
+   ebr_exit();
+   sink = found;
+}
+
+
+static void runMiss(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+   size_t i, found=0;
+
+   for(i=0;i<ops;i++)
+   {
+      if((i & (BATCH_MAX - 1)) == 0)
+      {
+         if(i > 0)
+            ebr_exit();
+         ebr_enter();
+      }
+      found += get(t->extra[t->stream[i]]) != NULL;
+   }
+   ebr_exit();
+   sink = found;
+}
+
+
+/* Puts the keys first to first + ops - 1 of keys */
+static void putKeys(const unsigned int *keys, size_t first, size_t ops)
+{
+   struct ip4bucket b;
+   size_t i;
+
+   empty_ip4_bucket(&b);
+   rate_init(&b.state, &rate_classes[0], rate_now());
+   for(i=0;i<ops;i++)
+   {
+      b.ipv4 = keys[first + i];
+      put(b.ipv4, b);
+   }
+}
+
+
+/* Removes the keys first to first + ops - 1 of keys */
+static void removeKeys(const unsigned int *keys, size_t first, size_t ops)
+{
+   size_t i, removed=0;
+
+   for(i=0;i<ops;i++)
+      removed += removeHashItem(keys[first + i]);
+   sink = removed;
+}
+
+
+/* Reclaims and purges the removed slots, as the update thread */
+static void tidyTable(void)
+{
+   reclaimHashItems();
+   purgeHashTable();
+}
+
+
+static void runRemove(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+
+   removeKeys(t->keys, t->first, ops);
+}
+
+
+static void undoRemove(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+
+   tidyTable();
+   putKeys(t->keys, t->first, ops);
+}
+
+
+static void runPut(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+
+   putKeys(t->extra, t->first, ops);
+}
+
+
+static void undoPut(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+
+   removeKeys(t->extra, t->first, ops);
+   tidyTable();
+}
+
+
+/* 
+ Removes and puts back the keys of a thread, one
+ pair per operation, each key once. A key put back
+ while its old slot waits for its grace period 
+ takes a slot further on its probe sequence, so 
+ the same keys cannot be churned over and over. 
+ The deleted slots are purged when needed, as 
+ the update thread would. 
+*/
+static void runChurn(void *arg, size_t ops)
+{
+   struct table_run *t = arg;
+   size_t i, step;
+
+   for(i=0;i<ops;i+=step)
+   {
+      step = ops - i < BATCH_MAX ? ops - i : BATCH_MAX;
+      removeKeys(t->keys, t->first + i, step);
+      putKeys(t->keys, t->first + i, step);
+      purgeHashTable();
+   }
+}
+
+
+static void undoChurn(__attribute__((unused)) void *arg, 
+                      __attribute__((unused)) size_t ops)
+{
+   tidyTable();
+}
+
+
+/* 
+ Returns the key i of a set, sequential keys
+ from 10.0.0.1 or random ones. Set 0 is the 
+ present keys, set 1 the absent ones. 
+*/
+static unsigned int tableKey(size_t i, int set, int sequential)
+{
+   unsigned long long s = i * 2 + (unsigned long long) set;
+   unsigned int k;
+
+   if(sequential)
+      return 0x0A000001U + (unsigned int)(i * 2 + (size_t) set);
+
+   do
+      k = (unsigned int) nextRandom(&s);
+   while(k == HT_EMPTY || k == HT_DELETED);
+   return k;
+}
+
+
+/* Fills a table of slots to percent of its capacity */
+static size_t fillTable(size_t slots, int percent, int sequential, struct table_run *t)
+{
+   struct ht_stats st;
+   size_t i;
+
+   if(!initHashTable(slots))
+      exit(EXIT_FAILURE);
+   getHashStats(&st);
+
+   t->n = st.capacity * (size_t) percent / 100;
+   for(i=0;i<st.capacity;i++)
+   {
+      t->keys[i] = tableKey(i, 0, sequential);
+      t->extra[i] = tableKey(i, 1, sequential);
+   }
+   putKeys(t->keys, 0, t->n);
+   return st.capacity;
+}
+
+
+static void tableBenchmarks(size_t slots, int maxthreads)
+{
+   static const int percents[] = { 25, 50, 75 };
+   struct table_run t, threads[WORKERS_MAX];
+   struct measure m;
+   struct ht_stats st;
+   size_t capacity, ops, i;
+   int p, sequential, n;
+   char name[64];
+
+   if(!initHashTable(slots))
+      exit(EXIT_FAILURE);
+   getHashStats(&st);
+   printf("table of %zu slots, capacity %zu, %zu MiB\n", st.slots, st.capacity, 
+          st.slots * sizeof(struct ip4bucket) >> 20);
+
+   t.keys = malloc(st.capacity * sizeof(unsigned int));
+   t.extra = malloc(st.capacity * sizeof(unsigned int));
+   t.stream = malloc(TABLE_OPS * sizeof(size_t));
+   if(t.keys == NULL || t.extra == NULL || t.stream == NULL)
+      exit(EXIT_FAILURE);
+
+   for(sequential=0;sequential<2;sequential++)
+   {
+      for(p=0;p<(int)(sizeof(percents) / sizeof(percents[0]));p++)
+      {
+         capacity = fillTable(slots, percents[p], sequential, &t);
+         printf("%d%% of capacity, %s keys\n", percents[p], sequential ? "sequential" : "random");
+
+         fillStream(t.stream, TABLE_OPS, t.n, 0, 2017);
+         measureOne("get hit, uniform", runGet, NULL, &t, TABLE_OPS);
+         fillStream(t.stream, TABLE_OPS, t.n, 1, 2017);
+         measureOne("get hit, zipf", runGet, NULL, &t, TABLE_OPS);
+         fillStream(t.stream, TABLE_OPS, t.n, 0, 2018);
+         measureOne("get miss", runMiss, NULL, &t, TABLE_OPS);
+
+         //the puts stay below the capacity, so nothing is evicted
+         ops = capacity / 8;
+         t.first = 0;
+         measureOne("removeHashItem", runRemove, undoRemove, &t, ops);
+         measureOne("put", runPut, undoPut, &t, ops);
+      }
+   }
+
+   capacity = fillTable(slots, 75, 0, &t);
+   printf("75%% of capacity, random keys, threads\n");
+   for(n=1;n<=maxthreads;n*=2)
+   {
+      ops = t.n / (size_t) n < TABLE_OPS ? t.n / (size_t) n : TABLE_OPS;
+      for(i=0;i<(size_t) n;i++)
+      {
+         threads[i] = t;
+         threads[i].stream = malloc(TABLE_OPS * sizeof(size_t));
+         if(threads[i].stream == NULL)
+            exit(EXIT_FAILURE);
+         fillStream(threads[i].stream, TABLE_OPS, t.n, 0, 2017 + i);
+         threads[i].first = i * ops;
+      }
+
+      m.run = runGet;
+      m.undo = NULL;
+      m.args = threads;
+      m.argsize = sizeof(struct table_run);
+      m.ops = TABLE_OPS;
+      m.threads = n;
+      snprintf(name, sizeof(name), "get hit, %d threads", n);
+      m.name = name;
+      measure(&m);
+
+      m.run = runChurn;
+      m.undo = undoChurn;
+      m.ops = ops / 8;
+      snprintf(name, sizeof(name), "remove and put, %d threads", n);
+      measure(&m);
+
+      for(i=0;i<(size_t) n;i++)
+         free(threads[i].stream);
+   }
+
+   free(t.keys);
+   free(t.extra);
+   free(t.stream);
+}
+
+
+static void runQueueSingle(void *arg, size_t ops)
+{
+   struct queue_run *r = arg;
+   struct queue_item item, out[BATCH_MAX];
+   size_t i, j, n=0;
+
+   memset(&item, 0, sizeof(item));
+   for(i=0;i<ops;i+=r->batch)
+   {
+      for(j=0;j<r->batch;j++)
+         enqueue(r->queue, &item);
+      n += dequeueBatch(r->queue, out, r->batch);
+   }
+   sink = n;
+}
+
+
+static void *consumer(void *arg)
+{
+   struct queue_run *r = arg;
+   struct queue_item out[BATCH_MAX];
+   size_t n=0;
+
+   while(n < r->batch)
+      n += dequeueBatch(r->queue, out, BATCH_MAX);
+   return NULL;
+}
+
+
+/* Sends ops items to a consumer thread, which dequeues them in batches */
+static void runQueueThreads(void *arg, size_t ops)
+{
+   struct queue_run *r = arg, c = *r;
+   struct queue_item item;
+   pthread_t tid;
+   size_t i;
+
+   c.batch = ops;
+   if(pthread_create(&tid, NULL, consumer, &c) != 0)
+   {
+      fprintf(stderr, "Cannot create consumer thread\n");
+      exit(EXIT_FAILURE);
+   }
+
+   memset(&item, 0, sizeof(item));
+   for(i=0;i<ops;i++)
+   {
+      while(enqueue(r->queue, &item) == -1)
+         sched_yield();
+   }
+   pthread_join(tid, NULL);
+}
+
+
+static void queueBenchmarks(void)
+{
+   struct queue_run r;
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   int spin;
+
+   for(spin=0;spin<2;spin++)
+   {
+      r.queue = newQueue(spin);
+      if(r.queue == NULL)
+         exit(EXIT_FAILURE);
+      printf("%s queue\n", spin ? "spin" : "locked");
+
+      r.batch = 1;
+      measureOne("enqueue and dequeue", runQueueSingle, NULL, &r, QUEUE_OPS);
+      r.batch = BATCH_MAX;
+      measureOne("enqueue, dequeue batches", runQueueSingle, NULL, &r, QUEUE_OPS);
+
+      //a spinning consumer needs a cpu of its own
+      if(!spin || cpus > 1)
+         measureOne("producer to consumer", runQueueThreads, NULL, &r, QUEUE_OPS);
+      else
+         printf("  %-28s needs 2 cpus\n", "producer to consumer");
+
+      hugeFree(r.queue, sizeof(struct queue));
+   }
+}
+
+
+static void runParse(void *arg, size_t ops)
+{
+   char (*strings)[IP4_CHAR_LEN] = arg;
+   size_t i;
+   unsigned int sum=0;
+
+   for(i=0;i<ops;i++)
+      sum += parseIP4(strings[i & (PARSE_STRINGS - 1)]);
+   sink = sum;
+}
+
+
+static void runPton(void *arg, size_t ops)
+{
+   char (*strings)[IP4_CHAR_LEN] = arg;
+   struct in_addr a;
+   size_t i;
+   unsigned int sum=0;
+
+   for(i=0;i<ops;i++)
+   {
+      inet_pton(AF_INET, strings[i & (PARSE_STRINGS - 1)], &a);
+      sum += a.s_addr;
+   }
+   sink = sum;
+}
+
+
+static void parseBenchmarks(void)
+{
+   static char strings[PARSE_STRINGS][IP4_CHAR_LEN];
+   unsigned long long seed = 2017, r;
+   size_t i;
+
+   printf("ipv4 parser\n");
+   for(i=0;i<PARSE_STRINGS;i++)
+      strcpy(strings[i], "1.2.3.4");
+   measureOne("parseIP4 short", runParse, NULL, strings, PARSE_OPS);
+
+   for(i=0;i<PARSE_STRINGS;i++)
+      strcpy(strings[i], "192.168.100.200");
+   measureOne("parseIP4 long", runParse, NULL, strings, PARSE_OPS);
+
+   for(i=0;i<PARSE_STRINGS;i++)
+   {
+      r = nextRandom(&seed);
+      snprintf(strings[i], IP4_CHAR_LEN, "%u.%u.%u.%u", (unsigned int)(r & 0xFF) | 1, 
+               (unsigned int)(r >> 8 & 0xFF), (unsigned int)(r >> 16 & 0xFF), 
+               (unsigned int)(r >> 24 & 0xFF));
+   }
+   measureOne("parseIP4 random", runParse, NULL, strings, PARSE_OPS);
+   measureOne("inet_pton random", runPton, NULL, strings, PARSE_OPS);
+}
+
+
+int main(int argc, char* argv[])
+{
+   const char *which = "all";
+   size_t slots = DEFAULT_SLOTS;
+   int threads = DEFAULT_THREADS, all;
+
+   if(argc > 1)
+      which = argv[1];
+   if(argc > 2)
+      slots = strtoul(argv[2], NULL, 10);
+   if(argc > 3)
+      threads = atoi(argv[3]);
+
+   all = strcmp(which, "all") == 0;
+   if(slots < 1024 || threads < 1 || threads > WORKERS_MAX || 
+      (!all && strcmp(which, "table") != 0 && strcmp(which, "queue") != 0 &&
+       strcmp(which, "parse") != 0))
+   {
+       fprintf(stderr,"Usage: %s [table|queue|parse|all] [slots] [threads]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   if(all || strcmp(which, "parse") == 0)
+      parseBenchmarks();
+   if(all || strcmp(which, "queue") == 0)
+      queueBenchmarks();
+   if(all || strcmp(which, "table") == 0)
+      tableBenchmarks(slots, threads);
+
+   return 0;
+}
@@ -0,0 +1,515 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Per prefix rate limits.
+
+ Each configured prefix, e.g. 10.1.0.0/16, has one
+ token bucket shared by all the addresses in it.
+ The rules are read from a file with one prefix,
+ burst and refill per line:
+
+   # prefix        burst  refill
+   10.0.0.0/8      5000   100
+   10.1.2.0/24     200    4
+
+ refill is the number of tokens added every
+ SLEEP_INTERVAL seconds by the update thread, at
+ least 1.
+
+ The longest matching prefix of an address is
+ found in a DIR-24-8 table. tbl24 has an entry
+ for each /24, either the matching rule or a tbl8
+ group of 256 entries for the /24s that have
+ longer prefixes. A lookup reads at most two
+ entries. Each rule links to the longest rule
+ that contains it, so the buckets of all the
+ prefixes of an address are reached by following
+ at most PREFIX_MAX_DEPTH links.
+
+ The class file (classes.c) adds prefixes that
+ only set the rate class of their addresses. A
+ prefix without a class of its own takes the class
+ of the longest prefix containing it, so the class
+ of an address is found by the same lookup.
+
+ The rules are added at startup and the table
+ is built by buildPrefixes() before the processing
+ thread uses it.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define TBL24_SIZE (1UL << 24)
+#define TBL8_SIZE 256
+
+/* tbl24 entry pointing to a tbl8 group */
+#define LPM_GROUP 0x8000U
+
+/*
+ A prefix with a bucket has burst > 0. first is
+ the rule itself if it has a bucket, otherwise
+ parent, the longest rule containing it that has
+ a bucket. depth counts the buckets on the chain.
+ cls is -1 until the table is built if the rule 
+ has no class of its own. 
+*/
+struct prefix_rule
+{
+ unsigned int addr;
+ int len;
+ int burst;
+ int refill;
+ int cls;
+ int first;
+ int parent;
+ int depth;
+ int tokens;
+};
+
+static struct prefix_rule *rules;
+static size_t nrules, maxrules;
+
+/*
+ Entries are 0 if no prefix matches, the rule
+ index + 1, or LPM_GROUP | tbl8 group
+*/
+static unsigned short *tbl24;
+static unsigned short *tbl8;
+static size_t ngroups, maxgroups;
+
+
+/*
+ Returns the index of the rule with the longest
+ prefix matching key k, -1 if there is none
+*/
+int prefix_lookup(unsigned int k)
+{
+   unsigned short e;
+
+   if(tbl24 == NULL)
+      return -1;
+
+   e = tbl24[k >> 8];
+   if(e & LPM_GROUP)
+      e = tbl8[(size_t)(e & ~LPM_GROUP) * TBL8_SIZE + (k & 0xFF)];
+
+   return (int)e - 1;
+}
+
+
+/* Returns a new tbl8 group filled with entry e, -1 on failure */
+static int newGroup(unsigned short e)
+{
+   unsigned short *p;
+   size_t i, n;
+
+   if(ngroups == maxgroups)
+   {
+      n = maxgroups == 0 ? 16 : maxgroups * 2;
+      if(n > LPM_GROUP)
+         n = LPM_GROUP;
+      if(ngroups == n)
+      {
+         fprintf(stderr, "Too many prefixes longer than /24\n");
+         return -1;
+      }
+
+      p = realloc(tbl8, n * TBL8_SIZE * sizeof(*tbl8));
+      if(p == NULL)
+      {
+         fprintf(stderr, "Unable to allocate prefix groups\n");
+         return -1;
+      }
+      tbl8 = p;
+      maxgroups = n;
+   }
+
+   for(i=0;i<TBL8_SIZE;i++)
+      tbl8[ngroups * TBL8_SIZE + i] = e;
+
+   return (int)ngroups++;
+}
+
+
+/*
+ Adds rule r to the table. Rules must be added
+ from the shortest prefix to the longest.
+ Returns 1 if successful, 0 otherwise
+*/
+static int insertRule(size_t r)
+{
+   unsigned int addr = rules[r].addr;
+   int len = rules[r].len, g;
+   size_t i, first, count;
+   unsigned short e = (unsigned short)(r + 1);
+
+   if(len <= 24)
+   {
+      first = addr >> 8;
+      count = 1UL << (24 - len);
+      for(i=0;i<count;i++)
+         tbl24[first + i] = e;
+      return 1;
+   }
+
+   first = addr >> 8;
+   if(!(tbl24[first] & LPM_GROUP))
+   {
+      g = newGroup(tbl24[first]);
+      if(g < 0)
+         return 0;
+      tbl24[first] = (unsigned short)(LPM_GROUP | (unsigned int)g);
+   }
+
+   g = tbl24[first] & ~LPM_GROUP;
+   first = (size_t)g * TBL8_SIZE + (addr & 0xFF);
+   count = 1UL << (32 - len);
+   for(i=0;i<count;i++)
+      tbl8[first + i] = e;
+
+   return 1;
+}
+
+
+/* Orders rules by prefix length, then address */
+static int compareRules(const void *a, const void *b)
+{
+   const struct prefix_rule *x = a, *y = b;
+
+   if(x->len != y->len)
+      return x->len - y->len;
+   return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+
+/*
+ Adds a prefix rule, with a bucket of burst 
+ tokens refilled by refill if burst is not 0 
+ and of class cls if cls is not negative. A
+ bucket needs a refill of at least 1, as a 
+ rate class does. 
+ Returns 1 if successful, 0 otherwise
+*/
+int addPrefixRule(unsigned int addr, int len, int burst, int refill, int cls)
+{
+   struct prefix_rule *p;
+   size_t max;
+
+   if(len < 0 || len > 32 || burst < 0 || refill < 0 || (burst > 0 && refill < 1))
+      return 0;
+
+   if(nrules == PREFIX_MAX)
+   {
+      fprintf(stderr, "More than %d prefix rules\n", PREFIX_MAX);
+      return 0;
+   }
+
+   if(nrules == maxrules)
+   {
+      max = maxrules == 0 ? 64 : maxrules * 2;
+      p = realloc(rules, max * sizeof(*rules));
+      if(p == NULL)
+      {
+         fprintf(stderr, "Unable to allocate prefix rules\n");
+         return 0;
+      }
+      rules = p;
+      maxrules = max;
+   }
+
+   p = &rules[nrules++];
+   memset(p, 0, sizeof(*p));
+   p->addr = len < 32 ? addr & ~(0xFFFFFFFFU >> len) : addr;
+   p->len = len;
+   p->burst = burst;
+   p->refill = refill;
+   p->tokens = burst;
+   p->cls = cls;
+   return 1;
+}
+
+
+/*
+ Reads the prefix limits from fp, one prefix,
+ burst and refill per line. 
+ Returns the number of rules read, -1 on failure
+*/
+int loadPrefixes(FILE *fp)
+{
+   char line[BUFSZ * 2], ip[IP4_CHAR_LEN], extra;
+   size_t lineno=0;
+   unsigned int addr;
+   int len, burst, refill, n, count=0;
+
+   while(fgets(line, sizeof(line), fp) != NULL)
+   {
+      lineno++;
+      line[strcspn(line, "#\r\n")] = '\0';
+      n = sscanf(line, " %15[0-9.]/%d %d %d %c", ip, &len, &burst, &refill, &extra);
+      if(n <= 0)
+         continue;
+
+      addr = parseIP4(ip);
+      if(n != 4 || (addr == 0 && strcmp(ip, "0.0.0.0") != 0) || burst <= 0 ||
+         !addPrefixRule(addr, len, burst, refill, -1))
+      {
+         fprintf(stderr, "Invalid prefix rule on line %zu\n", lineno);
+         return -1;
+      }
+      count++;
+   }
+
+   return count;
+}
+
+
+/*
+ Merges the rules of the same prefix, one may
+ give the bucket and the other the class. 
+ The rules must be sorted. 
+ Returns 1 if successful, 0 on a duplicate
+*/
+static int mergeRules(void)
+{
+   size_t i, n=0;
+   struct prefix_rule *p;
+
+   for(i=0;i<nrules;i++)
+   {
+      p = n > 0 ? &rules[n - 1] : NULL;
+      if(p != NULL && p->addr == rules[i].addr && p->len == rules[i].len)
+      {
+         if((p->burst > 0 && rules[i].burst > 0) || (p->cls >= 0 && rules[i].cls >= 0))
+         {
+            fprintf(stderr, "Duplicate prefix rule /%d\n", p->len);
+            return 0;
+         }
+         if(rules[i].burst > 0)
+         {
+            p->burst = rules[i].burst;
+            p->refill = rules[i].refill;
+            p->tokens = rules[i].tokens;
+         }
+         if(rules[i].cls >= 0)
+            p->cls = rules[i].cls;
+         continue;
+      }
+      rules[n++] = rules[i];
+   }
+
+   nrules = n;
+   return 1;
+}
+
+
+/*
+ Builds the lookup table from the rules added.
+ Prefixes longer than 24 bits need a tbl8 group
+ each, up to 32768 /24s. The rules are numbered 
+ by prefix length and then address. 
+ Returns the number of rules, -1 on failure
+*/
+int buildPrefixes(void)
+{
+   size_t i;
+   int longest, parent;
+
+   if(nrules == 0)
+      return 0;
+
+   tbl24 = hugeAlloc(TBL24_SIZE * sizeof(*tbl24), -1, NULL);
+   if(tbl24 == NULL)
+   {
+      fprintf(stderr, "Unable to allocate prefix table\n");
+      return -1;
+   }
+
+   /* a shorter prefix must be in place before the longer ones it contains */
+   qsort(rules, nrules, sizeof(*rules), compareRules);
+   if(!mergeRules())
+      return -1;
+
+   for(i=0;i<nrules;i++)
+   {
+      longest = prefix_lookup(rules[i].addr);
+      parent = longest < 0 ? -1 : rules[longest].first;
+      if(rules[i].cls < 0)
+         rules[i].cls = longest < 0 ? 0 : rules[longest].cls;
+
+      rules[i].parent = parent;
+      rules[i].first = rules[i].burst > 0 ? (int)i : parent;
+      rules[i].depth = (parent < 0 ? 0 : rules[parent].depth) + (rules[i].burst > 0);
+      if(rules[i].depth > PREFIX_MAX_DEPTH)
+      {
+         fprintf(stderr, "Prefixes nested more than %d deep\n", PREFIX_MAX_DEPTH);
+         return -1;
+      }
+
+      if(!insertRule(i))
+         return -1;
+   }
+
+   return (int)nrules;
+}
+
+
+/* Returns the rate class of the addresses of rule r, or the default class */
+int prefix_class(int r)
+{
+   return r < 0 ? 0 : rules[r].cls;
+}
+
+
+/*
+ Takes n tokens from a prefix bucket and sets
+ left to the tokens that remain in it. 
+ Returns 1 if they were available 
+*/
+static int takeTokens(int *tokens, int n, int *left)
+{
+   int old;
+
+   old = __atomic_load_n(tokens, __ATOMIC_RELAXED);
+   do
+   {
+      if(old < n)
+      {
+         *left = old;
+         return 0;
+      }
+   } while(!__atomic_compare_exchange_n(tokens, &old, old - n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   *left = old - n;
+   return 1;
+}
+
+
+/* Adds n tokens to a prefix bucket, up to burst */
+static void addTokens(int *tokens, int n, int burst)
+{
+   int old, new;
+
+   old = __atomic_load_n(tokens, __ATOMIC_RELAXED);
+   do
+   {
+      new = old + n > burst ? burst : old + n;
+   } while(!__atomic_compare_exchange_n(tokens, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*
+ Takes cost tokens from the bucket of every 
+ prefix of rule r, as returned by prefix_lookup().
+ If one of them is short the tokens already taken
+ are given back. left is set to the fewest tokens
+ left in the prefix buckets, or to those of the 
+ bucket that is short, INT_MAX if there is none.
+ Returns 1 if all had the tokens or no prefix
+ matches, 0 otherwise
+*/
+int prefix_consume(int r, int cost, int *left)
+{
+   int i, j, n;
+
+   *left = INT_MAX;
+   if(r < 0)
+      return 1;
+
+   i = rules[r].first;
+   for(j=i;j>=0;j=rules[j].parent)
+   {
+      if(!takeTokens(&rules[j].tokens, cost, &n))
+      {
+         *left = n;
+         for(;i!=j;i=rules[i].parent)
+            addTokens(&rules[i].tokens, cost, rules[i].burst);
+         return 0;
+      }
+      if(n < *left)
+         *left = n;
+   }
+
+   return 1;
+}
+
+
+/*
+ Gives back the tokens taken by prefix_consume()
+ for rule r, used when the ip bucket denies
+ the request
+*/
+void prefix_refund(int r, int cost)
+{
+   int i;
+
+   if(r < 0)
+      return;
+
+   for(i=rules[r].first;i>=0;i=rules[i].parent)
+      addTokens(&rules[i].tokens, cost, rules[i].burst);
+}
+
+
+/*
+ Returns the nanoseconds until every prefix 
+ bucket of rule r holds cost tokens, next is the
+ nanoseconds until the next refill
+*/
+unsigned long long prefix_wait(int r, int cost, unsigned long long next)
+{
+   unsigned long long w, wait=0;
+   int i;
+
+   if(r < 0)
+      return 0;
+
+   for(i=rules[r].first;i>=0;i=rules[i].parent)
+   {
+      w = refill_wait(cost - __atomic_load_n(&rules[i].tokens, __ATOMIC_RELAXED),
+                      rules[i].refill, next);
+      if(w > wait)
+         wait = w;
+   }
+
+   return wait;
+}
+
+
+/* Refills every prefix bucket, called every SLEEP_INTERVAL */
+void prefix_refill(void)
+{
+   size_t i;
+
+   for(i=0;i<nrules;i++)
+   {
+      if(rules[i].burst > 0)
+         addTokens(&rules[i].tokens, rules[i].refill, rules[i].burst);
+   }
+}
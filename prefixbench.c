@@ -0,0 +1,222 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the prefix limits
+
+ Loads nested /16, /24 and /28 rules and looks up
+ random addresses with the DIR-24-8 table and with
+ a linear scan of the rules. Every lookup of the
+ table is checked against the scan and the
+ benchmark exits with failure on a mismatch.
+ The cost of prefix_consume() is measured for
+ random addresses and for addresses inside three
+ nested prefixes.
+
+ Usage: prefixbench [lookups]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_LOOKUPS 10000000UL
+#define RULES16 1024
+#define RULES24 16384
+#define RULES28 2048
+#define NRULES (RULES16 + RULES24 + RULES28)
+
+struct bench_rule
+{
+ unsigned int addr;
+ int len;
+};
+
+static struct bench_rule brules[NRULES];
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/* Orders rules like loadPrefixes() numbers them */
+static int compareRules(const void *a, const void *b)
+{
+   const struct bench_rule *x = a, *y = b;
+
+   if(x->len != y->len)
+      return x->len - y->len;
+   return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+
+/* Writes the nested rules to fp */
+static void writeRules(FILE *fp)
+{
+   size_t i, n=0;
+   unsigned int a;
+
+   for(i=0;i<RULES16;i++)
+   {
+      brules[n].addr = (unsigned int)((i * 7 + 11) & 0xFFFF) << 16;
+      brules[n++].len = 16;
+   }
+   for(i=0;i<RULES24;i++)
+   {
+      brules[n].addr = brules[i % RULES16].addr | (unsigned int)(i / RULES16) << 8;
+      brules[n++].len = 24;
+   }
+   for(i=0;i<RULES28;i++)
+   {
+      brules[n].addr = brules[RULES16 + i].addr | 0x30;
+      brules[n++].len = 28;
+   }
+
+   qsort(brules, n, sizeof(*brules), compareRules);
+
+   for(i=0;i<n;i++)
+   {
+      a = brules[i].addr;
+      fprintf(fp, "%u.%u.%u.%u/%d 1000000 0\n", a >> 24, (a >> 16) & 0xFF,
+              (a >> 8) & 0xFF, a & 0xFF, brules[i].len);
+   }
+}
+
+
+/* Returns the longest rule matching k by a linear scan, -1 if none */
+static int scanRules(unsigned int k)
+{
+   size_t i;
+   int best=-1, bestlen=-1;
+   unsigned int mask;
+
+   for(i=0;i<NRULES;i++)
+   {
+      mask = brules[i].len == 0 ? 0 : 0xFFFFFFFFU << (32 - brules[i].len);
+      if((k & mask) == brules[i].addr && brules[i].len > bestlen)
+      {
+         best = (int)i;
+         bestlen = brules[i].len;
+      }
+   }
+
+   return best;
+}
+
+
+int main(int argc, char* argv[])
+{
+   size_t lookups = DEFAULT_LOOKUPS, i, matched=0;
+   unsigned int seed = 2017, k;
+   unsigned long long start;
+   volatile int sink = 0;
+   double t;
+   FILE *fp;
+   int r, left;
+
+   if(argc > 1)
+      lookups = strtoul(argv[1], NULL, 10);
+
+   if(lookups == 0)
+   {
+       fprintf(stderr,"Usage: %s [lookups]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   fp = tmpfile();
+   if(fp == NULL)
+   {
+       fprintf(stderr,"Unable to create rule file\n");
+       exit(EXIT_FAILURE);
+   }
+   writeRules(fp);
+   rewind(fp);
+   r = loadPrefixes(fp);
+   fclose(fp);
+   if(r != NRULES || buildPrefixes() != NRULES)
+      exit(EXIT_FAILURE);
+
+   printf("Rules: %d /16, %d /24, %d /28\n", RULES16, RULES24, RULES28);
+
+   /* check against the scan, half the addresses inside a rule */
+   for(i=0;i<100000;i++)
+   {
+      k = nextRandom(&seed);
+      if(i & 1)
+         k = brules[k % NRULES].addr | (k >> 24);
+      r = prefix_lookup(k);
+      if(r != scanRules(k))
+      {
+         fprintf(stderr, "Lookup mismatch for %08x\n", k);
+         exit(EXIT_FAILURE);
+      }
+      matched += r >= 0;
+   }
+   printf("checked 100000 lookups against a linear scan, %zu matched\n", matched);
+
+   start = monotonicNow();
+   for(i=0;i<lookups;i++)
+      sink += prefix_lookup(nextRandom(&seed));
+   t = (double)(monotonicNow() - start) / lookups;
+   printf("DIR-24-8 lookup:         %8.2f ns\n", t);
+
+   start = monotonicNow();
+   for(i=0;i<lookups / 1000;i++)
+      sink += scanRules(nextRandom(&seed));
+   t = (double)(monotonicNow() - start) / (lookups / 1000);
+   printf("linear scan:             %8.2f ns\n", t);
+
+   start = monotonicNow();
+   for(i=0;i<lookups;i++)
+   {
+      r = prefix_lookup(nextRandom(&seed));
+      sink += prefix_consume(r, 1, &left);
+      prefix_refund(r, 1);
+   }
+   t = (double)(monotonicNow() - start) / lookups;
+   printf("consume random:          %8.2f ns\n", t);
+
+   start = monotonicNow();
+   for(i=0;i<lookups;i++)
+   {
+      k = brules[RULES16 + RULES24 + nextRandom(&seed) % RULES28].addr | 0x5; //28 in 24 in 16
+      r = prefix_lookup(k);
+      sink += prefix_consume(r, 1, &left);
+      prefix_refund(r, 1);
+   }
+   t = (double)(monotonicNow() - start) / lookups;
+   printf("consume 3 nested:        %8.2f ns\n", t);
+
+   return 0;
+}
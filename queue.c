@@ -29,6 +29,14 @@
  dequeue operation blocking where there is no
  data in the queue. 
 
+ A spin queue, for the busy polling mode, is a 
+ lock free ring of a single producer and a single
+ consumer. The producer publishes an item by a
+ release store of tail, the consumer frees its 
+ slots by a release store of head, and an empty 
+ queue is polled instead of waited for, which 
+ saves the wakeup of the consumer. 
+
  Ng Chiang Lin
  April 2017
 */
@@ -48,6 +56,80 @@ void initQueue(struct queue * q)
 }
 
 
+/*
+Allocates and initializes a queue on the
+NUMA node of the calling thread, which should
+be the thread that dequeues from it. A spin
+queue if spin is set. 
+Returns a pointer to the queue, NULL on failure
+*/
+struct queue *newQueue(int spin)
+{
+  struct queue *q;
+
+  q = hugeAlloc(sizeof(struct queue), -1, NULL);
+  if(q == NULL)
+    return NULL;
+
+  initQueue(q);
+  q->spin = spin;
+  return q;
+}
+
+
+/* 
+Enqueues item on the spin queue q. 
+Returns 1 if success, -1 if the queue is full
+*/
+static int spinEnqueue(struct queue *q, struct queue_item *item)
+{
+   size_t tail = q->tail;
+
+   if(tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= QUEUESZ)
+      return -1;
+
+   q->qarray[tail & (QUEUESZ - 1)] = *item;
+   __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+   return 1;
+}
+
+
+/* 
+Waits for items on the spin queue q and 
+returns the tail it has seen
+*/
+static size_t spinWait(struct queue *q)
+{
+   size_t tail;
+
+   while((tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) == q->head)
+      cpuRelax();
+
+   return tail;
+}
+
+
+/* 
+Dequeues up to max items of the spin queue q
+into items, spins if the queue is empty. 
+Returns the number of items dequeued
+*/
+static size_t spinDequeueBatch(struct queue *q, struct queue_item *items, size_t max)
+{
+   size_t head = q->head, tail, n=0;
+
+   tail = spinWait(q);
+   while(head != tail && n < max)
+   {
+      items[n++] = q->qarray[head & (QUEUESZ - 1)];
+      head++;
+   }
+   __atomic_store_n(&q->head, head, __ATOMIC_RELEASE);
+
+   return n;
+}
+
+
 /*
 Enqueues a queue item
 Takes a pointer to a queue and
@@ -61,6 +143,9 @@ int enqueue( struct queue * q, struct queue_item* item)
    if(q == NULL || item == NULL)
      return -1; 
 
+   if(q->spin)
+     return spinEnqueue(q, item);
+
    pthread_mutex_lock( &q->lock );
 
    if( q->size >= QUEUESZ)
@@ -83,6 +168,43 @@ int enqueue( struct queue * q, struct queue_item* item)
 }
 
 
+/*
+Dequeues up to max queue items into items, 
+blocks if there is no data in queue. 
+The items are copied out, so they cannot be
+overwritten by enqueue() while in use. 
+Returns the number of items dequeued
+*/
+size_t dequeueBatch(struct queue * q, struct queue_item *items, size_t max)
+{
+   size_t n=0;
+
+   if(q == NULL || items == NULL || max == 0)
+      return 0;
+
+   if(q->spin)
+      return spinDequeueBatch(q, items, max);
+
+    pthread_mutex_lock(&q->lock );
+    while(q->size == 0)
+    { //conditional block when no data in queue
+       pthread_cond_wait(&q->qready, &q->lock);
+    }
+
+    while(q->size > 0 && n < max)
+    {
+       items[n++] = q->qarray[q->front];
+       q->size--;
+       q->front++;
+       if(q->front == QUEUESZ)
+             q->front=0;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
+
 /*
 Dequeues a queue item, blocks
 if there is no data in queue
@@ -98,6 +220,14 @@ struct queue_item* dequeue(struct queue * q )
    if(q == NULL)
       return NULL;
 
+   if(q->spin)
+   {
+      spinWait(q);
+      ret = &q->qarray[q->head & (QUEUESZ - 1)];
+      __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+      return ret;
+   }
+
     pthread_mutex_lock(&q->lock );
     while(q->size == 0)
     { //conditional block when no data in queue
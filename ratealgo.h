@@ -0,0 +1,656 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Rate algorithms used by the token bucket server.
+
+ Two algorithms are available:
+
+ RATE_ALGO_TOKEN_BUCKET
+   The original algorithm. Each bucket holds a token
+   count that is decremented per request and refilled
+   by the update thread every SLEEP_INTERVAL seconds.
+   The refill is not written into the buckets. Each
+   class keeps the tokens it has refilled so far, 
+   its credit, and a count is kept relative to it,
+   so the update thread adds the refill once per
+   class and never races the requests that take
+   tokens from a count.
+
+ RATE_ALGO_GCRA
+   Generic cell rate algorithm. Each bucket holds a single
+   theoretical arrival time (tat) in microseconds. A request
+   is allowed if it does not push the tat further than the
+   burst tolerance into the future. No refill is needed,
+   the update thread only reclaims buckets whose tat has
+   already passed.
+
+   The tat is kept in 32 bits like the token count, so
+   both algorithms use the same memory per bucket. It is
+   relative to an epoch that moves with the clock: the 
+   microseconds wrap every 71 minutes and a tat is only
+   compared to the time through its signed distance, 
+   which stays below GCRA_WINDOW. A tat is never further
+   ahead than the tolerance of its class, see 
+   rate_class_fits(), and the update thread removes or 
+   clamps the tats that have passed, so none falls more
+   than a few SLEEP_INTERVAL behind.
+
+ The limits of a bucket are given by its rate class,
+ see struct rate_class. 
+
+ The algorithm is chosen at build time, e.g.
+ make ALGO=GCRA
+ Every function here is static inline and the rate_* macros
+ map directly to the selected algorithm, so processing() is
+ specialized for it instead of calling through a pointer.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#ifndef RATEALGO_H
+#define RATEALGO_H
+
+#include <time.h>
+
+#define RATE_ALGO_TOKEN_BUCKET 1
+#define RATE_ALGO_GCRA 2
+
+#ifndef RATE_ALGO
+#define RATE_ALGO RATE_ALGO_TOKEN_BUCKET
+#endif
+
+/* 
+ Limits of the default rate class, used when
+ no class file is given
+*/
+#define MAX_TOKENS 50
+
+/* 1 token refill per 3 seconds */
+#define TOKEN_REFILL 1
+#define SLEEP_INTERVAL 3
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000ULL
+#define USEC_PER_SEC 1000000ULL
+
+/* GCRA emission interval in microseconds, time for one token to be refilled */
+#define GCRA_INTERVAL ((SLEEP_INTERVAL * USEC_PER_SEC) / TOKEN_REFILL)
+
+/* GCRA burst tolerance, allows MAX_TOKENS back to back requests */
+#define GCRA_LIMIT (GCRA_INTERVAL * MAX_TOKENS)
+
+/* 
+ Largest distance in microseconds between a tat 
+ and the time, about 35 minutes
+*/
+#define GCRA_WINDOW 0x7FFFFFFFULL
+
+
+/*
+ Rate class, the limits a bucket is checked
+ against. burst is the number of tokens of a full
+ bucket, refill the tokens added every SLEEP_INTERVAL
+ seconds and cost the tokens used by a request of the
+ class. interval and limit are the GCRA emission
+ interval and burst tolerance in microseconds for
+ burst and refill. debt and delay are zero unless
+ requests are shaped, they are the tokens a token
+ bucket may go below zero and the microseconds a 
+ GCRA request may be delayed beyond the limit. 
+ credit is the tokens refilled so far to every
+ token bucket of the class, see rate_credit().
+*/
+struct rate_class
+{
+ int burst;
+ int refill;
+ int cost;
+ int debt;
+ unsigned int credit;
+ unsigned long long interval;
+ unsigned long long limit;
+ unsigned long long delay;
+};
+
+#define RATE_CLASS_DEFAULT \
+  { MAX_TOKENS, TOKEN_REFILL, 1, 0, 0, GCRA_INTERVAL, GCRA_LIMIT, 0 }
+
+
+/* Sets up a rate class, refill must be at least 1 */
+static inline void rate_class_init(struct rate_class *c, int burst,
+                                   int refill, int cost)
+{
+   c->burst = burst;
+   c->refill = refill;
+   c->cost = cost;
+   c->debt = 0;
+   c->credit = 0;
+   c->interval = (SLEEP_INTERVAL * USEC_PER_SEC) / (unsigned long long)refill;
+   c->limit = c->interval * (unsigned long long)burst;
+   c->delay = 0;
+}
+
+
+/*
+ Lets the requests of class c be delayed by up
+ to maxdelay nanoseconds instead of denied. A
+ token bucket gets its refills in steps of 
+ SLEEP_INTERVAL, so it borrows only the refills
+ that are due within maxdelay, at most burst.
+*/
+static inline void rate_class_shape(struct rate_class *c, unsigned long long maxdelay)
+{
+   unsigned long long refills = maxdelay / (SLEEP_INTERVAL * NSEC_PER_SEC);
+
+   c->debt = refills * (unsigned long long)c->refill > (unsigned long long)c->burst ? 
+             c->burst : (int)(refills * (unsigned long long)c->refill);
+   c->delay = maxdelay / NSEC_PER_USEC;
+}
+
+
+/*
+ Returns the nanoseconds until a bucket that
+ gains refill tokens every SLEEP_INTERVAL has 
+ gained need tokens, next is the nanoseconds
+ until its next refill.
+*/
+static inline unsigned long long refill_wait(int need, int refill, 
+                                             unsigned long long next)
+{
+   if(need <= 0)
+      return 0;
+   return next + (unsigned long long)((need - 1) / refill) * 
+                 SLEEP_INTERVAL * NSEC_PER_SEC;
+}
+
+
+/* Returns the monotonic clock in nanoseconds */
+static inline unsigned long long monotonicNow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * NSEC_PER_SEC +
+          (unsigned long long)ts.tv_nsec;
+}
+
+/* Returns the monotonic clock in microseconds, the time of GCRA */
+static inline unsigned long long gcraNow(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * USEC_PER_SEC +
+          (unsigned long long)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+
+/*
+ Token bucket primitives
+ The state is the number of tokens left less
+ the credit of the class, in wrapping 32 bit
+ arithmetic. A level above the burst is capped
+ when tokens are taken, the tokens refilled 
+ beyond it are lost.
+*/
+
+/* Returns the credit of class c */
+static inline unsigned int tb_credit(const struct rate_class *c)
+{
+   return __atomic_load_n(&c->credit, __ATOMIC_RELAXED);
+}
+
+/* Returns the tokens in the bucket, not capped at the burst */
+static inline int tb_level(int *count, const struct rate_class *c)
+{
+   return (int)((unsigned int) *count + tb_credit(c));
+}
+
+/* Sets up a new bucket with used tokens already consumed */
+static inline void tb_init_used(int *count, int used, const struct rate_class *c)
+{
+   *count = (int)((unsigned int)(c->burst - used) - tb_credit(c));
+}
+
+/* Sets up a new bucket, the first request is consumed */
+static inline void tb_init(int *count, const struct rate_class *c)
+{
+   tb_init_used(count, c->cost, c);
+}
+
+/*
+ Consumes cost tokens, borrowing up to the debt
+ of the class when requests are shaped.
+ Returns 1 if enough tokens are available, 0 otherwise.
+*/
+static inline int tb_consume(int *count, int cost, const struct rate_class *c)
+{
+   unsigned int credit = tb_credit(c);
+   int t = (int)((unsigned int) *count + credit);
+
+   if(t > c->burst)
+      t = c->burst;
+   if(t - cost >= -c->debt)
+   {
+      *count = (int)((unsigned int)(t - cost) - credit);
+      return 1;
+   }
+   return 0;
+}
+
+/* Returns 1 if the bucket holds all its tokens, 0 otherwise */
+static inline int tb_full(int *count, const struct rate_class *c)
+{
+   return tb_level(count, c) >= c->burst;
+}
+
+/*
+ The refill is added to the credit of the class
+ by rate_credit(), the count is left alone.
+ Returns 1 if the bucket has been full for a
+ refill and can be removed from the hash table,
+ 0 otherwise.
+*/
+static inline int tb_refill(int *count, const struct rate_class *c)
+{
+   return tb_level(count, c) > c->burst;
+}
+
+/* Returns the tokens left in the bucket */
+static inline int tb_tokens(int *count, const struct rate_class *c)
+{
+   int t = tb_level(count, c);
+
+   if(t < 0)
+      return 0;
+   return t > c->burst ? c->burst : t;
+}
+
+/*
+ Returns the nanoseconds until the bucket holds
+ n tokens, next is the nanoseconds until the 
+ next refill
+*/
+static inline unsigned long long tb_wait(int *count, int n, const struct rate_class *c,
+                                         unsigned long long next)
+{
+   return refill_wait(n - tb_level(count, c), c->refill, next);
+}
+
+/*
+ Takes from the bucket the tokens consumed from
+ another copy of it while the state of the copy
+ went from from to to, under the same credit
+*/
+static inline void tb_replay(int *count, int from, int to, const struct rate_class *c)
+{
+   unsigned int credit = tb_credit(c);
+   int used = (int)((unsigned int) from + credit), t;
+
+   if(used > c->burst)
+      used = c->burst;
+   used -= (int)((unsigned int) to + credit);
+   if(used <= 0)
+      return;
+
+   t = tb_level(count, c);
+   if(t > c->burst)
+      t = c->burst;
+   *count = (int)((unsigned int)(t - used) - credit);
+}
+
+/* Refills every bucket of class c */
+static inline void tb_credit_refill(struct rate_class *c)
+{
+   __atomic_store_n(&c->credit, c->credit + (unsigned int) c->refill, __ATOMIC_RELAXED);
+}
+
+
+/*
+ GCRA primitives
+ The state is the theoretical arrival time in
+ microseconds of the monotonic clock, in 32 bits.
+ now is the time from gcraNow(), the tat and now
+ are compared through their distance only.
+*/
+
+/* Returns the microseconds from now to tat, 0 if tat has passed */
+static inline unsigned long long gcra_ahead(unsigned int *tat, unsigned long long now)
+{
+   int d = (int)(*tat - (unsigned int) now);
+
+   return d > 0 ? (unsigned long long) d : 0;
+}
+
+/* Sets up a new bucket with used tokens already consumed */
+static inline void gcra_init_used(unsigned int *tat, int used,
+                                  const struct rate_class *c,
+                                  unsigned long long now)
+{
+   unsigned long long t = c->interval * (unsigned long long)(used < 0 ? 0 : used);
+
+   if(t > c->limit + c->delay)
+      t = c->limit + c->delay;
+   *tat = (unsigned int)(now + t);
+}
+
+/* Sets up a new bucket, the first request is consumed */
+static inline void gcra_init(unsigned int *tat, const struct rate_class *c,
+                             unsigned long long now)
+{
+   gcra_init_used(tat, c->cost, c, now);
+}
+
+/*
+ Consumes cost tokens at time now. A request
+ that is shaped conforms if it is due within
+ the delay of the class.
+ Returns 1 if the request conforms, 0 otherwise.
+*/
+static inline int gcra_consume(unsigned int *tat, int cost,
+                               const struct rate_class *c,
+                               unsigned long long now)
+{
+   unsigned long long t;
+
+   t = gcra_ahead(tat, now) + c->interval * (unsigned long long)cost;
+   if(t > c->limit + c->delay)
+      return 0;
+
+   *tat = (unsigned int)(now + t);
+   return 1;
+}
+
+/*
+ Returns 1 if the tat has passed, meaning the
+ bucket holds all its tokens, 0 otherwise
+*/
+static inline int gcra_full(unsigned int *tat, unsigned long long now)
+{
+   return (int)(*tat - (unsigned int) now) <= 0;
+}
+
+/*
+ GCRA needs no refill. A tat that has passed
+ is moved up to now, so it stays within
+ GCRA_WINDOW of the time while the bucket
+ waits to be removed.
+ Returns 1 if the bucket is full and can be
+ removed, 0 otherwise.
+*/
+static inline int gcra_refill(unsigned int *tat, unsigned long long now)
+{
+   if(!gcra_full(tat, now))
+      return 0;
+   *tat = (unsigned int) now;
+   return 1;
+}
+
+/*
+ Returns the tokens left at time now, the 
+ requests of cost 1 that would still conform
+*/
+static inline int gcra_tokens(unsigned int *tat, const struct rate_class *c,
+                              unsigned long long now)
+{
+   unsigned long long t = gcra_ahead(tat, now);
+
+   if(t >= c->limit)
+      return 0;
+   return (int)((c->limit - t) / c->interval);
+}
+
+/* Returns the nanoseconds from now until the bucket holds n tokens */
+static inline unsigned long long gcra_wait(unsigned int *tat, int n,
+                                           const struct rate_class *c,
+                                           unsigned long long now)
+{
+   unsigned long long t = gcra_ahead(tat, now);
+
+   t += c->interval * (unsigned long long)n;
+   return t > c->limit ? (t - c->limit) * NSEC_PER_USEC : 0;
+}
+
+/*
+ Moves the tat on by the time consumed from
+ another copy of the bucket, whose tat went 
+ from from to to by the requests made after
+ then, up to the limit and delay of the class
+*/
+static inline void gcra_replay(unsigned int *tat, unsigned int from, unsigned int to,
+                               const struct rate_class *c, unsigned long long then,
+                               unsigned long long now)
+{
+   unsigned long long t;
+   int d;
+
+   if(gcra_full(&from, then))
+      from = (unsigned int) then;
+   d = (int)(to - from);
+   if(d <= 0)
+      return;
+
+   t = gcra_ahead(tat, now) + (unsigned long long) d;
+   if(t > c->limit + c->delay)
+      t = c->limit + c->delay;
+   *tat = (unsigned int)(now + t);
+}
+
+/*
+ Returns 1 if the tats of class c stay within
+ GCRA_WINDOW of the time, 0 otherwise
+*/
+static inline int gcra_fits(const struct rate_class *c)
+{
+   return c->interval > 0 && c->limit + c->delay <= GCRA_WINDOW;
+}
+
+
+/* 
+ Selected algorithm
+ rate_idle() is a state that is not full and 
+ allows no request, for slots without a bucket.
+ For GCRA it is the tat furthest from now, so it
+ holds for GCRA_WINDOW.
+ rate_class_fits() tells whether the states of a
+ class can be held by rate_state_t.
+ rate_credit() refills the buckets of a class, 
+ the update thread calls it once per refill 
+ before it looks for the full buckets.
+ rate_replay() charges a bucket with the requests
+ taken from an old copy of it, once a copied 
+ table is swapped in.
+*/
+#if RATE_ALGO == RATE_ALGO_GCRA
+
+typedef unsigned int rate_state_t;
+
+#define RATE_ALGO_NAME "GCRA"
+#define rate_idle(now) ((unsigned int)((now) + GCRA_WINDOW))
+#define rate_now() gcraNow()
+#define rate_class_fits(c) gcra_fits((c))
+#define rate_credit(c) ((void)(c))
+#define rate_init(s, c, now) gcra_init((s), (c), (now))
+#define rate_init_used(s, used, c, now) gcra_init_used((s), (used), (c), (now))
+#define rate_consume(s, cost, c, now) gcra_consume((s), (cost), (c), (now))
+#define rate_refill(s, c, now) ((void)(c), gcra_refill((s), (now)))
+#define rate_full(s, c, now) ((void)(c), gcra_full((s), (now)))
+#define rate_tokens(s, c, now) gcra_tokens((s), (c), (now))
+#define rate_wait(s, n, c, now, next) ((void)(next), gcra_wait((s), (n), (c), (now)))
+#define rate_replay(s, from, to, c, then, now) gcra_replay((s), (from), (to), (c), (then), (now))
+
+#elif RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+
+typedef int rate_state_t;
+
+#define RATE_ALGO_NAME "Token Bucket"
+#define rate_idle(now) ((void)(now), -(1 << 30))
+#define rate_now() 0ULL
+#define rate_class_fits(c) ((void)(c), 1)
+#define rate_credit(c) tb_credit_refill((c))
+#define rate_init(s, c, now) ((void)(now), tb_init((s), (c)))
+#define rate_init_used(s, used, c, now) ((void)(now), tb_init_used((s), (used), (c)))
+#define rate_consume(s, cost, c, now) ((void)(now), tb_consume((s), (cost), (c)))
+#define rate_refill(s, c, now) ((void)(now), tb_refill((s), (c)))
+#define rate_full(s, c, now) ((void)(now), tb_full((s), (c)))
+#define rate_tokens(s, c, now) ((void)(now), tb_tokens((s), (c)))
+#define rate_wait(s, n, c, now, next) ((void)(now), tb_wait((s), (n), (c), (next)))
+#define rate_replay(s, from, to, c, then, now) \
+  ((void)(then), (void)(now), tb_replay((s), (from), (to), (c)))
+
+#else
+#error "Unknown RATE_ALGO"
+#endif
+
+
+/*
+ Consumes cost tokens from a bucket state of 
+ class c that other threads update at the same
+ time, and sets seen to the state it left, from
+ which rate_tokens() and rate_wait() tell the
+ client where it stands. 
+ A request is taken whole or not at all.
+ Returns 1 if allowed, 0 otherwise.
+*/
+static inline int rate_consume_atomic(rate_state_t *s, int cost,
+                                      const struct rate_class *c,
+                                      unsigned long long now, rate_state_t *seen)
+{
+   rate_state_t old, new;
+
+   old = __atomic_load_n(s, __ATOMIC_RELAXED);
+   do
+   {
+      new = old;
+      if(!rate_consume(&new, cost, c, now))
+      {
+         *seen = old;
+         return 0;
+      }
+   } while(!__atomic_compare_exchange_n(s, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   *seen = new;
+   return 1;
+}
+
+/*
+ Charges a bucket state of class c that other
+ threads update at the same time with what was
+ consumed from an old copy of it, whose state
+ went from from to to after then, see 
+ rate_replay(). 
+*/
+static inline void rate_replay_atomic(rate_state_t *s, rate_state_t from, rate_state_t to,
+                                      const struct rate_class *c, unsigned long long then,
+                                      unsigned long long now)
+{
+   rate_state_t old, new;
+
+   old = __atomic_load_n(s, __ATOMIC_RELAXED);
+   do
+   {
+      new = old;
+      rate_replay(&new, from, to, c, then, now);
+      if(new == old)
+         break;
+   } while(!__atomic_compare_exchange_n(s, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ Refills a bucket state of class c that other 
+ threads update at the same time. A state the
+ refill leaves as it is, as the token bucket 
+ always does, is not written.
+ Returns 1 if the bucket is full, 0 otherwise.
+*/
+static inline int rate_refill_atomic(rate_state_t *s, const struct rate_class *c,
+                                     unsigned long long now)
+{
+   rate_state_t old, new;
+   int full;
+
+   old = __atomic_load_n(s, __ATOMIC_RELAXED);
+   do
+   {
+      new = old;
+      full = rate_refill(&new, c, now);
+      if(new == old)
+         break;
+   } while(!__atomic_compare_exchange_n(s, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   return full;
+}
+
+/* 
+ Answer to a request. left is the tokens left.
+ wait is the nanoseconds until the next token 
+ if the request is allowed, until it can be 
+ allowed if it is denied, and the delay the
+ client must keep first if it is shaped. 
+*/
+struct rate_reply
+{
+ int allowed;
+ int shaped;
+ int left;
+ unsigned long long wait;
+};
+
+/* 
+ Fills the reply r to a request of cost tokens
+ from the state seen of its bucket of class c
+ once status is decided. next is the time in 
+ nanoseconds until the next refill. 
+*/
+static inline void rate_reply_bucket(struct rate_reply *r, int status, rate_state_t *seen,
+                                     int cost, const struct rate_class *c,
+                                     unsigned long long now, unsigned long long next)
+{
+   r->allowed = status;
+   r->shaped = 0;
+   r->left = rate_tokens(seen, c, now);
+   if(!status)
+      r->wait = rate_wait(seen, cost, c, now, next);
+   else if((r->wait = rate_wait(seen, 0, c, now, next)) > 0) //in debt
+      r->shaped = 1;
+   else if(r->left < c->burst)
+      r->wait = rate_wait(seen, r->left + 1, c, now, next);
+}
+
+/* 
+ Formats the reply r as the server sends it, 
+ VERB left wait_ms, into buf of size bytes. 
+ Returns the length of the reply with its NUL
+*/
+static inline int rate_reply_format(char *buf, size_t size, const struct rate_reply *r)
+{
+   const char *verb = r->shaped ? "WAIT" : r->allowed ? "OK" : "NOK";
+
+   return snprintf(buf, size, "%s %d %llu", verb, r->left < 0 ? 0 : r->left, 
+                   (r->wait + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC) + 1;
+}
+
+#endif
@@ -0,0 +1,170 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark comparing the token bucket and the
+ GCRA rate algorithms defined in ratealgo.h.
+
+ Both algorithms are run over the same random
+ sequence of bucket indexes. The token bucket is
+ charged for its consume step and for the refill
+ sweep the update thread has to do. GCRA is charged
+ for its consume step including the clock read
+ that processing() does for every request.
+
+ Usage: ratebench [buckets] [operations]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_BUCKETS 65536
+#define DEFAULT_OPS 20000000
+#define SWEEPS 100
+
+static struct rate_class defclass = RATE_CLASS_DEFAULT;
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+static double elapsedNs(unsigned long long start)
+{
+   return (double)(monotonicNow() - start);
+}
+
+
+int main(int argc, char* argv[])
+{
+   size_t nbuckets = DEFAULT_BUCKETS, nops = DEFAULT_OPS, i, j;
+   unsigned int *idx, seed = 2017;
+   int *counts;
+   unsigned int *tats;
+   unsigned long long start, now, allowed;
+   double t;
+
+   if(argc > 1)
+      nbuckets = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      nops = strtoul(argv[2], NULL, 10);
+
+   if(nbuckets == 0 || nops == 0)
+   {
+       fprintf(stderr,"Usage: %s [buckets] [operations]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   idx = malloc(nops * sizeof(unsigned int));
+   counts = malloc(nbuckets * sizeof(int));
+   tats = malloc(nbuckets * sizeof(unsigned int));
+   if(idx == NULL || counts == NULL || tats == NULL)
+   {
+       fprintf(stderr,"Unable to allocate memory\n");
+       exit(EXIT_FAILURE);
+   }
+
+   for(i=0;i<nops;i++)
+      idx[i] = nextRandom(&seed) % nbuckets;
+
+   printf("Buckets: %zu Operations: %zu\n", nbuckets, nops);
+   printf("State per bucket: token bucket %zu bytes, GCRA %zu bytes\n",
+          sizeof(int), sizeof(unsigned int));
+
+
+   /* Token bucket consume */
+   for(i=0;i<nbuckets;i++)
+      tb_init(&counts[i], &defclass);
+
+   allowed = 0;
+   start = monotonicNow();
+   for(i=0;i<nops;i++)
+      allowed += tb_consume(&counts[idx[i]], 1, &defclass);
+   t = elapsedNs(start);
+   printf("token bucket consume: %8.2f ns/op allowed %llu\n", t / nops, allowed);
+
+   /* Token bucket refill sweep done by the update thread */
+   allowed = 0;
+   start = monotonicNow();
+   for(j=0;j<SWEEPS;j++)
+   {
+      tb_credit_refill(&defclass);
+      for(i=0;i<nbuckets;i++)
+      {
+         if(tb_refill(&counts[i], &defclass))
+         {
+            allowed++;
+            tb_init(&counts[i], &defclass);
+         }
+      }
+   }
+   t = elapsedNs(start);
+   printf("token bucket refill: %8.2f ns/bucket per sweep, %.3f ms per sweep\n",
+          t / (SWEEPS * nbuckets), t / SWEEPS / 1e6);
+
+
+   /* GCRA consume with a clock read per request */
+   now = gcraNow();
+   for(i=0;i<nbuckets;i++)
+      gcra_init(&tats[i], &defclass, now);
+
+   allowed = 0;
+   start = monotonicNow();
+   for(i=0;i<nops;i++)
+      allowed += gcra_consume(&tats[idx[i]], 1, &defclass, gcraNow());
+   t = elapsedNs(start);
+   printf("GCRA consume:         %8.2f ns/op allowed %llu\n", t / nops, allowed);
+
+   /* GCRA consume with the clock read once per batch */
+   for(i=0;i<nbuckets;i++)
+      gcra_init(&tats[i], &defclass, now);
+
+   allowed = 0;
+   start = monotonicNow();
+   for(i=0;i<nops;i++)
+   {
+      if((i & 63) == 0)
+         now = gcraNow();
+      allowed += gcra_consume(&tats[idx[i]], 1, &defclass, now);
+   }
+   t = elapsedNs(start);
+   printf("GCRA consume batched: %8.2f ns/op allowed %llu\n", t / nops, allowed);
+   printf("GCRA refill:              none\n");
+
+   free(idx);
+   free(counts);
+   free(tats);
+
+   return 0;
+}
@@ -35,27 +35,26 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
 
-
-/* Rate definitions */
-#define MAX_TOKENS 50
-
-/* 1 token refill per 3 seconds */
-#define TOKEN_REFILL 1
-#define SLEEP_INTERVAL 3
+#include "ratealgo.h"
 
 
 /* Queue Definitions*/
 
-#define QUEUESZ 256
+#define QUEUESZ 256 /* a power of two, for the spin queues */
 #define MSGSZ 64
 
 struct queue_item
@@ -66,6 +65,12 @@ struct queue_item
 };
 
 
+/* 
+ A spin queue has a single producer and a single
+ consumer, which spins instead of waiting on qready.
+ head and tail count the items dequeued and queued, 
+ on cache lines of their own. 
+*/
 struct queue
 {
  size_t size;
@@ -73,14 +78,27 @@ struct queue
  size_t end;
  pthread_mutex_t lock;
  pthread_cond_t qready;
- struct queue_item qarray[QUEUESZ];
+ int spin;
+ size_t head __attribute__((aligned(64)));
+ size_t tail __attribute__((aligned(64)));
+ struct queue_item qarray[QUEUESZ] __attribute__((aligned(64)));
 };
 
 void initQueue(struct queue * q);
+struct queue *newQueue(int spin);
 int enqueue( struct queue * q, struct queue_item * item);
 struct queue_item* dequeue(struct queue * q );
+size_t dequeueBatch(struct queue * q, struct queue_item *items, size_t max);
 
-struct queue input_queue;
+/* Hint to the cpu that the thread is spinning */
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__)
+   __asm__ __volatile__("yield");
+#endif
+}
 
 /* IPv4 Bucket definitions */
 #define IP4_CHAR_LEN 16
@@ -90,38 +108,668 @@ struct queue input_queue;
  The first member ipv4 
  serves as the key for the hash
  table that is used later. 
- count and addr are considered
- as the actual hash data
+ state and addr are considered
+ as the actual hash data. 
+ state holds the token count or the
+ theoretical arrival time depending
+ on the rate algorithm selected. 
+ cls is the rate class of the bucket. 
+ ref is the reference bit used by the
+ CLOCK eviction of the hash table and 
+ retired is set while a removed bucket
+ waits for its grace period. 
 */
 struct ip4bucket
 {
  unsigned int ipv4;
- int count;
+ rate_state_t state;
  char addr[IP4_CHAR_LEN];
+ unsigned char cls;
+ unsigned char ref;
+ unsigned char retired;
 };
 
 
 unsigned int parseIP4(const char * p);
+void formatIP4(unsigned int ip, char *buf);
 void copy_ip4_bucket_data(struct ip4bucket *s, struct ip4bucket *d);
 void empty_ip4_bucket(struct ip4bucket *s);
 
 
+/* IPv6 bucket definitions */
+#define IP6_CHAR_LEN INET6_ADDRSTRLEN
+
+/* 
+ Default prefix length of the ipv6 keys. 
+ A host usually gets a whole /64, so the
+ addresses in it share one bucket. 
+*/
+#define IP6_PREFIX 64
+
+struct ip6key
+{
+ unsigned long long hi;
+ unsigned long long lo;
+};
+
+/* 
+ IPv6 Bucket structure
+ key is the ipv6 prefix, hash is the low 
+ 32 bits of its hash and gives its home 
+ slot in the hash table. The bucket is 
+ 32 bytes, two fit in a cache line. 
+*/
+struct ip6bucket
+{
+ struct ip6key key;
+ rate_state_t state;
+ unsigned int hash;
+ unsigned char cls;
+ unsigned char ref;
+} __attribute__((aligned(32)));
+
+int parseIP6(const char *p, int prefix, struct ip6key *k);
+
+
+/* Rate class definitions */
+
+/* 
+ Classes are numbered in a byte of each bucket,
+ class 0 is the default class
+*/
+#define RATE_CLASS_MAX 64
+#define RATE_CLASS_NAME_LEN 16
+#define RATE_BURST_MAX 1000000
+
+extern struct rate_class rate_classes[RATE_CLASS_MAX];
+extern int rate_class_count;
+
+/* 
+ Returns the class of a bucket with class byte c,
+ the default class if c is not defined. The bytes
+ lie in shared memory that clients can write.
+*/
+static inline unsigned int classIndex(unsigned int c)
+{
+   return c < (unsigned int) rate_class_count ? c : 0;
+}
+
+int loadClasses(FILE *fp);
+int findClass(const char *name);
+const char *className(int c);
+int classCount(void);
+int minRefill(void);
+void refillClasses(void);
+
+
+/* Random seed definitions */
+
+void randomSeeds(unsigned long long *seeds, size_t n);
+void fixSeeds(unsigned long long seed);
+
+
+/* Memory allocation definitions */
+
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+#define HUGE_MIN (HUGEPAGE_SIZE / 4)
+
+#define HUGE_NONE 0
+#define HUGE_THP 1
+#define HUGE_TLB 2
+
+void setHugePages(int enable);
+int currentNode(void);
+void *hugeAlloc(size_t size, int node, int *huge);
+void hugeFree(void *p, size_t size);
+
+
+/* Epoch based reclamation definitions */
+
+#define CACHELINE 64
+#define EBR_MAX_THREADS 64
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_synchronize(void);
+unsigned long ebr_advance(void);
+int ebr_passed(unsigned long e);
+
+
 /* Hash table definitions */
 
 /*
- Use a prime number for hash table size 
- The hash table itself is a static array 
- defined in hashtable.c 
+ Layout of the bucket states, chosen at build time. 
+ AOS keeps the state in struct ip4bucket, SOA keeps
+ the states of a table in a dense array that the 
+ update thread refills with rate_sweep(). 
+ e.g. make LAYOUT=SOA
+*/
+#define TABLE_LAYOUT_AOS 1
+#define TABLE_LAYOUT_SOA 2
+
+#ifndef TABLE_LAYOUT
+#define TABLE_LAYOUT TABLE_LAYOUT_AOS
+#endif
+
+/*
+ Default hash table size, a prime number. 
+ The size can be given to initHashTable(), 
+ it is rounded up to a prime. 
 */
 #define HASHSZ 4093
 
-extern pthread_mutex_t ht_datalock;
+/* 
+ Keys marking empty and deleted slots, 
+ neither is accepted as an ip key
+*/
+#define HT_EMPTY 0
+#define HT_DELETED 0xFFFFFFFFU
+
+/* 
+ Buckets in use before put() evicts one. 
+ The load is capped so that probe sequences
+ stay short. 
+*/
+#define HT_CAPACITY(n) ((n) - (n) / 8)
 
-void initHashTable(void);
+/* Retired slots before put() reclaims them itself */
+#define HT_RECLAIM(n) ((n) / 32)
+
+/* Used and deleted slots before the update thread purges deleted ones */
+#define HT_PURGE(n) ((n) - (n) / 16)
+
+/* 
+ Slots the CLOCK hand looks at for an eviction.
+ It stops after CLOCK_SCAN slots if it has a
+ victim and never goes beyond CLOCK_MAX_SCAN. 
+*/
+#define CLOCK_SCAN 16
+#define CLOCK_MAX_SCAN 64
+
+/* Keys looked up together by consumeBatch() */
+#define BATCH_MAX 64
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+  do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+  } while(0)
+
+/* 
+ SipHash-1-3 of the 4 byte ip with key seeds, 
+ a single block holding the ip and the length.
+ Shared with the clients of the shared table. 
+*/
+static inline unsigned long long ip4Hash(const unsigned long long *seeds, unsigned int ip)
+{
+  unsigned long long v0 = seeds[0] ^ 0x736f6d6570736575ULL;
+  unsigned long long v1 = seeds[1] ^ 0x646f72616e646f6dULL;
+  unsigned long long v2 = seeds[0] ^ 0x6c7967656e657261ULL;
+  unsigned long long v3 = seeds[1] ^ 0x7465646279746573ULL;
+  unsigned long long m = (4ULL << 56) | ip;
+
+  v3 ^= m;
+  SIPROUND(v0, v1, v2, v3);
+  v0 ^= m;
+  v2 ^= 0xff;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* 
+ Returns the first slot of the probe sequence
+ of hash h in a table of size slots and sets 
+ step to its probe step, from 1 to size-1. 
+ The two halves of the hash are scaled down
+ with a multiply instead of a division.
+*/
+static inline size_t ip4ProbeStart(unsigned long long h, size_t size, size_t *step)
+{
+  *step = (size_t) ((((h >> 32) * (size - 1)) >> 32) + 1);
+  return (size_t) (((h & 0xFFFFFFFFULL) * size) >> 32);
+}
+
+struct ht_stats
+{
+ size_t size;
+ size_t evicted_full;
+ size_t evicted_lru;
+ size_t evict_failed;
+ size_t purges;
+ size_t reclaimed;
+ size_t slots;
+ size_t capacity;
+ size_t max_probe;
+ int huge;
+};
+
+int initHashTable(size_t slots);
 size_t put(unsigned int k, struct ip4bucket v);
+size_t putNew(unsigned int k, struct ip4bucket v);
 struct ip4bucket *getHashItem(size_t i);
 struct ip4bucket * get(unsigned int k);
+int consumeBucket(unsigned int k, int cost, unsigned long long now, rate_state_t *seen);
+void consumeBatch(const unsigned int *keys, const int *costs, size_t n, 
+                  unsigned long long now, int *results, rate_state_t *seen);
 size_t removeHashItem(unsigned int k);
+size_t refillHashTable(unsigned long long now);
+size_t reclaimHashItems(void);
+size_t purgeHashTable(void);
+void getHashStats(struct ht_stats *s);
+
+
+/* IPv6 hash table definitions */
+
+int initHashTable6(size_t slots);
+size_t put6(const struct ip6key *k, rate_state_t state, int cls);
+int consumeBucket6(const struct ip6key *k, int cost, unsigned long long now, 
+                   rate_state_t *seen);
+size_t refillHashTable6(unsigned long long now);
+void getHashStats6(struct ht_stats *s);
+
+
+/* Refill sweep definitions */
+
+size_t rate_sweep(rate_state_t *s, const unsigned char *cls, size_t n,
+                  unsigned long long now, unsigned long long *mask);
+const char *sweepKind(void);
+
+
+/* Prefix limit definitions */
+
+/* 
+ Rules fit in the 15 bit entries of the
+ prefix table, and an address is checked
+ against at most PREFIX_MAX_DEPTH nested 
+ prefixes
+*/
+#define PREFIX_MAX 32767
+#define PREFIX_MAX_DEPTH 8
+
+int addPrefixRule(unsigned int addr, int len, int burst, int refill, int cls);
+int loadPrefixes(FILE *fp);
+int buildPrefixes(void);
+int prefix_lookup(unsigned int k);
+int prefix_class(int r);
+int prefix_consume(int r, int cost, int *left);
+void prefix_refund(int r, int cost);
+unsigned long long prefix_wait(int r, int cost, unsigned long long next);
+void prefix_refill(void);
+
+
+/* Allow and deny list definitions */
+#define LIST_NONE 0
+#define LIST_ALLOW 1
+#define LIST_DENY 2
+
+long loadLists(const char *path);
+int list_lookup(unsigned int k);
+
+
+/* Heavy hitter definitions */
+
+/* 
+ Each worker tracks the ipv4 keys that ask for the
+ most tokens in TOPK_SLOTS counters (topk.c), which
+ are halved every TOPK_DECAY seconds. The admin 
+ query TOPK_QUERY of a local client is answered 
+ with the TOPK_REPORT heaviest keys of the workers. 
+ TOPK_INDEX is a power of two. 
+*/
+#define TOPK_SLOTS 64
+#define TOPK_INDEX 128
+#define TOPK_REPORT 20
+#define TOPK_DECAY 60
+#define TOPK_QUERY "top"
+
+/* 
+ tokens counts the tokens asked for by the key, 
+ with at most error of them from the keys it 
+ replaced. slot is the index entry of the key. 
+*/
+struct topk_entry
+{
+ unsigned int key;
+ unsigned int slot;
+ unsigned long long tokens;
+ unsigned long long error;
+ unsigned long requests;
+ unsigned long denies;
+};
+
+/* 
+ heap is a min heap on tokens of the n tracked 
+ keys and index gives the heap position + 1 of 
+ a key, 0 if the index entry is empty. 
+*/
+struct topk
+{
+ pthread_mutex_t lock;
+ size_t n;
+ struct topk_entry heap[TOPK_SLOTS];
+ unsigned char index[TOPK_INDEX];
+};
+
+struct topk *newTopK(void);
+void topk_begin(struct topk *t);
+void topk_end(struct topk *t);
+void topk_add(struct topk *t, unsigned int k, int cost, int denied);
+void topk_decay(struct topk *t);
+size_t topk_collect(struct topk *t, struct topk_entry *out);
+size_t topk_merge(struct topk_entry *e, size_t n);
+
+
+/* Scope definitions */
+
+/* 
+ A request can name a scope after SCOPE_SEP, e.g.
+ "10.1.2.3@/v1/search" or "2001:db8::1@tenant42",
+ to get a bucket of its own for the address in 
+ that scope. The name is interned in an arena
+ (scope.c) and the bucket is kept in a table of 
+ 128 bit keys, the address and the number of the 
+ scope. Once SCOPE_MAX names or SCOPE_ARENA bytes
+ are used, new scopes share SCOPE_OVERFLOW. 
+*/
+#define SCOPE_SEP '@'
+#define SCOPE_LEN 32
+#define SCOPE_MAX 65536
+#define SCOPE_ARENA (SCOPE_MAX * 16)
+#define SCOPE_OVERFLOW 0xFFFFFFFFU
+
+int initScopes(void);
+unsigned int internScope(const char *name);
+
+/* 
+ Sets k to the key of the bucket of scope of 
+ the ipv4 address or the ipv6 prefix hi of 
+ family. The key of an ipv6 address only holds
+ its first 64 bits. 
+*/
+static inline void scopeKey(unsigned long long addr, int family, unsigned int scope, 
+                            struct ip6key *k)
+{
+  k->hi = addr;
+  k->lo = ((unsigned long long)(unsigned int) family << 32) | scope;
+}
+
+int initScopeTable(size_t slots);
+size_t putScoped(const struct ip6key *k, rate_state_t state, int cls);
+int consumeScoped(const struct ip6key *k, int cost, unsigned long long now, 
+                  rate_state_t *seen);
+size_t refillScopeTable(unsigned long long now);
+void getScopeStats(struct ht_stats *s);
+
+
+/* Trace definitions */
+
+/* 
+ With -r the queries are recorded in a trace 
+ file (trace.c) for replaybench. The file starts
+ with struct trace_header, then each query is a 
+ struct trace_record followed by the len bytes 
+ of its message, in the byte order of the host. 
+ time is in nanoseconds since the start of the
+ trace and peer holds the address of an ipv4
+ or ipv6 client in network order. 
+*/
+#define TRACE_MAGIC 0x54425452U
+#define TRACE_VERSION 1
+#define TRACE_PEER_UNIX 1
+#define TRACE_PEER_IP4 4
+#define TRACE_PEER_IP6 6
+
+struct trace_header
+{
+ unsigned int magic;
+ unsigned int version;
+ unsigned long long start;
+};
+
+struct trace_record
+{
+ unsigned long long time;
+ unsigned char peer[16];
+ unsigned short port;
+ unsigned char family;
+ unsigned char len;
+};
+
+int openTrace(const char *path);
+void traceRequest(const struct queue_item *qt);
+void flushTrace(void);
+FILE *readTraceHeader(const char *path, struct trace_header *h);
+int readTrace(FILE *fp, struct trace_record *r, char *msg);
+
+
+/* Dump definitions */
+
+/* 
+ With -o the ipv4 hash table is dumped to a file
+ on SIGUSR1 (dump.c), and with -i the buckets of
+ a dump are loaded at start. A binary dump is a
+ struct dump_header followed by count records, 
+ in the byte order of the host. A file whose name
+ ends in DUMP_CSV holds lines of ip,class,tokens,burst
+ instead. Records keep the tokens left rather than
+ the rate state, so a dump loads in either rate 
+ algorithm. The class is a number in a binary 
+ dump, the classes must be the same when it is 
+ loaded. 
+*/
+#define DUMP_MAGIC 0x54424450U
+#define DUMP_VERSION 1
+#define DUMP_CSV ".csv"
+
+/* Slots copied in one read section, buckets loaded under one lock */
+#define DUMP_CHUNK 4096
+
+struct dump_header
+{
+ unsigned int magic;
+ unsigned int version;
+ unsigned long long count;
+ unsigned long long time;
+};
+
+struct dump_record
+{
+ unsigned int key;
+ int tokens;
+ unsigned char cls;
+ unsigned char pad[3];
+};
+
+size_t snapshotHashTable(struct dump_record *out, size_t max, unsigned long long now);
+size_t preloadHashTable(const struct dump_record *r, size_t n, unsigned long long now);
+int dumpHashTable(const char *path);
+long loadDump(const char *path);
+
+
+/* Global budget definitions */
+
+/*
+ The global budget is split into per thread 
+ shards, each on its own cache line. A thread 
+ leases up to BUDGET_CHUNK tokens at a time from
+ the shared pool into its shard, and the update
+ thread gives the unused tokens back to the pool.
+*/
+#define BUDGET_SHARDS 64
+#define BUDGET_CHUNK 64
+
+int initBudget(unsigned long rate);
+int budget_take(int cost);
+void budget_refund(int cost);
+unsigned long long budget_wait(int cost);
+void budget_reconcile(void);
+
+
+/* Worker definitions */
+
+/* 
+ Workers with -w, each with its own ipv4 socket,
+ queue and processing thread. A request for key
+ k is steered to worker k % workers. 
+*/
+#define WORKERS_MAX 16
+
+int attachSteering(int socket, int workers);
+
+
+/* Busy polling definitions */
+
+/* 
+ With -b the receiving and processing threads 
+ are pinned to the listed cpus and spin instead
+ of sleeping. BUSY_POLL_US is the SO_BUSY_POLL
+ time of the sockets in microseconds. 
+*/
+#define BUSY_CPUS_MAX 64
+#define BUSY_POLL_US 50
+
+int parseCpuList(const char *list, int *cpus, int max);
+int pinThread(int cpu);
+int busyPollSocket(int socket);
+
+
+/* Shared memory definitions */
+
+/*
+ With -s the ipv4 hash table is placed in a
+ named shared memory segment that local clients
+ map with the tbshm library (tbshm.h). The 
+ segment starts with struct shm_header, the 
+ tables follow at the offsets it gives. 
+*/
+#define SHM_MAGIC 0x54425348U
+#define SHM_VERSION 1
+
+/* Client processes attached at the same time */
+#define SHM_CLIENTS 256
+
+/* 
+ Set in the flags of the header when a client
+ decides a request to a bucket in the table as
+ the server would. Otherwise, and for new ips,
+ clients send their requests to the server. 
+ Requests decided by clients are not in the
+ heavy hitter summary, and the flag is not set
+ while the server records a trace. 
+*/
+#define SHM_LOCAL 1
+
+/* 
+ Read section announcement of a client process, 
+ pid is 0 if the slot is free
+*/
+struct shm_client
+{
+ unsigned long epoch;
+ int pid;
+ char pad[CACHELINE - sizeof(unsigned long) - sizeof(int)];
+};
+
+struct shm_header
+{
+ unsigned int magic;
+ unsigned int version;
+ int algo;
+ int layout;
+ int flags;
+ int port;
+ size_t bucketsize;
+ size_t slots;
+ unsigned long long seeds[2];
+ size_t tables[2];
+ size_t states[2];
+ size_t classes[2];
+ int current;
+ unsigned long long refilltime;
+ struct rate_class rates[RATE_CLASS_MAX];
+ unsigned long epoch __attribute__((aligned(CACHELINE)));
+ struct shm_client clients[SHM_CLIENTS] __attribute__((aligned(CACHELINE)));
+};
+
+int initShm(const char *name);
+void *shmAlloc(size_t size);
+int shmFree(void *p, size_t size);
+void shareHashTable(struct ip4bucket **tables, rate_state_t **states, 
+                    unsigned char **classes, size_t slots, 
+                    const unsigned long long *seeds);
+void shareCurrentTable(int current);
+void shareRefill(unsigned long long t);
+void publishShm(int flags, int port);
+void ebr_share(unsigned long *epoch, struct shm_client *clients, int n);
+
+
+/* Count-min sketch definitions */
+
+/*
+ The sketch counts the tokens used by each ip
+ in SKETCH_DEPTH rows of SKETCH_WIDTH saturating 
+ 8 bit counters. Its size is fixed and does not
+ depend on the number of distinct ip addresses. 
+
+ The estimate of an ip never undercounts. With N 
+ the tokens recorded since the counters were last
+ zero, it overcounts by more than e/SKETCH_WIDTH * N
+ with probability at most exp(-SKETCH_DEPTH). 
+*/
+#define SKETCH_DEPTH 4
+#define SKETCH_BITS 20
+#define SKETCH_WIDTH (1U << SKETCH_BITS)
+#define SKETCH_MAX 255
+
+/* 
+ In hybrid mode an ip that has used this many 
+ tokens is moved to the exact hash table
+*/
+#define SKETCH_PROMOTE 8
+
+int initSketch(void);
+int sketch_consume(unsigned int k, int cost, int burst);
+int sketch_estimate(unsigned int k);
+void sketch_decay(int rate);
+
+
+/* Limiter modes */
+#define LIMIT_EXACT 0
+#define LIMIT_SKETCH 1
+#define LIMIT_HYBRID 2
+
+
+/* Request decision definitions */
+
+/* 
+ Decision on a request of a batch. key is its 
+ ipv4 key, 0 for ipv6 and invalid requests. 
+ replied is 0 if it gets no reply, denied is 1
+ if it was denied, 0 if allowed and -1 if it is
+ not counted in the heavy hitters. 
+*/
+struct batch_decision
+{
+ struct rate_reply reply;
+ unsigned int key;
+ int cost;
+ int replied;
+ int denied;
+};
+
+void setIP6Prefix(int n);
+void decideBatch(struct queue_item *items, size_t n, int mode, unsigned long long now,
+                 unsigned long long next, struct batch_decision *d);
+
+/* Longest delay of a shaped request, one hour */
+#define MAX_DELAY_MS 3600000UL
 
 #define BUFSZ 64
 
@@ -0,0 +1,436 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Replay of a trace recorded with tbserver -r
+
+ By default the queries are replayed in process
+ with a virtual clock, the time of each query in
+ the trace. They go through a queue and are 
+ decided in batches of up to BATCH_MAX by the 
+ decideBatch() of the server in exact mode, with
+ the ipv4, ipv6 and scoped hash tables in the 
+ default class, refilled at every SLEEP_INTERVAL
+ of the trace. The seeds of
+ the hash tables are fixed, so a replay of one 
+ trace always gives the same decisions. The
+ latency of a query is the time to decide its 
+ batch. 
+
+ With -l the queries are sent to a server on the
+ loopback interface at the pace of the trace, 
+ scaled by the speed of -x, 0 for as fast as the
+ server answers. Up to POOL_SOCKETS queries are 
+ in flight, each on a socket of its own so that
+ the replies of several workers are matched. 
+
+ Both modes print the throughput, the latency
+ percentiles and the count of each decision. -o
+ writes the decision stream, a line of the query
+ index and its reply, - if there is none, so 
+ that the results of two builds can be diffed. 
+
+ Usage: replaybench [-l] [-x speed] [-t slots] [-o file] trace
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define POOL_SOCKETS 64
+#define REPLY_LEN 32
+#define REPLY_TIMEOUT NSEC_PER_SEC
+#define REPLAY_SEED 2017
+
+/* virtual time of the start of the trace, for GCRA */
+#define VIRTUAL_START (3600ULL * NSEC_PER_SEC)
+
+struct query
+{
+ unsigned long long time;
+ char msg[MSGSZ];
+};
+
+/* reply and latency of each query, latency 0 if there is no reply */
+static char (*replies)[REPLY_LEN];
+static unsigned long long *latencies;
+
+
+/* 
+ Reads the queries of the trace path into q. 
+ Returns the number of queries, 0 on failure
+*/
+static size_t loadTrace(const char *path, struct query **q)
+{
+   struct trace_header h;
+   struct trace_record r;
+   struct query *p;
+   size_t n=0, size=1024;
+   FILE *fp;
+
+   fp = readTraceHeader(path, &h);
+   if(fp == NULL)
+      return 0;
+
+   *q = malloc(size * sizeof(struct query));
+   while(*q != NULL && readTrace(fp, &r, (*q)[n].msg))
+   {
+      (*q)[n++].time = r.time;
+      if(n == size)
+      {
+         size *= 2;
+         p = realloc(*q, size * sizeof(struct query));
+         if(p == NULL)
+            free(*q);
+         *q = p;
+      }
+   }
+   fclose(fp);
+
+   if(*q == NULL)
+   {
+      fprintf(stderr, "Unable to allocate the queries\n");
+      return 0;
+   }
+   return n;
+}
+
+
+/* 
+ Decides the queries of items, all at virtual 
+ time now with next ns until the refill, with 
+ the exact mode of the server and writes their
+ replies from index first
+*/
+static void replayBatch(struct queue_item *items, size_t n, unsigned long long now,
+                        unsigned long long next, size_t first)
+{
+   struct batch_decision d[BATCH_MAX];
+   size_t i;
+
+   decideBatch(items, n, LIMIT_EXACT, now, next, d);
+   for(i=0;i<n;i++)
+   {
+      if(d[i].replied)
+         rate_reply_format(replies[first + i], REPLY_LEN, &d[i].reply);
+      else
+         strcpy(replies[first + i], "-");
+   }
+}
+
+
+/* Returns the rate algorithm time of trace time t */
+static unsigned long long virtualNow(unsigned long long t)
+{
+#if RATE_ALGO == RATE_ALGO_GCRA
+   return VIRTUAL_START + t;
+#else
+   (void) t;
+   return rate_now();
+#endif
+}
+
+
+/* 
+ Replays the n queries q in process and sets
+ seconds to the time it took. 
+ Returns 1 if successful, 0 otherwise
+*/
+static int replayLocal(struct query *q, size_t n, size_t slots, double *seconds)
+{
+   struct queue_item item, items[BATCH_MAX];
+   struct queue *queue;
+   unsigned long long refill = SLEEP_INTERVAL * NSEC_PER_SEC, begin, start, t;
+   size_t i=0, m, j;
+
+   fixSeeds(REPLAY_SEED);
+   setHugePages(0);
+   queue = newQueue(0);
+   if(queue == NULL || !initHashTable(slots) || !initHashTable6(slots) ||
+      !initScopes() || !initScopeTable(slots))
+      return 0;
+
+   memset(&item, 0, sizeof(item));
+   begin = monotonicNow();
+   while(i < n)
+   {
+      while(q[i].time >= refill)
+      {//the update thread
+         refillClasses();
+         refillHashTable(virtualNow(refill));
+         refillHashTable6(virtualNow(refill));
+         refillScopeTable(virtualNow(refill));
+         reclaimHashItems();
+         purgeHashTable();
+         refill += SLEEP_INTERVAL * NSEC_PER_SEC;
+      }
+
+      start = monotonicNow();
+      for(m=0;i + m<n && m<BATCH_MAX && q[i + m].time<refill;m++)
+      {
+         strcpy(item.msg, q[i + m].msg);
+         enqueue(queue, &item);
+      }
+
+      m = dequeueBatch(queue, items, BATCH_MAX);
+      t = q[i + m - 1].time;
+      replayBatch(items, m, virtualNow(t), refill - t, i);
+
+      t = monotonicNow() - start + 1;
+      for(j=0;j<m;j++)
+         latencies[i + j] = t;
+      i += m;
+   }
+
+   *seconds = (double)(monotonicNow() - begin) / NSEC_PER_SEC;
+   return 1;
+}
+
+
+/* 
+ Reads the replies of the sockets that poll() 
+ found ready and gives up on the queries that 
+ waited longer than REPLY_TIMEOUT. 
+ Returns the number of queries done
+*/
+static size_t collectReplies(struct pollfd *fds, long *pending, 
+                             unsigned long long *sent, int timeout)
+{
+   unsigned long long clock;
+   ssize_t len;
+   size_t done=0;
+   int i;
+
+   if(poll(fds, POOL_SOCKETS, timeout) == -1)
+      return 0;
+
+   clock = monotonicNow();
+   for(i=0;i<POOL_SOCKETS;i++)
+   {
+      if(pending[i] < 0)
+         continue;
+
+      if(fds[i].revents & POLLIN)
+      {
+         len = recv(fds[i].fd, replies[pending[i]], REPLY_LEN - 1, 0);
+         if(len <= 0)
+            continue;
+         replies[pending[i]][len] = '\0';
+         latencies[pending[i]] = clock - sent[i] + 1;
+      }
+      else if(clock - sent[i] > REPLY_TIMEOUT)
+         strcpy(replies[pending[i]], "-");
+      else
+         continue;
+
+      pending[i] = -1;
+      done++;
+   }
+
+   return done;
+}
+
+
+/* 
+ Replays the n queries q over loopback at speed 
+ times their pace, 0 for as fast as possible, and
+ sets seconds to the time it took. 
+ Returns 1 if successful, 0 otherwise
+*/
+static int replayLoopback(struct query *q, size_t n, double speed, double *seconds)
+{
+   struct pollfd fds[POOL_SOCKETS];
+   struct sockaddr_in in;
+   long pending[POOL_SOCKETS];
+   unsigned long long sent[POOL_SOCKETS], start, due, clock;
+   size_t i, done=0;
+   int s, timeout;
+
+   memset(&in, 0, sizeof(in));
+   in.sin_family = AF_INET;
+   in.sin_port = htons(3211);
+   in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   for(s=0;s<POOL_SOCKETS;s++)
+   {
+      fds[s].fd = socket(AF_INET, SOCK_DGRAM, 0);
+      fds[s].events = POLLIN;
+      pending[s] = -1;
+      if(fds[s].fd == -1 || connect(fds[s].fd, (struct sockaddr *) &in, sizeof(in)) == -1)
+      {
+         perror("Socket error");
+         return 0;
+      }
+   }
+
+   start = monotonicNow();
+   for(i=0,s=0;i<n;i++)
+   {
+      due = speed > 0 ? start + (unsigned long long)((double)(q[i].time - q[0].time) / speed) : 0;
+      while(1)
+      {
+         for(s=0;s<POOL_SOCKETS && pending[s]>=0;s++)
+            ;
+         clock = monotonicNow();
+         if(s < POOL_SOCKETS && clock >= due)
+            break;
+         timeout = s < POOL_SOCKETS ? (int)((due - clock) / NSEC_PER_MSEC) : 1;
+         done += collectReplies(fds, pending, sent, timeout);
+      }
+
+      pending[s] = (long) i;
+      sent[s] = monotonicNow();
+      if(send(fds[s].fd, q[i].msg, strlen(q[i].msg) + 1, 0) == -1)
+         perror("Send error");
+      done += collectReplies(fds, pending, sent, 0);
+   }
+
+   while(done < n)
+      done += collectReplies(fds, pending, sent, 1);
+
+   *seconds = (double)(monotonicNow() - start) / NSEC_PER_SEC;
+   for(s=0;s<POOL_SOCKETS;s++)
+      close(fds[s].fd);
+   return 1;
+}
+
+
+/* Orders latencies */
+static int compareTimes(const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a;
+   unsigned long long y = *(const unsigned long long *) b;
+
+   return (x > y) - (x < y);
+}
+
+
+/* Prints the decisions and the latencies of the n queries */
+static void printResults(size_t n, double seconds)
+{
+   static const char *verbs[] = { "OK", "NOK", "WAIT", "-" };
+   size_t counts[4] = { 0, 0, 0, 0 }, answered=0, i, v;
+
+   for(i=0;i<n;i++)
+   {
+      for(v=0;v<3 && strncmp(replies[i], verbs[v], strcspn(replies[i], " "))!=0;v++)
+         ;
+      counts[v]++;
+      if(latencies[i] > 0)
+         latencies[answered++] = latencies[i];
+   }
+
+   printf("%zu queries in %.3f s, %.0f queries/s\n", n, seconds, n / seconds);
+   printf("OK %zu NOK %zu WAIT %zu no reply %zu\n", counts[0], counts[1], counts[2], counts[3]);
+   if(answered == 0)
+      return;
+
+   qsort(latencies, answered, sizeof(*latencies), compareTimes);
+   printf("latency p50 %.2f us, p99 %.2f us, p99.9 %.2f us, max %.2f us\n",
+          (double) latencies[answered / 2] / 1000, 
+          (double) latencies[answered - answered / 100 - 1] / 1000,
+          (double) latencies[answered - answered / 1000 - 1] / 1000,
+          (double) latencies[answered - 1] / 1000);
+}
+
+
+int main(int argc, char* argv[])
+{
+   const char *output = NULL;
+   struct query *q;
+   size_t n, i, slots = HASHSZ;
+   double speed = 1, seconds;
+   int opt, loopback=0, ok;
+   char *end;
+   FILE *fp;
+
+   while((opt = getopt(argc, argv, "lx:t:o:")) != -1)
+   {
+      switch(opt)
+      {
+         case 'l':
+            loopback = 1;
+            break;
+         case 'x':
+            speed = strtod(optarg, &end);
+            if(*end != '\0' || speed < 0)
+               speed = -1;
+            break;
+         case 't':
+            slots = strtoul(optarg, &end, 10);
+            if(*end != '\0')
+               slots = 0;
+            break;
+         case 'o':
+            output = optarg;
+            break;
+         default:
+            speed = -1;
+      }
+   }
+
+   if(optind != argc - 1 || speed < 0 || slots == 0)
+   {
+       fprintf(stderr,"Usage: %s [-l] [-x speed] [-t slots] [-o file] trace\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   n = loadTrace(argv[optind], &q);
+   if(n == 0)
+   {
+       fprintf(stderr,"No queries in %s\n", argv[optind]);
+       exit(EXIT_FAILURE);
+   }
+
+   replies = calloc(n, sizeof(*replies));
+   latencies = calloc(n, sizeof(*latencies));
+   if(replies == NULL || latencies == NULL)
+      exit(EXIT_FAILURE);
+
+   printf("Replaying %zu queries over %.3f s %s\n", n, (double) q[n - 1].time / NSEC_PER_SEC,
+          loopback ? "over loopback" : "in process");
+   ok = loopback ? replayLoopback(q, n, speed, &seconds) : 
+                   replayLocal(q, n, slots, &seconds);
+   if(!ok)
+      exit(EXIT_FAILURE);
+
+   if(output != NULL)
+   {
+      fp = fopen(output, "w");
+      if(fp == NULL)
+      {
+         perror("Unable to write the decisions");
+         exit(EXIT_FAILURE);
+      }
+      for(i=0;i<n;i++)
+         fprintf(fp, "%zu %s\n", i, replies[i]);
+      fclose(fp);
+   }
+
+   printResults(n, seconds);
+   free(q);
+   return 0;
+}
@@ -0,0 +1,236 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Scopes of the composite keys. 
+
+ A request can name a scope after its address, 
+ such as an api route or a tenant, to be limited
+ by a bucket of the address in that scope. The 
+ scope names come from the clients and vary in 
+ length, so each is interned once: its bytes are 
+ copied into a single arena allocated at start 
+ and it is given a number. The bucket is then 
+ found by the fixed size key of the address and 
+ that number (scopeKey()), without comparing any
+ string. 
+
+ The names are indexed in an open addressing 
+ table on a SipHash of the name with a random 
+ key. Lookups of a known scope take no lock, a 
+ new scope is added under a mutex and published 
+ with a release store of its number. Nothing in
+ the arena is ever freed, the numbers stay valid
+ as long as the server runs. Once the arena or 
+ the numbers run out every new scope is given 
+ SCOPE_OVERFLOW, so a client cannot escape its 
+ limits by making up scopes. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <ctype.h>
+
+
+/* slots of the name index, twice SCOPE_MAX */
+#define SCOPE_SLOTS (SCOPE_MAX * 2)
+
+/* 
+ Each name is kept in the arena as a length 
+ byte followed by its bytes and a '\0'
+*/
+static char *arena;
+static size_t arenaused;
+static int arenahuge;
+
+/* offset in the arena of the name of each scope */
+static unsigned int offsets[SCOPE_MAX + 1];
+static unsigned int nscopes;
+
+/* scope of each index slot, 0 if empty, and the hash of its name */
+static unsigned int scopeindex[SCOPE_SLOTS];
+static unsigned int scopehashes[SCOPE_SLOTS];
+
+static unsigned long long scopeseeds[2];
+static pthread_mutex_t scopelock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* 
+ SipHash-1-3 of the len bytes of name, in 
+ 8 byte blocks with the length in the last one
+*/
+static unsigned long long scopeHash(const char *name, size_t len)
+{
+   unsigned long long v0 = scopeseeds[0] ^ 0x736f6d6570736575ULL;
+   unsigned long long v1 = scopeseeds[1] ^ 0x646f72616e646f6dULL;
+   unsigned long long v2 = scopeseeds[0] ^ 0x6c7967656e657261ULL;
+   unsigned long long v3 = scopeseeds[1] ^ 0x7465646279746573ULL;
+   unsigned long long m;
+   size_t i, j;
+
+   for(i=0;i+8<=len;i+=8)
+   {
+      memcpy(&m, name + i, 8);
+      v3 ^= m;
+      SIPROUND(v0, v1, v2, v3);
+      v0 ^= m;
+   }
+
+   m = (unsigned long long) len << 56;
+   for(j=0;i+j<len;j++)
+      m |= (unsigned long long)(unsigned char) name[i + j] << (8 * j);
+
+   v3 ^= m;
+   SIPROUND(v0, v1, v2, v3);
+   v0 ^= m;
+
+   v2 ^= 0xff;
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+   SIPROUND(v0, v1, v2, v3);
+
+   return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ Allocates the arena and picks the key of 
+ the hash of the names. Must be called before
+ internScope(). 
+ Returns 1 if successful, 0 otherwise
+*/
+int initScopes(void)
+{
+   arena = hugeAlloc(SCOPE_ARENA, -1, &arenahuge);
+   if(arena == NULL)
+   {
+      fprintf(stderr, "Unable to allocate the scope arena\n");
+      return 0;
+   }
+
+   randomSeeds(scopeseeds, 2);
+   arenaused = 0;
+   nscopes = 0;
+   memset(scopeindex, 0, sizeof(scopeindex));
+   return 1;
+}
+
+
+/* 
+ Returns the scope of the name of len bytes 
+ with hash h, 0 if it has not been interned
+*/
+static unsigned int findScope(const char *name, size_t len, unsigned int h)
+{
+   const char *s;
+   unsigned int i, id;
+
+   for(i=h&(SCOPE_SLOTS - 1);
+       (id = __atomic_load_n(&scopeindex[i], __ATOMIC_ACQUIRE)) != 0;
+       i=(i + 1) & (SCOPE_SLOTS - 1))
+   {
+      if(scopehashes[i] != h)
+         continue;
+      s = arena + offsets[id];
+      if((unsigned char) s[0] == len && memcmp(s + 1, name, len) == 0)
+         return id;
+   }
+
+   return 0;
+}
+
+
+/* 
+ Copies the name of len bytes with hash h 
+ into the arena and gives it the next scope. 
+ scopelock must be held. 
+ Returns the scope, SCOPE_OVERFLOW if the 
+ arena or the scopes are used up
+*/
+static unsigned int addScope(const char *name, size_t len, unsigned int h)
+{
+   static int warned;
+   unsigned int i, id;
+
+   if(nscopes == SCOPE_MAX || arenaused + len + 2 > SCOPE_ARENA)
+   {
+      if(!warned)
+         fprintf(stderr, "No room for more scopes, new scopes share one bucket\n");
+      warned = 1;
+      return SCOPE_OVERFLOW;
+   }
+
+   id = ++nscopes;
+   offsets[id] = (unsigned int) arenaused;
+   arena[arenaused] = (char) len;
+   memcpy(arena + arenaused + 1, name, len);
+   arena[arenaused + 1 + len] = '\0';
+   arenaused += len + 2;
+
+   for(i=h&(SCOPE_SLOTS - 1);scopeindex[i]!=0;i=(i + 1) & (SCOPE_SLOTS - 1))
+      ;
+   scopehashes[i] = h;
+   __atomic_store_n(&scopeindex[i], id, __ATOMIC_RELEASE);
+
+   return id;
+}
+
+
+/* 
+ Interns the scope name, at most SCOPE_LEN - 1 
+ printable characters. 
+ Returns the number of the scope, from 1, 
+ SCOPE_OVERFLOW if there is no room for a new
+ scope and 0 if the name is invalid
+*/
+unsigned int internScope(const char *name)
+{
+   size_t i, len;
+   unsigned int h, id;
+
+   len = strlen(name);
+   if(arena == NULL || len == 0 || len >= SCOPE_LEN)
+      return 0;
+   for(i=0;i<len;i++)
+   {
+      if(!isgraph((unsigned char) name[i]))
+         return 0;
+   }
+
+   h = (unsigned int) scopeHash(name, len);
+   id = findScope(name, len, h);
+   if(id != 0)
+      return id;
+
+   pthread_mutex_lock(&scopelock);
+   id = findScope(name, len, h); //may have been added by another worker
+   if(id == 0)
+      id = addScope(name, len, h);
+   pthread_mutex_unlock(&scopelock);
+
+   return id;
+}
+
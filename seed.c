@@ -0,0 +1,102 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Random seeds for the keyed hash functions of
+ the hash table and the count-min sketch. 
+ They are read from /dev/urandom so that the
+ slots an ip maps to cannot be predicted from
+ outside the process. A replay of a trace can
+ fix them so that its runs place the buckets, 
+ and so evict them, the same way. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <fcntl.h>
+
+
+/* state of the fixed seeds, used if fixed is set */
+static int fixed;
+static unsigned long long fixedstate;
+
+
+/* 
+ Makes randomSeeds() return a fixed sequence
+ from seed instead of random values
+*/
+void fixSeeds(unsigned long long seed)
+{
+   fixed = 1;
+   fixedstate = seed;
+}
+
+
+/*
+ Fills seeds with n random values. 
+ Falls back to rand() seeded with the time
+ and pid if /dev/urandom cannot be read. 
+*/
+void randomSeeds(unsigned long long *seeds, size_t n)
+{
+   static int warned;
+   size_t i;
+   ssize_t r=0;
+   unsigned long long z;
+   int fd;
+
+   if(fixed)
+   {//splitmix64
+      for(i=0;i<n;i++)
+      {
+         z = (fixedstate += 0x9E3779B97F4A7C15ULL);
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+         seeds[i] = z ^ (z >> 31);
+      }
+      return;
+   }
+
+   fd = open("/dev/urandom", O_RDONLY);
+   if(fd != -1)
+   {
+      r = read(fd, seeds, n * sizeof(*seeds));
+      close(fd);
+   }
+
+   if(r == (ssize_t)(n * sizeof(*seeds)))
+      return;
+
+   if(!warned)
+   {
+      fprintf(stderr, "Unable to read random seeds, using time\n");
+      srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+      warned = 1;
+   }
+
+   for(i=0;i<n;i++)
+      seeds[i] = ((unsigned long long)rand() << 32) ^ (unsigned long long)rand();
+}
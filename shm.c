@@ -0,0 +1,269 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Shared memory segment of the ipv4 hash table
+
+ The server creates the segment named with -s, 
+ e.g. /tbserver, and the hash table allocates 
+ its two tables, and with LAYOUT=SOA their
+ states and classes, from it with shmAlloc(). 
+ Each allocation grows the segment and is 
+ mapped on its own, its offset goes into the
+ header for the clients, which map the whole
+ segment at once. 
+
+ The header is complete once publishShm() sets
+ its magic, after the rate classes are loaded.
+ A client that finds no magic must retry later.
+ The segment is created with mode 0660 so that
+ client processes of the same group can attach,
+ they write the bucket states and their read
+ section slots. 
+
+ The tables are in normal pages, not in the 
+ huge pages of hugeAlloc(). 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+/* allocations from the segment, at most one per table array */
+#define SHM_REGIONS 8
+
+struct shm_region
+{
+ void *p;
+ size_t offset;
+ size_t size;
+};
+
+static struct shm_header *header;
+static int shmfd = -1;
+static size_t shmsize;
+static struct shm_region regions[SHM_REGIONS];
+
+
+/* Rounds size up to a multiple of the page size */
+static size_t pageRound(size_t size)
+{
+   size_t page = (size_t) sysconf(_SC_PAGESIZE);
+   return (size + page - 1) / page * page;
+}
+
+
+/*
+ Creates the shared memory segment name with its
+ header, replacing a segment of that name left 
+ by an earlier server. Must be called before the
+ hash table is initialized and before any read
+ section. 
+ Returns 1 if successful, 0 otherwise
+*/
+int initShm(const char *name)
+{
+   void *p;
+
+   shm_unlink(name);
+   shmfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+   if(shmfd == -1)
+   {
+      perror("Shared memory error");
+      return 0;
+   }
+
+   shmsize = pageRound(sizeof(struct shm_header));
+   if(ftruncate(shmfd, (off_t) shmsize) == -1 ||
+      (p = mmap(NULL, shmsize, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0)) == MAP_FAILED)
+   {
+      perror("Shared memory error");
+      close(shmfd);
+      shmfd = -1;
+      shm_unlink(name);
+      return 0;
+   }
+
+   header = p;
+   header->version = SHM_VERSION;
+   header->algo = RATE_ALGO;
+   header->layout = TABLE_LAYOUT;
+   header->bucketsize = sizeof(struct ip4bucket);
+   ebr_share(&header->epoch, header->clients, SHM_CLIENTS);
+   return 1;
+}
+
+
+/*
+ Allocates size bytes of zeroed memory at the 
+ end of the shared memory segment. 
+ Returns NULL if there is no segment or on 
+ failure. 
+*/
+void *shmAlloc(size_t size)
+{
+   void *p;
+   int i;
+
+   if(header == NULL)
+      return NULL;
+
+   for(i=0;i<SHM_REGIONS && regions[i].p!=NULL;i++)
+      ;
+   if(i == SHM_REGIONS)
+      return NULL;
+
+   size = pageRound(size);
+   if(ftruncate(shmfd, (off_t)(shmsize + size)) == -1 ||
+      (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 
+                (off_t) shmsize)) == MAP_FAILED)
+   {
+      perror("Shared memory error");
+      return NULL;
+   }
+
+   regions[i].p = p;
+   regions[i].offset = shmsize;
+   regions[i].size = size;
+   shmsize += size;
+   return p;
+}
+
+
+/* 
+ Unmaps memory from shmAlloc(), the segment 
+ keeps its space. 
+ Returns 1 if p was in the segment, 0 otherwise
+*/
+int shmFree(void *p, size_t size)
+{
+   int i;
+
+   for(i=0;i<SHM_REGIONS;i++)
+   {
+      if(p != NULL && regions[i].p == p)
+      {
+         munmap(p, pageRound(size));
+         regions[i].p = NULL;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+
+/* Returns the offset of p in the segment, 0 if it is not in it */
+static size_t shmOffset(const void *p)
+{
+   int i;
+
+   for(i=0;i<SHM_REGIONS;i++)
+   {
+      if(p != NULL && regions[i].p == p)
+         return regions[i].offset;
+   }
+
+   return 0;
+}
+
+
+/*
+ Gives the clients the tables of slots buckets
+ and their states and classes, which are NULL
+ with LAYOUT=AOS, and the key of their hash. 
+ tables[0] is the current table. 
+*/
+void shareHashTable(struct ip4bucket **tables, rate_state_t **states, 
+                    unsigned char **classes, size_t slots, 
+                    const unsigned long long *seeds)
+{
+   int i;
+
+   if(header == NULL)
+      return;
+
+   header->slots = slots;
+   header->seeds[0] = seeds[0];
+   header->seeds[1] = seeds[1];
+   for(i=0;i<2;i++)
+   {
+      header->tables[i] = shmOffset(tables[i]);
+      header->states[i] = states == NULL ? 0 : shmOffset(states[i]);
+      header->classes[i] = classes == NULL ? 0 : shmOffset(classes[i]);
+   }
+   shareCurrentTable(0);
+}
+
+
+/* Tells the clients which of the two tables is current */
+void shareCurrentTable(int current)
+{
+   if(header != NULL)
+      __atomic_store_n(&header->current, current, __ATOMIC_RELEASE);
+}
+
+
+/* 
+ Tells the clients when the buckets were last 
+ refilled and gives them the credits of the
+ classes after the refill
+*/
+void shareRefill(unsigned long long t)
+{
+   int i;
+
+   if(header == NULL)
+      return;
+
+   for(i=0;i<RATE_CLASS_MAX;i++)
+      __atomic_store_n(&header->rates[i].credit, 
+                       __atomic_load_n(&rate_classes[i].credit, __ATOMIC_RELAXED), 
+                       __ATOMIC_RELAXED);
+   __atomic_store_n(&header->refilltime, t, __ATOMIC_RELAXED);
+}
+
+
+/*
+ Copies the rate classes into the header and 
+ opens the segment to clients. flags tell the
+ clients whether they decide requests to the 
+ buckets they find themselves, port is the udp
+ port of the server. 
+*/
+void publishShm(int flags, int port)
+{
+   if(header == NULL)
+      return;
+
+   memcpy(header->rates, rate_classes, sizeof(header->rates));
+   header->flags = flags;
+   header->port = port;
+   __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,109 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the shared memory mode
+
+ Needs a server started with -s, e.g. 
+ tbserver -s /tbserver. Adds the buckets of 256
+ addresses through the server, then measures 
+ requests to them decided in the shared table 
+ and requests for an ipv6 address, which always
+ make the udp round trip to the server. 
+
+ Usage: shmbench [name] [requests]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include "tbshm.h"
+
+
+#define DEFAULT_REQUESTS 1000000UL
+#define BENCH_IPS 256
+
+
+int main(int argc, char* argv[])
+{
+   const char *name = "/tbserver";
+   char ips[BENCH_IPS][IP4_CHAR_LEN];
+   size_t requests = DEFAULT_REQUESTS, udp, i;
+   unsigned long local, remote, allowed=0;
+   unsigned long long start;
+   struct tbshm_reply r;
+   struct tbshm *h;
+   double tshm, tudp;
+
+   if(argc > 1)
+      name = argv[1];
+   if(argc > 2)
+      requests = strtoul(argv[2], NULL, 10);
+
+   if(requests == 0)
+   {
+       fprintf(stderr,"Usage: %s [name] [requests]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   h = tbshm_open(name);
+   if(h == NULL)
+      exit(EXIT_FAILURE);
+
+   for(i=0;i<BENCH_IPS;i++)
+   {
+      snprintf(ips[i], sizeof(ips[i]), "198.18.%zu.%zu", i / 16, i % 16 + 1);
+      if(tbshm_consume(h, ips[i], 0, &r) < 0)
+      {
+         fprintf(stderr, "No answer from the server\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   start = monotonicNow();
+   for(i=0;i<requests;i++)
+      allowed += tbshm_consume(h, ips[i % BENCH_IPS], 0, &r) > 0;
+   tshm = (double)(monotonicNow() - start) / requests;
+
+   tbshm_stats(h, &local, &remote);
+   printf("shared table: %10.2f ns/request, %lu of %zu decided in the table, %lu allowed\n",
+          tshm, local, requests, allowed);
+
+   udp = requests / 100 < 1000 ? 1000 : requests / 100;
+   start = monotonicNow();
+   for(i=0;i<udp;i++)
+   {
+      if(tbshm_consume(h, "2001:db8::1", 0, &r) < 0)
+      {
+         fprintf(stderr, "No answer from the server\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   tudp = (double)(monotonicNow() - start) / udp;
+   printf("udp:          %10.2f ns/request\n", tudp);
+
+   tbshm_close(h);
+   return 0;
+}
@@ -0,0 +1,192 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ A decaying count-min sketch used as an approximate
+ rate limiter. Each ip is mapped to one counter in
+ every row and its used tokens are estimated by the
+ minimum of these counters.
+
+ Counters are only raised as far as needed
+ (conservative update) and the decay subtracts the
+ refill rate from every counter, which mirrors the
+ token refill of an exact bucket. Neither step can
+ make the estimate of an ip lower than its true
+ value, so the sketch never allows more than the
+ exact limiter would.
+
+ A mutex serializes consume and decay. The decay
+ holds it for the whole pass, otherwise a consume
+ between two rows could leave a row below the
+ true value.
+
+ The counters are allocated with hugeAlloc() by 
+ the thread calling initSketch().
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+static unsigned char (*sketch)[SKETCH_WIDTH];
+static unsigned long long seed_a[SKETCH_DEPTH];
+static unsigned long long seed_b[SKETCH_DEPTH];
+
+static pthread_mutex_t sketchlock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ Row hash, multiply-add-shift with random
+ seeds which is universal for 32 bit keys
+*/
+static size_t sketchHash(unsigned int k, size_t row)
+{
+   return (size_t) ((seed_a[row] * k + seed_b[row]) >> (64 - SKETCH_BITS));
+}
+
+
+/*
+ Initializes the sketch counters and
+ picks random seeds for the row hashes. 
+ Returns 1 if successful, 0 otherwise
+*/
+int initSketch(void)
+{
+   size_t i;
+
+   if(sketch == NULL)
+   {
+      sketch = hugeAlloc((size_t)SKETCH_DEPTH * SKETCH_WIDTH, -1, NULL);
+      if(sketch == NULL)
+      {
+         fprintf(stderr, "Unable to allocate count-min sketch\n");
+         return 0;
+      }
+   }
+   else
+      memset(sketch, 0, (size_t)SKETCH_DEPTH * SKETCH_WIDTH);
+
+   randomSeeds(seed_a, SKETCH_DEPTH);
+   randomSeeds(seed_b, SKETCH_DEPTH);
+   for(i=0;i<SKETCH_DEPTH;i++)
+      seed_a[i] |= 1;
+
+   return 1;
+}
+
+
+/* Minimum of the counters of k, lock must be held */
+static int sketchMin(unsigned int k, size_t *index)
+{
+   size_t i;
+   int c, min = SKETCH_MAX;
+
+   for(i=0;i<SKETCH_DEPTH;i++)
+   {
+      index[i] = sketchHash(k, i);
+      c = sketch[i][index[i]];
+      if(c < min)
+         min = c;
+   }
+
+   return min;
+}
+
+
+/*
+ Consumes cost tokens for the ip key k with
+ a limit of burst tokens, at most SKETCH_MAX.
+ Returns the tokens used by k including this
+ request if it is within the rate limit,
+ 0 if the rate limit is exceeded.
+*/
+int sketch_consume(unsigned int k, int cost, int burst)
+{
+   size_t i, index[SKETCH_DEPTH];
+   int used;
+
+   if(burst > SKETCH_MAX)
+      burst = SKETCH_MAX;
+
+   pthread_mutex_lock(&sketchlock);
+   used = sketchMin(k, index);
+   if(used + cost > burst)
+   {
+      pthread_mutex_unlock(&sketchlock);
+      return 0;
+   }
+
+   used += cost;
+   for(i=0;i<SKETCH_DEPTH;i++)
+   {//conservative update
+      if(sketch[i][index[i]] < used)
+         sketch[i][index[i]] = (unsigned char) used;
+   }
+   pthread_mutex_unlock(&sketchlock);
+
+   return used;
+}
+
+
+/*
+ Returns the estimated tokens used
+ by the ip key k
+*/
+int sketch_estimate(unsigned int k)
+{
+   size_t index[SKETCH_DEPTH];
+   int used;
+
+   pthread_mutex_lock(&sketchlock);
+   used = sketchMin(k, index);
+   pthread_mutex_unlock(&sketchlock);
+
+   return used;
+}
+
+
+/*
+ Decays the sketch by subtracting the refill
+ rate from every counter. Called by the update
+ thread every SLEEP_INTERVAL.
+*/
+void sketch_decay(int rate)
+{
+   size_t i, j;
+   unsigned char r;
+
+   if(rate <= 0)
+      return;
+   r = rate > SKETCH_MAX ? SKETCH_MAX : (unsigned char) rate;
+
+   pthread_mutex_lock(&sketchlock);
+   for(i=0;i<SKETCH_DEPTH;i++)
+   {
+      for(j=0;j<SKETCH_WIDTH;j++)
+         sketch[i][j] = sketch[i][j] > r ? sketch[i][j] - r : 0;
+   }
+   pthread_mutex_unlock(&sketchlock);
+}
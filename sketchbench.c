@@ -0,0 +1,191 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark and error bound check for the
+ count-min sketch limiter in sketch.c
+
+ Simulates an ip spray where most ips send a
+ single request and a few send many. It measures
+ the cost of sketch_consume() and compares each
+ estimate with the exact number of tokens used:
+
+ - an estimate below the true value is an error
+ - the fraction of ips whose estimate exceeds the
+   true value by more than e/SKETCH_WIDTH * N must
+   be at most exp(-SKETCH_DEPTH)
+
+ The check is repeated after decaying the sketch,
+ with N still counting the tokens recorded before
+ the decay.
+ Exits with failure if a bound does not hold.
+
+ Usage: sketchbench [distinct ips]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <math.h>
+
+
+#define DEFAULT_IPS 2000000
+#define HEAVY_EVERY 1000
+#define DECAY_RATE 2
+
+
+/* xorshift pseudo random generator */
+static unsigned int nextRandom(unsigned int *s)
+{
+   unsigned int x = *s;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *s = x;
+   return x;
+}
+
+
+/*
+ Distinct non zero ip keys, multiplying by
+ an odd number is a bijection modulo 2^32
+*/
+static unsigned int ipKey(size_t i)
+{
+   return (unsigned int)((i + 1) * 2654435761U);
+}
+
+
+/*
+ Compares the sketch estimates with the
+ true used tokens. Returns 1 if the bounds
+ hold, 0 otherwise.
+*/
+static int checkBounds(const char *label, unsigned char *used,
+                       size_t nips, unsigned long long total)
+{
+   size_t i, over=0, under=0;
+   int est, err, maxerr=0;
+   double eps, delta, bound, frac;
+
+   eps = exp(1.0) / SKETCH_WIDTH;
+   delta = exp(-(double)SKETCH_DEPTH);
+   bound = eps * (double)total;
+
+   for(i=0;i<nips;i++)
+   {
+      est = sketch_estimate(ipKey(i));
+      err = est - used[i];
+      if(err < 0)
+         under++;
+      if(err > maxerr)
+         maxerr = err;
+      if((double)err > bound)
+         over++;
+   }
+
+   frac = (double)over / (double)nips;
+   printf("%s: N %llu bound %.2f tokens, over bound %.5f (delta %.5f), "
+          "max error %d, undercounts %zu\n",
+          label, total, bound, frac, delta, maxerr, under);
+
+   return under == 0 && frac <= delta;
+}
+
+
+int main(int argc, char* argv[])
+{
+   size_t nips = DEFAULT_IPS, i, j, reqs;
+   unsigned int seed = 2017;
+   unsigned char *used;
+   unsigned long long total=0, denied=0, ops=0, start;
+   int ok=1;
+   double t;
+
+   if(argc > 1)
+      nips = strtoul(argv[1], NULL, 10);
+
+   if(nips == 0)
+   {
+       fprintf(stderr,"Usage: %s [distinct ips]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   used = calloc(nips, 1);
+   if(used == NULL)
+   {
+       fprintf(stderr,"Unable to allocate memory\n");
+       exit(EXIT_FAILURE);
+   }
+
+   if(!initSketch())
+      exit(EXIT_FAILURE);
+   printf("Distinct ips: %zu Sketch memory: %zu bytes (%d x %u)\n",
+          nips, (size_t)SKETCH_DEPTH * SKETCH_WIDTH, SKETCH_DEPTH, SKETCH_WIDTH);
+
+   start = monotonicNow();
+   for(i=0;i<nips;i++)
+   {
+      reqs = 1;
+      if(i % HEAVY_EVERY == 0)
+         reqs = 1 + nextRandom(&seed) % (MAX_TOKENS * 2);
+
+      for(j=0;j<reqs;j++)
+      {
+         ops++;
+         if(sketch_consume(ipKey(i), 1, MAX_TOKENS) > 0)
+         {
+            used[i]++;
+            total++;
+         }
+         else if(used[i] < MAX_TOKENS)
+            denied++;
+      }
+   }
+   t = (double)(monotonicNow() - start);
+
+   printf("sketch_consume: %.2f ns/op, wrongly denied %llu of %llu\n",
+          t / ops, denied, ops);
+
+   ok &= checkBounds("fresh", used, nips, total);
+
+   /* N stays the tokens recorded since the sketch was zero */
+   sketch_decay(DECAY_RATE);
+   for(i=0;i<nips;i++)
+      used[i] = used[i] > DECAY_RATE ? used[i] - DECAY_RATE : 0;
+
+   ok &= checkBounds("decayed", used, nips, total);
+
+   free(used);
+
+   if(!ok)
+   {
+      printf("Error bound check FAILED\n");
+      return EXIT_FAILURE;
+   }
+
+   printf("Error bound check passed\n");
+   return 0;
+}
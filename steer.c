@@ -0,0 +1,170 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Steering of the ipv4 requests to the workers
+
+ With -w the server binds one ipv4 socket per 
+ worker to the same port with SO_REUSEPORT. The
+ kernel would pick the socket of a datagram by 
+ a hash of its addresses and ports, so requests
+ for one queried ip could reach every worker. 
+ Instead a classic BPF program attached to the 
+ group parses the ipv4 address at the start of 
+ the message and returns key % workers, the 
+ index of the socket that gets the datagram, 
+ so the requests for one ip stay on one worker
+ and its bucket stays in the cache of one cpu.
+
+ cBPF has no loops, so the parse is unrolled 
+ over the IP4_CHAR_LEN - 1 characters an address
+ can have. It stops at the end of the datagram 
+ or at the first character that is neither a 
+ digit nor a dot, such as the NUL or the space 
+ before a class selector. M[0] holds the octets
+ parsed so far and M[1] the current octet. 
+ Messages that are not ipv4 addresses are still
+ steered by their first characters, the same 
+ message always to the same worker. 
+
+ Steering is a placement, it gives a worker no
+ ownership of its keys. Worker 0 also serves 
+ the unix socket and the ipv6 socket, whose 
+ queries can name any ipv4 address, and shm 
+ clients update the buckets in place. The hash
+ table, the sketch, the global budget and the 
+ prefix buckets are shared by every worker and
+ updated with atomics or under their locks. 
+ Where steering is not available the kernel 
+ hash is used and the workers share the keys.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+
+/* instructions for one character and for the start and the end */
+#define STEER_CHAR_LEN 22
+#define STEER_LEN (3 + (IP4_CHAR_LEN - 1) * STEER_CHAR_LEN + 7)
+
+#define STMT(c, k) ((struct sock_filter) BPF_STMT((c), (k)))
+#define JUMP(c, k, jt, jf) ((struct sock_filter) BPF_JUMP((c), (k), (jt), (jf)))
+
+
+/* 
+ Adds the instructions that parse character i
+ at code[n]. done is the index of the end of 
+ the program. Returns the index after them. 
+*/
+static int steerChar(struct sock_filter *code, int n, int i, int done)
+{
+   int next = n + STEER_CHAR_LEN, out = n + 13;
+
+   code[n++] = STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+   code[n++] = JUMP(BPF_JMP | BPF_JGT | BPF_K, (unsigned int) i, 0, 11); //to the exit
+   code[n++] = STMT(BPF_LD | BPF_B | BPF_ABS, (unsigned int) i);
+   code[n++] = JUMP(BPF_JMP | BPF_JEQ | BPF_K, '.', 10, 0);             //to the dot
+   code[n++] = JUMP(BPF_JMP | BPF_JGE | BPF_K, '0', 0, 8);
+   code[n++] = JUMP(BPF_JMP | BPF_JGT | BPF_K, '9', 7, 0);
+   //M[1] = M[1] * 10 + digit
+   code[n++] = STMT(BPF_ALU | BPF_SUB | BPF_K, '0');
+   code[n++] = STMT(BPF_MISC | BPF_TAX, 0);
+   code[n++] = STMT(BPF_LD | BPF_MEM, 1);
+   code[n++] = STMT(BPF_ALU | BPF_MUL | BPF_K, 10);
+   code[n++] = STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+   code[n++] = STMT(BPF_ST, 1);
+   code[n++] = STMT(BPF_JMP | BPF_JA, (unsigned int)(next - out));
+   //the exit, conditional jumps only reach 255 instructions
+   code[n++] = STMT(BPF_JMP | BPF_JA, (unsigned int)(done - out - 1));
+   //the dot, M[0] = M[0] << 8 | M[1], M[1] = 0
+   code[n++] = STMT(BPF_LD | BPF_MEM, 0);
+   code[n++] = STMT(BPF_ALU | BPF_LSH | BPF_K, 8);
+   code[n++] = STMT(BPF_MISC | BPF_TAX, 0);
+   code[n++] = STMT(BPF_LD | BPF_MEM, 1);
+   code[n++] = STMT(BPF_ALU | BPF_OR | BPF_X, 0);
+   code[n++] = STMT(BPF_ST, 0);
+   code[n++] = STMT(BPF_LD | BPF_IMM, 0);
+   code[n++] = STMT(BPF_ST, 1);
+
+   return n;
+}
+
+
+/*
+ Attaches the steering program for workers 
+ sockets to the reuseport group of socket, 
+ which must be bound. 
+ Returns 1 if successful, 0 otherwise
+*/
+int attachSteering(int socket, int workers)
+{
+   struct sock_filter code[STEER_LEN];
+   struct sock_fprog prog;
+   int i, n=0, done = STEER_LEN - 7;
+
+   code[n++] = STMT(BPF_LD | BPF_IMM, 0);
+   code[n++] = STMT(BPF_ST, 0);
+   code[n++] = STMT(BPF_ST, 1);
+
+   for(i=0;i<IP4_CHAR_LEN - 1;i++)
+      n = steerChar(code, n, i, done);
+
+   //return (M[0] << 8 | M[1]) % workers, the key of parseIP4()
+   code[n++] = STMT(BPF_LD | BPF_MEM, 0);
+   code[n++] = STMT(BPF_ALU | BPF_LSH | BPF_K, 8);
+   code[n++] = STMT(BPF_MISC | BPF_TAX, 0);
+   code[n++] = STMT(BPF_LD | BPF_MEM, 1);
+   code[n++] = STMT(BPF_ALU | BPF_OR | BPF_X, 0);
+   code[n++] = STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int) workers);
+   code[n++] = STMT(BPF_RET | BPF_A, 0);
+
+   prog.len = (unsigned short) n;
+   prog.filter = code;
+   if(setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0)
+   {
+      perror("Unable to attach the steering program");
+      return 0;
+   }
+
+   return 1;
+}
+
+#else
+
+int attachSteering(__attribute__((unused)) int socket, 
+                   __attribute__((unused)) int workers)
+{
+   fprintf(stderr, "Steering of requests is not supported\n");
+   return 0;
+}
+
+#endif
@@ -0,0 +1,443 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Stress test of the accuracy of the rate limit
+
+ Many threads send requests for a few ips as fast
+ as they can and every allowed request is counted.
+ The counts are checked against the admissions 
+ the rate algorithm allows, a key that gets more
+ is over-admitted and one that gets fewer is 
+ under-admitted, and either fails the test. 
+
+ By default the hash table is driven in process.
+ The threads take the tokens as the exact mode 
+ of processing() does, with consumeBucket() and 
+ put() if the bucket is missing, while a refill
+ thread does what update() does every -i ms 
+ instead of every SLEEP_INTERVAL. 
+ - Token bucket: each key gets its burst and 
+   refill tokens for each refill. The refills 
+   stop at the end and the threads run each key
+   dry, so the count must be exact, less the 
+   tokens a refill may have lost to a bucket 
+   that was close to full, which are counted 
+   where the refill thread sees them. 
+ - GCRA: each key gets its burst and refill 
+   tokens per SLEEP_INTERVAL of time since its
+   first request, up to one token either way for
+   the time of the last request. 
+
+ With -l the requests go to a server on the
+ loopback interface, which must use the limits 
+ given here (its defaults unless -b and -f are 
+ given). Its refills are not seen, so a token 
+ bucket key must get its burst and between one 
+ refill less and one refill more than the 
+ SLEEP_INTERVAL of the run allow, GCRA one token
+ either way. The keys are random /24 addresses,
+ so the buckets of earlier runs are not reused. 
+
+ Usage: stressbench [-l] [-t threads] [-k keys] [-d seconds] 
+                    [-i refill ms] [-b burst] [-f refill]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_KEYS 4
+#define DEFAULT_SECONDS 3
+#define DEFAULT_TICK_MS 2
+#define KEYS_MAX 64
+
+struct key_count
+{
+ unsigned int key;
+ unsigned long allowed;
+ unsigned long denied;
+ unsigned long long first;
+ unsigned long long last;
+};
+
+struct stress_thread
+{
+ int socket;
+ unsigned long long seed;
+};
+
+static struct key_count counts[KEYS_MAX];
+static int nkeys = DEFAULT_KEYS;
+static int loopback;
+
+/* set once the refills have stopped, then the threads run the keys dry */
+static volatile int stopped;
+static volatile int running = 1;
+
+static unsigned long long tickns = DEFAULT_TICK_MS * NSEC_PER_MSEC;
+static unsigned long refills;
+
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+/* tokens of each key that did not fit in its bucket at a refill */
+static unsigned long long lost[KEYS_MAX];
+#endif
+
+
+/* splitmix64 pseudo random generator */
+static unsigned long long nextRandom(unsigned long long *s)
+{
+   unsigned long long z = (*s += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+
+/* 
+ Takes a token for key k as the exact mode of 
+ processing() does. 
+ Returns 1 if allowed, 0 otherwise
+*/
+static int takeToken(unsigned int k)
+{
+   struct ip4bucket b;
+   unsigned long long now = rate_now();
+   rate_state_t seen;
+   int status;
+
+   status = consumeBucket(k, 1, now, &seen);
+   if(status < 0)
+   {
+      empty_ip4_bucket(&b);
+      b.ipv4 = k;
+      rate_init_used(&b.state, 1, &rate_classes[0], now);
+      status = putNew(k, b) != 0 ? 1 :
+               consumeBucket(k, 1, now, &seen); //added by another thread meanwhile
+   }
+
+   return status;
+}
+
+
+/* 
+ Asks the server on the connected socket for a 
+ token for key k. 
+ Returns 1 if allowed, 0 if denied, -1 on error
+*/
+static int askToken(int sock, unsigned int k)
+{
+   char msg[IP4_CHAR_LEN], buf[BUFSZ];
+   struct in_addr a;
+   ssize_t len;
+
+   a.s_addr = htonl(k);
+   inet_ntop(AF_INET, &a, msg, sizeof(msg));
+   if(send(sock, msg, strlen(msg) + 1, 0) == -1)
+      return -1;
+
+   len = recv(sock, buf, sizeof(buf) - 1, 0);
+   if(len <= 0)
+      return -1;
+   buf[len] = '\0';
+
+   return strncmp(buf, "OK ", 3) == 0;
+}
+
+
+/* Counts a request for key i that was allowed or not */
+static void countRequest(int i, int allowed)
+{
+   unsigned long long now = monotonicNow();
+
+   if(allowed)
+   {
+      __atomic_add_fetch(&counts[i].allowed, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&counts[i].last, now, __ATOMIC_RELAXED);
+   }
+   else
+      __atomic_add_fetch(&counts[i].denied, 1, __ATOMIC_RELAXED);
+}
+
+
+static void *requests(void *arg)
+{
+   struct stress_thread *t = arg;
+   int i, r, dry[KEYS_MAX];
+
+   while(running)
+   {
+      i = (int)(nextRandom(&t->seed) % (unsigned long long) nkeys);
+      r = loopback ? askToken(t->socket, counts[i].key) : takeToken(counts[i].key);
+      if(r < 0)
+      {
+         fprintf(stderr, "No answer for a request\n");
+         exit(EXIT_FAILURE);
+      }
+      countRequest(i, r);
+   }
+
+   if(loopback)
+      return NULL;
+
+   //no more refills, each key is asked until it is denied
+   for(i=0;i<nkeys;i++)
+      dry[i] = 0;
+   for(i=0;i<nkeys;i++)
+   {
+      while(!dry[i])
+      {
+         r = takeToken(counts[i].key);
+         countRequest(i, r);
+         dry[i] = !r;
+      }
+   }
+
+   return NULL;
+}
+
+
+/* 
+ Refill thread, does what update() does every
+ tick. Before a token bucket refill, the tokens
+ that cannot fit in a bucket are counted as lost. 
+*/
+static void *refilling(__attribute__((unused)) void *arg)
+{
+   struct timespec ts = { 0, (long) tickns };
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+   struct ip4bucket *b;
+   const struct rate_class *c = &rate_classes[0];
+   unsigned long long over;
+   rate_state_t state;
+   int i;
+#endif
+
+   while(!stopped)
+   {
+      nanosleep(&ts, NULL);
+
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+      ebr_enter();
+      for(i=0;i<nkeys;i++)
+      {
+         b = get(counts[i].key);
+         if(b == NULL)
+            continue;
+         state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+         over = (unsigned long long)(rate_tokens(&state, c, 0) + c->refill);
+         if(over > (unsigned long long) c->burst)
+            lost[i] += over - (unsigned long long) c->burst;
+      }
+      ebr_exit();
+#endif
+
+      refillClasses();
+      refillHashTable(rate_now());
+      reclaimHashItems();
+      purgeHashTable();
+      refills++;
+   }
+
+   return NULL;
+}
+
+
+/* 
+ Checks the count of key i against the admissions
+ of the rate algorithm over seconds of run. 
+ Returns 1 if they match, 0 otherwise
+*/
+static int checkKey(int i, double seconds)
+{
+   const struct rate_class *c = &rate_classes[0];
+   double ticks, low, high;
+
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+   if(loopback)
+   {//server refills every SLEEP_INTERVAL, at times not known here
+      ticks = seconds / SLEEP_INTERVAL;
+      low = c->burst + c->refill * (double)(long)(ticks - 1);
+      high = c->burst + c->refill * ((double)(long) ticks + 1);
+      if(low < c->burst)
+         low = c->burst;
+   }
+   else
+   {
+      (void) ticks;
+      high = c->burst + (double) c->refill * refills;
+      low = high - (double) lost[i];
+   }
+#else
+   //one token per interval since the first request, up to burst ahead
+   ticks = (double)(counts[i].last - counts[i].first) / (c->interval * NSEC_PER_USEC);
+   (void) seconds;
+   low = c->burst + (double)(long) ticks - 1;
+   high = c->burst + (double)(long) ticks + 1;
+#endif
+
+   printf("%-15s allowed %8lu denied %10lu expected %.0f - %.0f %s\n", 
+          inet_ntoa((struct in_addr){ htonl(counts[i].key) }), counts[i].allowed, 
+          counts[i].denied, low, high, 
+          counts[i].allowed > high ? "OVER-ADMITTED" : 
+          counts[i].allowed < low ? "UNDER-ADMITTED" : "ok");
+
+   return counts[i].allowed >= low && counts[i].allowed <= high;
+}
+
+
+/* Returns a socket connected to the server, exits on failure */
+static int connectServer(void)
+{
+   struct sockaddr_in in;
+   struct timeval tv = { 1, 0 };
+   int sock;
+
+   memset(&in, 0, sizeof(in));
+   in.sin_family = AF_INET;
+   in.sin_port = htons(3211);
+   in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   sock = socket(AF_INET, SOCK_DGRAM, 0);
+   if(sock == -1 || connect(sock, (struct sockaddr *) &in, sizeof(in)) == -1 ||
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+   {
+      perror("Socket error");
+      exit(EXIT_FAILURE);
+   }
+   return sock;
+}
+
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "Usage: %s [-l] [-t threads] [-k keys] [-d seconds]\n"
+                   "          [-i refill ms] [-b burst] [-f refill]\n", prog);
+   exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char* argv[])
+{
+   pthread_t tids[WORKERS_MAX * 4], rtid;
+   struct stress_thread threads[WORKERS_MAX * 4];
+   struct timespec ts;
+   unsigned long long seed, start, base;
+   int nthreads = DEFAULT_THREADS, seconds = DEFAULT_SECONDS, tick = DEFAULT_TICK_MS;
+   int burst = rate_classes[0].burst, refill = rate_classes[0].refill;
+   int opt, i, ok=1;
+
+   while((opt = getopt(argc, argv, "lt:k:d:i:b:f:")) != -1)
+   {
+      switch(opt)
+      {
+         case 'l': loopback = 1; break;
+         case 't': nthreads = atoi(optarg); break;
+         case 'k': nkeys = atoi(optarg); break;
+         case 'd': seconds = atoi(optarg); break;
+         case 'i': tick = atoi(optarg); break;
+         case 'b': burst = atoi(optarg); break;
+         case 'f': refill = atoi(optarg); break;
+         default: usage(argv[0]);
+      }
+   }
+
+   if(optind != argc || nthreads < 1 || nthreads > WORKERS_MAX * 4 || nkeys < 1 ||
+      nkeys > KEYS_MAX || seconds < 1 || tick < 1 || tick >= 1000 || burst < 1 || 
+      burst > RATE_BURST_MAX || refill < 1)
+      usage(argv[0]);
+
+   rate_class_init(&rate_classes[0], burst, refill, 1);
+   if(!rate_class_fits(&rate_classes[0]))
+      usage(argv[0]);
+   tickns = (unsigned long long) tick * NSEC_PER_MSEC;
+
+   //random /24 of 10.0.0.0/8 for the keys
+   start = monotonicNow();
+   seed = start ^ (unsigned long long) getpid();
+   base = 0x0A000000U | ((unsigned int) nextRandom(&seed) & 0x00FFFF00U);
+   for(i=0;i<nkeys;i++)
+   {
+      memset(&counts[i], 0, sizeof(counts[i]));
+      counts[i].key = (unsigned int) base + (unsigned int) i + 1;
+   }
+
+   if(!loopback && !initHashTable(HASHSZ))
+      exit(EXIT_FAILURE);
+
+   printf("%s, %d threads on %d keys for %d s, burst %d refill %d%s\n", 
+          RATE_ALGO_NAME, nthreads, nkeys, seconds, burst, refill,
+          loopback ? " over loopback" : "");
+
+   //each bucket starts before the refills, with one request
+   threads[0].socket = loopback ? connectServer() : -1;
+   for(i=0;i<nkeys;i++)
+   {
+      counts[i].first = monotonicNow();
+      countRequest(i, loopback ? askToken(threads[0].socket, counts[i].key) == 1 : 
+                                 takeToken(counts[i].key));
+   }
+
+   if(!loopback && pthread_create(&rtid, NULL, refilling, NULL) != 0)
+   {
+      fprintf(stderr, "Cannot create refill thread\n");
+      exit(EXIT_FAILURE);
+   }
+
+   start = monotonicNow();
+   for(i=0;i<nthreads;i++)
+   {
+      threads[i].socket = loopback ? (i == 0 ? threads[0].socket : connectServer()) : -1;
+      threads[i].seed = 2017 + (unsigned long long) i;
+      if(pthread_create(&tids[i], NULL, requests, &threads[i]) != 0)
+      {
+         fprintf(stderr, "Cannot create request thread\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   ts.tv_sec = seconds;
+   ts.tv_nsec = 0;
+   nanosleep(&ts, NULL);
+
+   if(!loopback)
+   {//the refills stop first, then the threads run the keys dry
+      stopped = 1;
+      pthread_join(rtid, NULL);
+   }
+   running = 0;
+   for(i=0;i<nthreads;i++)
+      pthread_join(tids[i], NULL);
+
+   if(!loopback)
+      printf("%lu refills\n", refills);
+   for(i=0;i<nkeys;i++)
+      ok &= checkKey(i, (double)(monotonicNow() - start) / NSEC_PER_SEC);
+
+   printf("%s\n", ok ? "all keys within the limit" : "ADMISSION ERRORS");
+   return ok ? 0 : EXIT_FAILURE;
+}
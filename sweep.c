@@ -0,0 +1,195 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Refill sweep over a dense array of bucket states,
+ used by the hash table when it is built with
+ LAYOUT=SOA.
+
+ The sweep only reads the states, it sets a bit
+ in the mask for each bucket that is full and 
+ can be removed. For the token bucket the refill
+ has already been added to the credit of each
+ class by refillClasses(), a bucket is full once
+ its count plus the credit of its class is over
+ the burst of the class. The credit and the burst
+ are gathered from the class table by the class
+ byte of each bucket, a byte out of range counts
+ as the default class. For GCRA the classes are not
+ needed, a bucket is full once its arrival time
+ is in the past whatever its class, which is a 
+ signed compare of its distance to now. Both 
+ states are 32 bits, an AVX2 register holds 8 of
+ them.
+
+ As nothing is written, the requests that take
+ tokens from the counts while the sweep runs, on
+ any worker or shm client, cannot be undone by it.
+
+ The sweep uses AVX2 when the cpu has it, otherwise
+ a scalar loop. GCRA is branch free there and the
+ compiler can vectorize it with the SSE2 
+ instructions every x86-64 cpu has.
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWEEP_X86 1
+#endif
+
+
+/* Sweeps n states from index start, returns the full buckets */
+static size_t sweepScalar(rate_state_t *s, const unsigned char *cls, 
+                          size_t start, size_t n, unsigned long long now, 
+                          unsigned long long *mask)
+{
+   size_t i, j, m, full=0;
+   unsigned long long bits;
+
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+   int f;
+   (void) now;
+#else
+   int f;
+   unsigned int t = (unsigned int) now;
+   (void) cls;
+#endif
+
+   for(i=start;i<n;i+=64)
+   {
+      m = n - i < 64 ? n - i : 64;
+      bits = 0;
+      for(j=0;j<m;j++)
+      {
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+         f = tb_refill(&s[i + j], &rate_classes[classIndex(cls[i + j])]);
+#else
+         f = (int)(s[i + j] - t) <= 0;
+#endif
+         bits |= (unsigned long long)f << j;
+      }
+      mask[i / 64] = bits;
+      full += (size_t) __builtin_popcountll(bits);
+   }
+
+   return full;
+}
+
+
+#ifdef SWEEP_X86
+
+/* Sweeps the whole 64 bucket blocks with AVX2, returns the full buckets */
+__attribute__((target("avx2")))
+static size_t sweepAvx2(rate_state_t *s, const unsigned char *cls, size_t n,
+                        unsigned long long now, unsigned long long *mask)
+{
+   size_t i, j, full=0;
+   unsigned long long bits;
+   __m256i v, f;
+
+#if RATE_ALGO == RATE_ALGO_TOKEN_BUCKET
+   const __m256i stride = _mm256_set1_epi32(sizeof(struct rate_class) / sizeof(int));
+   const __m256i count = _mm256_set1_epi32(rate_class_count);
+   __m256i c, credit, max;
+   (void) now;
+
+   for(i=0;i+64<=n;i+=64)
+   {
+      bits = 0;
+      for(j=0;j<64;j+=8)
+      {
+         c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&cls[i + j]));
+         c = _mm256_and_si256(c, _mm256_cmpgt_epi32(count, c)); //undefined classes to 0
+         c = _mm256_mullo_epi32(c, stride);
+         credit = _mm256_i32gather_epi32((const int *)&rate_classes[0].credit, c, 4);
+         max = _mm256_i32gather_epi32(&rate_classes[0].burst, c, 4);
+         v = _mm256_loadu_si256((const __m256i *)&s[i + j]);
+         v = _mm256_add_epi32(v, credit);
+         f = _mm256_cmpgt_epi32(v, max);
+         bits |= (unsigned long long)(unsigned int)
+                 _mm256_movemask_ps(_mm256_castsi256_ps(f)) << j;
+      }
+      mask[i / 64] = bits;
+      full += (size_t) __builtin_popcountll(bits);
+   }
+#else
+   const __m256i t = _mm256_set1_epi32((int)(unsigned int) now);
+   const __m256i zero = _mm256_setzero_si256();
+   (void) cls;
+
+   for(i=0;i+64<=n;i+=64)
+   {
+      bits = 0;
+      for(j=0;j<64;j+=8)
+      {
+         v = _mm256_loadu_si256((const __m256i *)&s[i + j]);
+         v = _mm256_sub_epi32(v, t);
+         f = _mm256_cmpgt_epi32(v, zero); //tat ahead of now, not full
+         bits |= (unsigned long long)(~(unsigned int)
+                 _mm256_movemask_ps(_mm256_castsi256_ps(f)) & 0xFF) << j;
+      }
+      mask[i / 64] = bits;
+      full += (size_t) __builtin_popcountll(bits);
+   }
+#endif
+
+   return full + sweepScalar(s, cls, i, n, now, mask);
+}
+
+#endif
+
+
+/* Returns the instruction set used by rate_sweep() */
+const char *sweepKind(void)
+{
+#ifdef SWEEP_X86
+   if(__builtin_cpu_supports("avx2"))
+      return "avx2";
+#endif
+   return "scalar";
+}
+
+
+/*
+ Checks the n bucket states in s, whose rate 
+ classes are in cls, at time now once their
+ classes are refilled and sets bit i % 64 of
+ mask[i / 64] if bucket i is full.
+ mask must hold (n + 63) / 64 words.
+ Returns the number of full buckets.
+*/
+size_t rate_sweep(rate_state_t *s, const unsigned char *cls, size_t n, 
+                  unsigned long long now, unsigned long long *mask)
+{
+#ifdef SWEEP_X86
+   if(__builtin_cpu_supports("avx2"))
+      return sweepAvx2(s, cls, n, now, mask);
+#endif
+   return sweepScalar(s, cls, 0, n, now, mask);
+}
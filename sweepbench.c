@@ -0,0 +1,142 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the refill sweep of the update
+ thread for the selected rate algorithm.
+
+ - rate_sweep() over a dense array of states, as
+   used by the hash table built with LAYOUT=SOA
+ - rate_refill_atomic() of each bucket in an
+   array of struct ip4bucket, as used by the
+   default layout
+ - one refillHashTable() over a table of the
+   same number of slots filled to capacity, in
+   the layout the benchmark is built with
+
+ Usage: sweepbench [buckets]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_BUCKETS (1024UL * 1024)
+#define SWEEPS 100
+
+
+/* Distinct non zero keys, bijection modulo 2^32 */
+static unsigned int benchKey(size_t i)
+{
+   return (unsigned int)((i + 1) * 2654435761U);
+}
+
+
+int main(int argc, char* argv[])
+{
+   size_t nbuckets = DEFAULT_BUCKETS, i, j, full=0;
+   rate_state_t *dense;
+   unsigned char *classes;
+   struct ip4bucket *buckets, b;
+   struct ht_stats st;
+   unsigned long long *mask, start, now;
+   double t;
+
+   if(argc > 1)
+      nbuckets = strtoul(argv[1], NULL, 10);
+
+   if(nbuckets == 0)
+   {
+       fprintf(stderr,"Usage: %s [buckets]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   dense = hugeAlloc(nbuckets * sizeof(rate_state_t), -1, NULL);
+   buckets = hugeAlloc(nbuckets * sizeof(struct ip4bucket), -1, NULL);
+   mask = hugeAlloc((nbuckets + 63) / 64 * sizeof(unsigned long long), -1, NULL);
+   classes = hugeAlloc(nbuckets, -1, NULL); //zeroed, every bucket in the default class
+   if(dense == NULL || buckets == NULL || mask == NULL || classes == NULL)
+   {
+       fprintf(stderr,"Unable to allocate memory\n");
+       exit(EXIT_FAILURE);
+   }
+
+   printf("Rate algorithm: %s Buckets: %zu\n", RATE_ALGO_NAME, nbuckets);
+
+   now = rate_now();
+   for(i=0;i<nbuckets;i++)
+   {
+      rate_init(&dense[i], &rate_classes[0], now);
+      rate_init(&buckets[i].state, &rate_classes[0], now);
+   }
+
+   start = monotonicNow();
+   for(j=0;j<SWEEPS;j++)
+   {
+      refillClasses();
+      full += rate_sweep(dense, classes, nbuckets, now, mask);
+   }
+   t = (double)(monotonicNow() - start) / SWEEPS;
+   printf("dense sweep (%s):      %8.3f ms per sweep, %.3f ns/bucket\n",
+          sweepKind(), t / 1e6, t / nbuckets);
+
+   start = monotonicNow();
+   for(j=0;j<SWEEPS;j++)
+   {
+      refillClasses();
+      for(i=0;i<nbuckets;i++)
+         full += rate_refill_atomic(&buckets[i].state, &rate_classes[0], now);
+   }
+   t = (double)(monotonicNow() - start) / SWEEPS;
+   printf("per bucket refill:       %8.3f ms per sweep, %.3f ns/bucket\n",
+          t / 1e6, t / nbuckets);
+
+   if(!initHashTable(nbuckets))
+      exit(EXIT_FAILURE);
+
+   getHashStats(&st);
+   for(i=0;i<st.capacity;i++)
+   {
+      empty_ip4_bucket(&b);
+      rate_init(&b.state, &rate_classes[0], rate_now());
+      put(benchKey(i), b);
+   }
+
+   refillClasses();
+   start = monotonicNow();
+   full += refillHashTable(rate_now());
+   t = (double)(monotonicNow() - start);
+   printf("refillHashTable (%s): %8.3f ms for %zu slots\n",
+          TABLE_LAYOUT == TABLE_LAYOUT_SOA ? "SOA" : "AOS", t / 1e6, st.slots);
+
+   printf("(full buckets seen %zu)\n", full);
+
+   hugeFree(dense, nbuckets * sizeof(rate_state_t));
+   hugeFree(buckets, nbuckets * sizeof(struct ip4bucket));
+   hugeFree(mask, (nbuckets + 63) / 64 * sizeof(unsigned long long));
+
+   return 0;
+}
@@ -0,0 +1,440 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Client side of the shared memory mode, the 
+ tbshm library. See tbshm.h for its use. 
+
+ The handle maps the whole segment, checks that
+ its header was written by a server built with
+ the same rate algorithm and table layout, and 
+ takes a read section slot in the header for 
+ its process. The slot is what keeps the server
+ from giving a bucket the client is looking at
+ to another ip, as for the threads of the server
+ (ebr.c). A client holds it only while it looks
+ up and consumes a bucket. 
+
+ A lookup follows the probe sequence of the 
+ server, with the hash key of the header, in the 
+ current one of the two tables. The server 
+ refills the buckets and removes the full ones
+ as usual. When the refills stop, the server is
+ taken to be gone and requests go to its udp 
+ port, where a new server would answer them. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include "tbshm.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+
+/* seconds without a refill before the server is taken to be gone */
+#define TBSHM_STALE (SLEEP_INTERVAL * 3)
+
+/* milliseconds to wait for an answer from the server */
+#define TBSHM_TIMEOUT_MS 1000
+
+struct tbshm
+{
+ struct shm_header *hdr;
+ size_t size;
+ struct shm_client *slot;
+ int sock;
+ unsigned long local;
+ unsigned long remote;
+};
+
+
+/* Returns the table i of the segment */
+static struct ip4bucket *shmTable(const struct tbshm *h, int i)
+{
+   return (struct ip4bucket *)((char *) h->hdr + h->hdr->tables[i]);
+}
+
+
+/* Returns the state of the bucket in slot j of table i */
+static rate_state_t *shmState(const struct tbshm *h, int i, size_t j)
+{
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+   return (rate_state_t *)((char *) h->hdr + h->hdr->states[i]) + j;
+#else
+   return &shmTable(h, i)[j].state;
+#endif
+}
+
+
+/* 
+ Returns the rate class of the bucket in slot j of 
+ table i, the default class if the byte is out of
+ range. The classes the server did not define have
+ a burst of 0, so their requests go to the server. 
+*/
+static int shmClass(const struct tbshm *h, int i, size_t j)
+{
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+   int c = ((unsigned char *) h->hdr + h->hdr->classes[i])[j];
+#else
+   int c = shmTable(h, i)[j].cls;
+#endif
+   return c < RATE_CLASS_MAX ? c : 0;
+}
+
+
+/* 
+ Returns 1 if the arrays of the header lie in
+ the segment, 0 otherwise
+*/
+static int checkLayout(const struct tbshm *h)
+{
+   const struct shm_header *hdr = h->hdr;
+   size_t n = hdr->slots;
+   int i;
+
+   if(n == 0)
+      return 0;
+
+   for(i=0;i<2;i++)
+   {
+      if(hdr->tables[i] == 0 || hdr->tables[i] > h->size ||
+         (h->size - hdr->tables[i]) / sizeof(struct ip4bucket) < n)
+         return 0;
+#if TABLE_LAYOUT == TABLE_LAYOUT_SOA
+      if(hdr->states[i] == 0 || hdr->states[i] > h->size || 
+         (h->size - hdr->states[i]) / sizeof(rate_state_t) < n ||
+         hdr->classes[i] == 0 || hdr->classes[i] > h->size ||
+         h->size - hdr->classes[i] < n)
+         return 0;
+#endif
+   }
+
+   return 1;
+}
+
+
+/* 
+ Takes a free read section slot for the calling
+ process, or the slot of a process that is gone. 
+ Returns 1 if successful, 0 otherwise
+*/
+static int takeSlot(struct tbshm *h)
+{
+   struct shm_client *c;
+   int i, pid, self = (int) getpid();
+
+   for(i=0;i<SHM_CLIENTS;i++)
+   {
+      c = &h->hdr->clients[i];
+      pid = __atomic_load_n(&c->pid, __ATOMIC_ACQUIRE);
+      if(pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+         continue;
+      if(__atomic_compare_exchange_n(&c->pid, &pid, self, 0, 
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      {
+         __atomic_store_n(&c->epoch, 0, __ATOMIC_RELEASE);
+         h->slot = c;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+
+/* Opens the udp socket to the port of the server */
+static int openSocket(struct tbshm *h)
+{
+   struct sockaddr_in addr;
+   struct timeval tv;
+
+   h->sock = socket(AF_INET, SOCK_DGRAM, 0);
+   if(h->sock == -1)
+      return 0;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons((unsigned short) h->hdr->port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   tv.tv_sec = TBSHM_TIMEOUT_MS / 1000;
+   tv.tv_usec = (TBSHM_TIMEOUT_MS % 1000) * 1000;
+
+   return connect(h->sock, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+          setsockopt(h->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+
+/*
+ Attaches to the shared memory segment name of 
+ a running server. 
+ Returns the handle, NULL on failure
+*/
+struct tbshm *tbshm_open(const char *name)
+{
+   struct tbshm *h;
+   struct shm_header *hdr;
+   struct stat st;
+   void *p;
+   int fd;
+
+   fd = shm_open(name, O_RDWR, 0);
+   if(fd == -1 || fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr))
+   {
+      fprintf(stderr, "No shared memory segment %s\n", name);
+      if(fd != -1)
+         close(fd);
+      return NULL;
+   }
+
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   h = calloc(1, sizeof(*h));
+   if(p == MAP_FAILED || h == NULL)
+   {
+      fprintf(stderr, "Unable to map shared memory segment %s\n", name);
+      if(p != MAP_FAILED)
+         munmap(p, (size_t) st.st_size);
+      free(h);
+      return NULL;
+   }
+
+   hdr = h->hdr = p;
+   h->size = (size_t) st.st_size;
+   h->sock = -1;
+   if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC)
+      fprintf(stderr, "Shared memory segment %s is not ready\n", name);
+   else if(hdr->version != SHM_VERSION || hdr->algo != RATE_ALGO ||
+           hdr->layout != TABLE_LAYOUT || hdr->bucketsize != sizeof(struct ip4bucket) ||
+           !checkLayout(h))
+      fprintf(stderr, "Shared memory segment %s is from another build\n", name);
+   else if(!takeSlot(h))
+      fprintf(stderr, "More than %d clients of %s\n", SHM_CLIENTS, name);
+   else if(!openSocket(h))
+      perror("Socket error");
+   else
+      return h;
+
+   tbshm_close(h);
+   return NULL;
+}
+
+
+/* Enters a read section of the shared table */
+static void enterRead(struct tbshm *h)
+{
+   unsigned long e = __atomic_load_n(&h->hdr->epoch, __ATOMIC_ACQUIRE);
+
+   __atomic_store_n(&h->slot->epoch, e, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+/* Leaves a read section of the shared table */
+static void exitRead(struct tbshm *h)
+{
+   __atomic_store_n(&h->slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ Returns the slot of the bucket of k in table i,
+ -1 if there is none, as lookup() of the server
+ does. Must be called inside a read section. 
+*/
+static long findBucket(struct tbshm *h, int i, unsigned int k)
+{
+   struct ip4bucket *t = shmTable(h, i);
+   size_t n = h->hdr->slots, index, step, j;
+   unsigned int key;
+
+   index = ip4ProbeStart(ip4Hash(h->hdr->seeds, k), n, &step);
+   for(j=0;j<n;j++)
+   {
+      key = __atomic_load_n(&t[index].ipv4, __ATOMIC_ACQUIRE);
+      if(key == k)
+      {
+         if(!__atomic_load_n(&t[index].ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&t[index].ref, 1, __ATOMIC_RELAXED);
+         return (long) index;
+      }
+      if(key == HT_EMPTY)
+         break;
+      index += step;
+      if(index >= n)
+         index -= n;
+   }
+
+   return -1;
+}
+
+
+/*
+ Decides a request of cost tokens, 0 for the cost
+ of its class, from the bucket of ip in the 
+ shared table and fills r. 
+ Returns 1 if allowed, 0 if denied and -1 if 
+ the server has to decide it
+*/
+static int consumeLocal(struct tbshm *h, const char *ip, int cost, struct rate_reply *r)
+{
+   struct shm_header *hdr = h->hdr;
+   const struct rate_class *c = NULL;
+   unsigned long long clock, next, now;
+   struct in_addr addr;
+   rate_state_t seen;
+   unsigned int k;
+   int i, status=-1, n=0;
+   long j;
+
+   if(!(hdr->flags & SHM_LOCAL) || inet_pton(AF_INET, ip, &addr) != 1)
+      return -1;
+
+   k = ntohl(addr.s_addr);
+   if(k == HT_EMPTY || k == HT_DELETED)
+      return -1;
+
+   clock = monotonicNow();
+   next = __atomic_load_n(&hdr->refilltime, __ATOMIC_RELAXED) + SLEEP_INTERVAL * NSEC_PER_SEC;
+   if(clock > next + TBSHM_STALE * NSEC_PER_SEC)
+      return -1;
+   next = next > clock ? next - clock : 0;
+   now = rate_now();
+
+   enterRead(h);
+   i = __atomic_load_n(&hdr->current, __ATOMIC_ACQUIRE);
+   while((j = findBucket(h, i, k)) >= 0)
+   {
+      c = &hdr->rates[shmClass(h, i, (size_t) j)];
+      n = cost > 0 ? cost : c->cost;
+      if(n > c->burst)
+         break;
+      status = rate_consume_atomic(shmState(h, i, (size_t) j), n, c, now, &seen);
+      if(__atomic_load_n(&shmTable(h, i)[j].ipv4, __ATOMIC_ACQUIRE) == k)
+         break;
+      status = -1; //removed meanwhile, look again
+   }
+   exitRead(h);
+
+   if(status >= 0)
+      rate_reply_bucket(r, status, &seen, n, c, now, next);
+   return status;
+}
+
+
+/*
+ Sends a request of cost tokens for ip to the 
+ server and fills r with its answer. 
+ Returns 1 if allowed, 0 if denied and -1 on
+ failure
+*/
+static int consumeRemote(struct tbshm *h, const char *ip, int cost, struct tbshm_reply *r)
+{
+   char buf[BUFSZ], verb[8];
+   ssize_t len;
+   int n;
+
+   if(cost > 0)
+      n = snprintf(buf, sizeof(buf), "%s %d", ip, cost);
+   else
+      n = snprintf(buf, sizeof(buf), "%s", ip);
+   if(n < 0 || (size_t) n >= sizeof(buf))
+      return -1;
+
+   while(recv(h->sock, verb, sizeof(verb), MSG_DONTWAIT) > 0) //late answers
+      ;
+   if(send(h->sock, buf, (size_t) n + 1, 0) == -1)
+      return -1;
+
+   len = recv(h->sock, buf, sizeof(buf) - 1, 0);
+   if(len <= 0)
+      return -1;
+   buf[len] = '\0';
+
+   if(sscanf(buf, "%7s %d %llu", verb, &r->left, &r->wait_ms) != 3)
+      return -1;
+   r->shaped = strcmp(verb, "WAIT") == 0;
+   r->allowed = r->shaped || strcmp(verb, "OK") == 0;
+   return r->allowed;
+}
+
+
+/*
+ Takes cost tokens for ip, or the cost of its
+ rate class if cost is 0, and fills r with the 
+ answer of the server. 
+ Returns 1 if allowed, 0 if denied and -1 if 
+ the server did not answer
+*/
+int tbshm_consume(struct tbshm *h, const char *ip, int cost, struct tbshm_reply *r)
+{
+   struct rate_reply rr;
+   int status;
+
+   if(cost < 0)
+      return -1;
+
+   status = consumeLocal(h, ip, cost, &rr);
+   if(status < 0)
+   {
+      h->remote++;
+      return consumeRemote(h, ip, cost, r);
+   }
+
+   h->local++;
+   r->allowed = rr.allowed;
+   r->shaped = rr.shaped;
+   r->left = rr.left < 0 ? 0 : rr.left;
+   r->wait_ms = (rr.wait + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+   return status;
+}
+
+
+/* Sets the requests decided in the shared table and by the server */
+void tbshm_stats(const struct tbshm *h, unsigned long *local, unsigned long *remote)
+{
+   *local = h->local;
+   *remote = h->remote;
+}
+
+
+/* Gives back the slot of the handle and unmaps the segment */
+void tbshm_close(struct tbshm *h)
+{
+   if(h == NULL)
+      return;
+
+   if(h->slot != NULL)
+   {
+      __atomic_store_n(&h->slot->epoch, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&h->slot->pid, 0, __ATOMIC_RELEASE);
+   }
+   if(h->sock != -1)
+      close(h->sock);
+   munmap(h->hdr, h->size);
+   free(h);
+}
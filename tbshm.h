@@ -0,0 +1,83 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Client library of the shared memory mode of 
+ the token bucket server, for processes on the
+ same host as a server started with -s name. 
+
+   struct tbshm *h = tbshm_open("/tbserver");
+   struct tbshm_reply r;
+
+   if(tbshm_consume(h, "192.0.2.10", 0, &r) > 0)
+      ... allowed, after r.wait_ms if r.shaped ...
+
+ A request to an ipv4 bucket that is already in
+ the shared table takes its tokens directly in
+ the table, with the same atomic operations and
+ the same result as the server. Any other 
+ request, for a new ip, an ipv6 address, or when
+ the server also checks lists, prefixes, a 
+ global budget or a sketch, is sent to the udp
+ port of the server and waits for its answer. 
+
+ A handle must be used by one thread at a time.
+ Open it in the process that uses it, after any
+ fork. 
+
+ Link with -ltbshm, built by make as libtbshm.a
+ and libtbshm.so. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#ifndef TBSHM_H
+#define TBSHM_H
+
+struct tbshm;
+
+/* 
+ Answer to a request as the server gives it, 
+ allowed is 0 for NOK, shaped is 1 for WAIT
+*/
+struct tbshm_reply
+{
+ int allowed;
+ int shaped;
+ int left;
+ unsigned long long wait_ms;
+};
+
+/* 
+ Requests decided in the shared table do not
+ reach the server and are not counted in its
+ heavy hitter report
+*/
+struct tbshm *tbshm_open(const char *name);
+int tbshm_consume(struct tbshm *h, const char *ip, int cost, struct tbshm_reply *r);
+void tbshm_stats(const struct tbshm *h, unsigned long *local, unsigned long *remote);
+void tbshm_close(struct tbshm *h);
+
+#endif
@@ -0,0 +1,343 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Heavy hitters of the ipv4 requests
+
+ A Space-Saving summary of the tokens asked for 
+ by each key. At most TOPK_SLOTS keys are tracked.
+ A key that is not tracked replaces the one with
+ the fewest tokens and starts from its count, 
+ which it keeps as the error of its own. So the
+ count of a key is never below its true count and
+ every key that asked for more than a share of
+ 1 / TOPK_SLOTS of the tokens is tracked. 
+
+ The counters are a min heap on the tokens, so 
+ the key to replace is at the top, with a small
+ open addressing index from the keys to their 
+ heap positions. An update is a probe of the 
+ index and a sift of at most log2(TOPK_SLOTS)
+ levels, the memory is fixed. 
+
+ Each worker has its own summary and takes its 
+ lock once per batch of requests, the lock is 
+ only contended by the admin query and the decay. 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define INDEX_MASK (TOPK_INDEX - 1)
+
+
+/* Home index entry of key k */
+static unsigned int indexHash(unsigned int k)
+{
+   return ((k * 2654435761U) >> 16) & INDEX_MASK;
+}
+
+
+/* Sets the heap position i of an entry in the index */
+static void setPosition(struct topk *t, size_t i)
+{
+   t->index[t->heap[i].slot] = (unsigned char)(i + 1);
+}
+
+
+/* 
+ Moves the heap entry i up to its place. The 
+ parents it passes move down into the hole it
+ leaves, so it is copied once
+*/
+static void siftUp(struct topk *t, size_t i)
+{
+   struct topk_entry e = t->heap[i];
+
+   while(i > 0 && e.tokens < t->heap[(i - 1) / 2].tokens)
+   {
+      t->heap[i] = t->heap[(i - 1) / 2];
+      setPosition(t, i);
+      i = (i - 1) / 2;
+   }
+   t->heap[i] = e;
+   setPosition(t, i);
+}
+
+
+/* Moves the heap entry i down to its place */
+static void siftDown(struct topk *t, size_t i)
+{
+   struct topk_entry e = t->heap[i];
+   size_t c;
+
+   while((c = 2 * i + 1) < t->n)
+   {
+      if(c + 1 < t->n && t->heap[c + 1].tokens < t->heap[c].tokens)
+         c++;
+      if(e.tokens <= t->heap[c].tokens)
+         break;
+      t->heap[i] = t->heap[c];
+      setPosition(t, i);
+      i = c;
+   }
+   t->heap[i] = e;
+   setPosition(t, i);
+}
+
+
+/* Returns the heap position of k, -1 if k is not tracked */
+static long findKey(struct topk *t, unsigned int k)
+{
+   unsigned int s;
+
+   for(s=indexHash(k);t->index[s]!=0;s=(s + 1) & INDEX_MASK)
+   {
+      if(t->heap[t->index[s] - 1].key == k)
+         return t->index[s] - 1;
+   }
+
+   return -1;
+}
+
+
+/* Adds the key of the heap entry i to the index */
+static void indexKey(struct topk *t, size_t i)
+{
+   unsigned int s;
+
+   for(s=indexHash(t->heap[i].key);t->index[s]!=0;s=(s + 1) & INDEX_MASK)
+      ;
+   t->heap[i].slot = s;
+   setPosition(t, i);
+}
+
+
+/* 
+ Removes the key of the heap entry i from the 
+ index and shifts the keys after it back, so 
+ that no probe ends early
+*/
+static void unindexKey(struct topk *t, size_t i)
+{
+   unsigned int hole = t->heap[i].slot, s = hole, home;
+
+   t->index[hole] = 0;
+   while(1)
+   {
+      s = (s + 1) & INDEX_MASK;
+      if(t->index[s] == 0)
+         return;
+      home = indexHash(t->heap[t->index[s] - 1].key);
+      if(((s - home) & INDEX_MASK) >= ((s - hole) & INDEX_MASK))
+      {
+         t->index[hole] = t->index[s];
+         t->heap[t->index[s] - 1].slot = hole;
+         t->index[s] = 0;
+         hole = s;
+      }
+   }
+}
+
+
+/*
+ Allocates an empty summary on the NUMA node of
+ the calling thread. 
+ Returns a pointer to the summary, NULL on failure
+*/
+struct topk *newTopK(void)
+{
+   struct topk *t;
+
+   t = hugeAlloc(sizeof(struct topk), -1, NULL);
+   if(t == NULL)
+      return NULL;
+
+   memset(t, 0, sizeof(struct topk));
+   pthread_mutex_init(&t->lock, NULL);
+   return t;
+}
+
+
+/* Locks the summary t for a batch of topk_add() */
+void topk_begin(struct topk *t)
+{
+   pthread_mutex_lock(&t->lock);
+}
+
+
+/* Unlocks the summary t */
+void topk_end(struct topk *t)
+{
+   pthread_mutex_unlock(&t->lock);
+}
+
+
+/*
+ Counts a request of key k for cost tokens, 
+ denied if it was not allowed. A request for
+ no token only counts for a tracked key. A 
+ request rejected before its cost is known,
+ with a cost of -1, counts for no token. 
+ The summary must be locked with topk_begin()
+*/
+void topk_add(struct topk *t, unsigned int k, int cost, int denied)
+{
+   struct topk_entry *e;
+   long i;
+
+   if(cost < 0)
+      cost = 0;
+
+   i = findKey(t, k);
+   if(i >= 0)
+   {
+      e = &t->heap[i];
+      e->tokens += (unsigned long long) cost;
+      e->requests++;
+      e->denies += denied != 0;
+      siftDown(t, (size_t) i);
+      return;
+   }
+
+   if(t->n < TOPK_SLOTS)
+   {
+      i = (long) t->n++;
+      e = &t->heap[i];
+      e->error = 0;
+   }
+   else if(cost > 0)
+   {//the key with the fewest tokens makes room
+      i = 0;
+      e = &t->heap[0];
+      unindexKey(t, 0);
+      e->error = e->tokens;
+   }
+   else
+      return;
+
+   e->key = k;
+   e->tokens = e->error + (unsigned long long) cost;
+   e->requests = 1;
+   e->denies = denied != 0;
+   indexKey(t, (size_t) i);
+   if(i > 0)
+      siftUp(t, (size_t) i);
+   else
+      siftDown(t, (size_t) i);
+}
+
+
+/* 
+ Halves the counts of t, so that the keys that 
+ were heavy long ago give way to the current ones
+*/
+void topk_decay(struct topk *t)
+{
+   size_t i;
+
+   pthread_mutex_lock(&t->lock);
+   for(i=0;i<t->n;i++)
+   {//halving keeps the heap order
+      t->heap[i].tokens /= 2;
+      t->heap[i].error /= 2;
+      t->heap[i].requests /= 2;
+      t->heap[i].denies /= 2;
+   }
+   pthread_mutex_unlock(&t->lock);
+}
+
+
+/* 
+ Copies the tracked keys of t into out, which 
+ has room for TOPK_SLOTS entries. 
+ Returns the number of keys
+*/
+size_t topk_collect(struct topk *t, struct topk_entry *out)
+{
+   size_t n;
+
+   pthread_mutex_lock(&t->lock);
+   n = t->n;
+   memcpy(out, t->heap, n * sizeof(struct topk_entry));
+   pthread_mutex_unlock(&t->lock);
+
+   return n;
+}
+
+
+/* Orders entries by key */
+static int compareKeys(const void *a, const void *b)
+{
+   unsigned int x = ((const struct topk_entry *) a)->key;
+   unsigned int y = ((const struct topk_entry *) b)->key;
+
+   return (x > y) - (x < y);
+}
+
+
+/* Orders entries by tokens, the most first */
+static int compareTokens(const void *a, const void *b)
+{
+   unsigned long long x = ((const struct topk_entry *) a)->tokens;
+   unsigned long long y = ((const struct topk_entry *) b)->tokens;
+
+   return (x < y) - (x > y);
+}
+
+
+/* 
+ Merges the n entries e collected from several
+ summaries, adding up the counts of a key that 
+ is tracked by more than one, and orders them
+ by tokens, the most first. 
+ Returns the number of entries left
+*/
+size_t topk_merge(struct topk_entry *e, size_t n)
+{
+   size_t i, m=0;
+
+   if(n == 0)
+      return 0;
+
+   qsort(e, n, sizeof(struct topk_entry), compareKeys);
+   for(i=1;i<n;i++)
+   {
+      if(e[i].key == e[m].key)
+      {
+         e[m].tokens += e[i].tokens;
+         e[m].error += e[i].error;
+         e[m].requests += e[i].requests;
+         e[m].denies += e[i].denies;
+      }
+      else
+         e[++m] = e[i];
+   }
+
+   qsort(e, m + 1, sizeof(struct topk_entry), compareTokens);
+   return m + 1;
+}
@@ -0,0 +1,190 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the heavy hitter summary
+
+ Counts a stream of requests where a few heavy
+ keys take a given share of the requests and the
+ rest come from random keys, as in a flood from
+ spoofed addresses, in batches of BATCH_MAX like
+ the processing threads. Prints the time per 
+ request and checks that every heavy key is 
+ tracked with a count no lower than its true one
+ and no higher than that plus its error. 
+ Requests rejected with a cost of 0 or -1 are
+ then checked to count without adding tokens. 
+
+ Usage: topkbench [requests] [heavy keys] [heavy share %]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+#define DEFAULT_REQUESTS 10000000UL
+#define DEFAULT_HEAVY 10
+#define DEFAULT_SHARE 30
+
+
+/* splitmix64 pseudo random generator */
+static unsigned long long nextRandom(unsigned long long *s)
+{
+   unsigned long long z = (*s += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+
+/* 
+ Counts requests of cost 0 and -1, as rejected
+ by requestCost(), for a tracked and a new key.
+ Returns 1 if they are counted without tokens,
+ 0 otherwise
+*/
+static int checkRejected(void)
+{
+   struct topk_entry e[TOPK_SLOTS];
+   struct topk *t;
+   size_t n, k;
+   unsigned long long want;
+   unsigned int key;
+
+   t = newTopK();
+   if(t == NULL)
+      return 0;
+
+   topk_begin(t);
+   topk_add(t, 0x0A000001U, 3, 0);
+   topk_add(t, 0x0A000001U, -1, 1);
+   topk_add(t, 0x0A000001U, 0, 1);
+   topk_add(t, 0x0A000002U, -1, 1);
+   topk_add(t, 0x0A000002U, 2, 0);
+   topk_end(t);
+
+   n = topk_collect(t, e);
+   for(key=0x0A000001U;key<=0x0A000002U;key++)
+   {
+      want = key == 0x0A000001U ? 3 : 2;
+      for(k=0;k<n && e[k].key != key;k++)
+         ;
+      if(k == n || e[k].tokens != want || e[k].requests != (want == 3 ? 3UL : 2UL) ||
+         e[k].denies != (want == 3 ? 2UL : 1UL))
+      {
+         fprintf(stderr, "Rejected requests of key %u counted wrong: tokens %llu\n", 
+                 key, k == n ? 0ULL : e[k].tokens);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+   struct topk_entry e[TOPK_SLOTS];
+   unsigned long requests = DEFAULT_REQUESTS, heavy = DEFAULT_HEAVY, share = DEFAULT_SHARE;
+   unsigned long *counts, i, j;
+   unsigned long long seed = 2017, r, start, total=0;
+   unsigned int keys[BATCH_MAX];
+   int costs[BATCH_MAX];
+   struct topk *t;
+   size_t n, k;
+   double ns;
+
+   if(argc > 1)
+      requests = strtoul(argv[1], NULL, 10);
+   if(argc > 2)
+      heavy = strtoul(argv[2], NULL, 10);
+   if(argc > 3)
+      share = strtoul(argv[3], NULL, 10);
+
+   //each heavy key needs more than 1 / TOPK_SLOTS of the requests
+   if(requests == 0 || heavy == 0 || share > 100 || 
+      share * TOPK_SLOTS <= heavy * 100)
+   {
+       fprintf(stderr,"Usage: %s [requests] [heavy keys] [heavy share %%]\n", argv[0]);
+       fprintf(stderr,"The share of each heavy key must be above 1/%d\n", TOPK_SLOTS);
+       exit(EXIT_FAILURE);
+   }
+
+   counts = calloc(heavy, sizeof(*counts));
+   t = newTopK();
+   if(counts == NULL || t == NULL)
+      exit(EXIT_FAILURE);
+
+   for(i=0;i<requests;i+=BATCH_MAX)
+   {
+      for(j=0;j<BATCH_MAX;j++)
+      {
+         r = nextRandom(&seed);
+         if(r % 100 < share)
+         {//heavy keys are 10.0.0.1 and up
+            keys[j] = 0x0A000001U + (unsigned int)(r / 100 % heavy);
+            counts[r / 100 % heavy]++;
+         }
+         else
+            keys[j] = (unsigned int)(r >> 32) | 0x80000000U;
+         costs[j] = 1;
+      }
+
+      start = monotonicNow();
+      topk_begin(t);
+      for(j=0;j<BATCH_MAX;j++)
+         topk_add(t, keys[j], costs[j], j & 1);
+      topk_end(t);
+      total += monotonicNow() - start;
+   }
+   ns = (double) total / i;
+
+   n = topk_merge(e, topk_collect(t, e));
+   printf("%lu requests, %lu heavy keys with %lu%%: %.2f ns/request\n",
+          i, heavy, share, ns);
+
+   for(j=0;j<heavy;j++)
+   {
+      for(k=0;k<n && e[k].key != 0x0A000001U + j;k++)
+         ;
+      if(k == n || e[k].tokens < counts[j] || e[k].tokens - e[k].error > counts[j])
+      {
+         fprintf(stderr, "Heavy key %lu: true count %lu, %s\n", j, counts[j],
+                 k == n ? "not tracked" : "count out of bounds");
+         exit(EXIT_FAILURE);
+      }
+      if(k < 3 || j < 3)
+         printf("key %lu rank %zu count %llu error %llu true %lu\n", 
+                j, k + 1, e[k].tokens, e[k].error, counts[j]);
+   }
+
+   printf("all %lu heavy keys tracked\n", heavy);
+
+   if(!checkRejected())
+      exit(EXIT_FAILURE);
+   printf("rejected requests add no tokens\n");
+   return 0;
+}
@@ -0,0 +1,183 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Traces of the queries
+
+ The receiving threads append each query to the
+ trace with a single fwrite() of its record and
+ message, which the lock of the stdio stream 
+ keeps whole. The stream is buffered and flushed
+ by the update thread, so a server that is killed
+ loses at most the queries of its last interval. 
+ The admin queries are not recorded. 
+
+ replaybench reads the traces back with
+ readTraceHeader() and readTrace(). 
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+
+
+static FILE *trace;
+static unsigned long long tracestart;
+
+
+/* 
+ Creates the trace file path and writes its header. 
+ Returns 1 if successful, 0 otherwise
+*/
+int openTrace(const char *path)
+{
+   struct trace_header h;
+   struct timespec ts;
+
+   trace = fopen(path, "wb");
+   if(trace == NULL)
+   {
+      perror("Unable to create trace");
+      return 0;
+   }
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   memset(&h, 0, sizeof(h));
+   h.magic = TRACE_MAGIC;
+   h.version = TRACE_VERSION;
+   h.start = (unsigned long long) ts.tv_sec * NSEC_PER_SEC + (unsigned long long) ts.tv_nsec;
+   tracestart = monotonicNow();
+
+   if(fwrite(&h, sizeof(h), 1, trace) != 1)
+   {
+      perror("Unable to write trace");
+      fclose(trace);
+      trace = NULL;
+      return 0;
+   }
+
+   return 1;
+}
+
+
+/* Appends the query qt to the trace, if there is one */
+void traceRequest(const struct queue_item *qt)
+{
+   unsigned char buf[sizeof(struct trace_record) + MSGSZ];
+   struct trace_record r;
+   const struct sockaddr_in *in = (const struct sockaddr_in *) &qt->peer_addr;
+   const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &qt->peer_addr;
+   size_t len;
+
+   if(trace == NULL)
+      return;
+
+   memset(&r, 0, sizeof(r));
+   r.time = monotonicNow() - tracestart;
+   switch(qt->peer_addr.ss_family)
+   {
+      case AF_INET:
+         r.family = TRACE_PEER_IP4;
+         r.port = ntohs(in->sin_port);
+         memcpy(r.peer, &in->sin_addr, 4);
+         break;
+      case AF_INET6:
+         r.family = TRACE_PEER_IP6;
+         r.port = ntohs(in6->sin6_port);
+         memcpy(r.peer, &in6->sin6_addr, 16);
+         break;
+      default:
+         r.family = TRACE_PEER_UNIX;
+         break;
+   }
+
+   len = strlen(qt->msg);
+   if(len >= MSGSZ)
+      len = MSGSZ - 1;
+   r.len = (unsigned char) len;
+
+   memcpy(buf, &r, sizeof(r));
+   memcpy(buf + sizeof(r), qt->msg, len);
+   if(fwrite(buf, sizeof(r) + len, 1, trace) != 1)
+      perror("Unable to write trace");
+}
+
+
+/* Writes the buffered queries to the trace file */
+void flushTrace(void)
+{
+   if(trace != NULL)
+      fflush(trace);
+}
+
+
+/* 
+ Opens the trace file path for reading and 
+ reads its header into h. 
+ Returns the file, NULL on failure
+*/
+FILE *readTraceHeader(const char *path, struct trace_header *h)
+{
+   FILE *fp;
+
+   fp = fopen(path, "rb");
+   if(fp == NULL)
+   {
+      perror("Unable to open trace");
+      return NULL;
+   }
+
+   if(fread(h, sizeof(*h), 1, fp) != 1 || h->magic != TRACE_MAGIC ||
+      h->version != TRACE_VERSION)
+   {
+      fprintf(stderr, "%s is not a trace of this version\n", path);
+      fclose(fp);
+      return NULL;
+   }
+
+   return fp;
+}
+
+
+/* 
+ Reads the next query of the trace fp into r 
+ and its message into msg, of MSGSZ bytes. 
+ Returns 1 if successful, 0 at the end of the 
+ trace or if it is cut short
+*/
+int readTrace(FILE *fp, struct trace_record *r, char *msg)
+{
+   if(fread(r, sizeof(*r), 1, fp) != 1)
+      return 0;
+
+   if(r->len >= MSGSZ || fread(msg, 1, r->len, fp) != r->len)
+   {
+      fprintf(stderr, "Trace cut short\n");
+      return 0;
+   }
+
+   msg[r->len] = '\0';
+   return 1;
+}
@@ -0,0 +1,153 @@
+/*
+* MIT License
+*
+* Copyright (c) 2017 Ng Chiang Lin
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+/*
+ Benchmark of the unix datagram transport
+
+ Needs a server started with -u, e.g. 
+ tbserver -u /tmp/tbserver.sock. Sends requests
+ one at a time to the udp port on the loopback
+ interface and to the unix socket, and reports
+ the mean, median and 99th percentile of the 
+ round trips. 
+
+ Usage: unixbench [path] [requests]
+
+ Ng Chiang Lin
+ April 2017
+*/
+
+#include "ratelimit.h"
+#include <sys/un.h>
+
+
+#define DEFAULT_REQUESTS 100000UL
+#define BENCH_IP "198.18.0.1"
+
+
+/* Orders round trip times */
+static int compareTimes(const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a;
+   unsigned long long y = *(const unsigned long long *) b;
+
+   return (x > y) - (x < y);
+}
+
+
+/* 
+ Sends n requests on the connected socket sock
+ and prints the statistics of their round trips
+ into times. Returns 1 if successful, 0 otherwise
+*/
+static int runRequests(const char *name, int sock, unsigned long long *times, size_t n)
+{
+   char buf[BUFSZ];
+   unsigned long long start, total=0;
+   size_t i;
+
+   for(i=0;i<n;i++)
+   {
+      start = monotonicNow();
+      if(send(sock, BENCH_IP, sizeof(BENCH_IP), 0) == -1 ||
+         recv(sock, buf, sizeof(buf), 0) <= 0)
+      {
+         fprintf(stderr, "No answer on %s\n", name);
+         return 0;
+      }
+      times[i] = monotonicNow() - start;
+      total += times[i];
+   }
+
+   qsort(times, n, sizeof(*times), compareTimes);
+   printf("%-5s mean %8.2f us, median %8.2f us, p99 %8.2f us\n", name,
+          (double) total / n / 1000, (double) times[n / 2] / 1000,
+          (double) times[n - n / 100 - 1] / 1000);
+   return 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+   const char *path = "/tmp/tbserver.sock";
+   size_t requests = DEFAULT_REQUESTS;
+   unsigned long long *times;
+   struct sockaddr_in in;
+   struct sockaddr_un un, self;
+   struct timeval tv = { 1, 0 };
+   int udp, local, ok;
+
+   if(argc > 1)
+      path = argv[1];
+   if(argc > 2)
+      requests = strtoul(argv[2], NULL, 10);
+
+   if(requests == 0 || strlen(path) >= sizeof(un.sun_path))
+   {
+       fprintf(stderr,"Usage: %s [path] [requests]\n", argv[0]);
+       exit(EXIT_FAILURE);
+   }
+
+   times = calloc(requests, sizeof(*times));
+   udp = socket(AF_INET, SOCK_DGRAM, 0);
+   local = socket(AF_UNIX, SOCK_DGRAM, 0);
+   if(times == NULL || udp == -1 || local == -1)
+   {
+       fprintf(stderr,"Unable to create sockets\n");
+       exit(EXIT_FAILURE);
+   }
+
+   memset(&in, 0, sizeof(in));
+   in.sin_family = AF_INET;
+   in.sin_port = htons(3211);
+   in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   //the server replies to the path the client is bound to
+   memset(&self, 0, sizeof(self));
+   self.sun_family = AF_UNIX;
+   snprintf(self.sun_path, sizeof(self.sun_path), "/tmp/unixbench.%d", (int) getpid());
+   memset(&un, 0, sizeof(un));
+   un.sun_family = AF_UNIX;
+   strcpy(un.sun_path, path);
+
+   if(connect(udp, (struct sockaddr *) &in, sizeof(in)) == -1 ||
+      bind(local, (struct sockaddr *) &self, sizeof(self)) == -1 ||
+      connect(local, (struct sockaddr *) &un, sizeof(un)) == -1 ||
+      setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+      setsockopt(local, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+   {
+       perror("Socket error");
+       unlink(self.sun_path);
+       exit(EXIT_FAILURE);
+   }
+
+   ok = runRequests("udp", udp, times, requests) && 
+        runRequests("unix", local, times, requests);
+
+   unlink(self.sun_path);
+   close(udp);
+   close(local);
+   free(times);
+   return ok ? 0 : EXIT_FAILURE;
+}